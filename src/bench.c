@@ -0,0 +1,430 @@
+/*
+ * Host benchmarks for the file system, run against the fake block device.
+ *
+ * Usage: fsbench [-m <mkfs flags>] [-s <seed>] [<benchmark> ...]
+ *
+ * Each benchmark starts from a fresh file system and prints one JSON object
+ * per line: operations per second, latency percentiles in microseconds and
+ * device blocks read and written per operation. Device counts include a
+ * closing fs_sync, so deferred journal and write-back traffic is charged to
+ * the benchmark that caused it; setup before timing starts is not. With no
+ * names every benchmark runs; a name selects those it prefixes.
+ */
+#include "common.h"
+#include "block.h"
+#include "fs.h"
+#include "hostutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Most operations a benchmark times individually
+#define BENCH_MAX_OPS 4096
+
+// Files and directories made by the metadata benchmarks. Names are looked
+// up in the working directory only, and a directory holds at most 62
+// entries besides "." and ".."
+#define STORM_DIRS 6
+#define STORM_FILES 60
+#define DEEP_LEVELS 32
+#define LIST_FILES 60
+
+// Files written and read by the data benchmarks, each of the largest size
+// a file can have
+#define DATA_FILES 16
+#define DATA_FILE_SIZE (INODE_ADDRS * BLOCK_SIZE)
+#define RANDOM_OPS 1024
+
+typedef struct {
+    const char *name;
+    void (*setup)(int size); // Untimed and uncounted preparation, or NULL
+    void (*run)(int size);
+    int size; // Bytes moved by each operation, 0 if none
+} bench_t;
+
+static int mkfs_flags;
+static uint32_t rand_state;
+
+static int op_count;
+static int op_errors;
+static uint64_t op_start;
+static uint64_t op_times[BENCH_MAX_OPS];
+
+static char data_buf[DATA_FILE_SIZE];
+static int data_fds[DATA_FILES];
+
+/* Measurement ***************************************************************/
+
+static uint32_t bench_rand(void) {
+    return xorshift32(&rand_state);
+}
+
+static void op_begin(void) {
+    op_start = now_ns();
+}
+
+static void op_end(int result) {
+    if (op_count < BENCH_MAX_OPS) {
+        op_times[op_count++] = now_ns() - op_start;
+    }
+
+    // A benchmark whose operations fail measures nothing useful
+    if (result < 0) {
+        op_errors++;
+    }
+}
+
+static void bench_report(bench_t *bench, uint64_t elapsed, int reads,
+                         int writes) {
+    double seconds = elapsed / 1e9;
+
+    // Percentiles come from the sorted individual times
+    sort_times(op_times, op_count);
+    printf("{\"bench\":\"%s\",\"mkfs\":%d,\"size\":%d,\"ops\":%d,"
+           "\"errors\":%d,"
+           "\"seconds\":%.6f,\"ops_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+           "\"reads_per_op\":%.3f,\"writes_per_op\":%.3f}\n",
+           bench->name, mkfs_flags, bench->size, op_count, op_errors,
+           seconds,
+           (seconds > 0) ? op_count / seconds : 0.0,
+           percentile_us(op_times, op_count, 50),
+           percentile_us(op_times, op_count, 90),
+           percentile_us(op_times, op_count, 99),
+           percentile_us(op_times, op_count, 100), (double)reads / op_count,
+           (double)writes / op_count);
+    fflush(stdout);
+}
+
+/* Setup helpers *************************************************************/
+
+static void storm_enter(int dir) {
+    char name[MAX_FILE_NAME];
+
+    sprintf(name, "d%d", dir);
+    fs_cd(name);
+}
+
+static void make_storm(int size) {
+    int i, j;
+    char name[MAX_FILE_NAME];
+
+    for (i = 0; i < STORM_DIRS; i++) {
+        sprintf(name, "d%d", i);
+        fs_mkdir(name);
+        storm_enter(i);
+        for (j = 0; j < STORM_FILES; j++) {
+            sprintf(name, "f%d", j);
+            fs_close(fs_open(name, FS_O_RDWR));
+        }
+        fs_cd("..");
+    }
+}
+
+static void make_data_files(void) {
+    int i, fd;
+    char name[MAX_FILE_NAME];
+
+    for (i = 0; i < DATA_FILES; i++) {
+        sprintf(name, "data%d", i);
+        fd = fs_open(name, FS_O_RDWR);
+        fs_write(fd, data_buf, DATA_FILE_SIZE);
+        fs_close(fd);
+    }
+}
+
+static void open_data_files(int mode) {
+    int i;
+    char name[MAX_FILE_NAME];
+
+    make_data_files();
+    for (i = 0; i < DATA_FILES; i++) {
+        sprintf(name, "data%d", i);
+        data_fds[i] = fs_open(name, mode);
+    }
+}
+
+static void setup_readers(int size) {
+    open_data_files(FS_O_RDONLY);
+}
+
+static void setup_writers(int size) {
+    open_data_files(FS_O_RDWR);
+}
+
+static void close_data_files(void) {
+    int i;
+
+    for (i = 0; i < DATA_FILES; i++) {
+        fs_close(data_fds[i]);
+    }
+}
+
+/* Metadata benchmarks *******************************************************/
+
+static void make_storm_dirs(int size) {
+    int i;
+    char name[MAX_FILE_NAME];
+
+    for (i = 0; i < STORM_DIRS; i++) {
+        sprintf(name, "d%d", i);
+        fs_mkdir(name);
+    }
+}
+
+static void bench_create(int size) {
+    int i, j;
+    char name[MAX_FILE_NAME];
+
+    // Each operation creates an empty file
+    for (i = 0; i < STORM_DIRS; i++) {
+        storm_enter(i);
+        for (j = 0; j < STORM_FILES; j++) {
+            sprintf(name, "f%d", j);
+            op_begin();
+            op_end(fs_close(fs_open(name, FS_O_RDWR)));
+        }
+        fs_cd("..");
+    }
+}
+
+static void bench_stat(int size) {
+    int i, j;
+    char name[MAX_FILE_NAME];
+    fileStat st;
+
+    // Each operation looks up a file
+    for (i = 0; i < STORM_DIRS; i++) {
+        storm_enter(i);
+        for (j = 0; j < STORM_FILES; j++) {
+            sprintf(name, "f%d", j);
+            op_begin();
+            op_end(fs_stat(name, &st));
+        }
+        fs_cd("..");
+    }
+}
+
+static void bench_unlink(int size) {
+    int i, j;
+    char name[MAX_FILE_NAME];
+
+    // Each operation removes a file
+    for (i = 0; i < STORM_DIRS; i++) {
+        storm_enter(i);
+        for (j = 0; j < STORM_FILES; j++) {
+            sprintf(name, "f%d", j);
+            op_begin();
+            op_end(fs_unlink(name));
+        }
+        fs_cd("..");
+    }
+}
+
+static void make_deep(int size) {
+    int i;
+
+    // Build a chain of directories and a file at its bottom
+    for (i = 0; i < DEEP_LEVELS; i++) {
+        fs_mkdir("d");
+        fs_cd("d");
+    }
+    fs_close(fs_open("f", FS_O_RDWR));
+    for (i = 0; i < DEEP_LEVELS; i++) {
+        fs_cd("..");
+    }
+}
+
+static void bench_deep_lookup(int size) {
+    int i, j;
+    int result;
+    fileStat st;
+
+    // Each operation walks from the top of the chain down to the file,
+    // one directory at a time, and looks it up
+    for (i = 0; i < 1000; i++) {
+        op_begin();
+        result = SUCCESS;
+        for (j = 0; j < DEEP_LEVELS; j++) {
+            result |= fs_cd("d");
+        }
+        result |= fs_stat("f", &st);
+        op_end(result);
+        for (j = 0; j < DEEP_LEVELS; j++) {
+            fs_cd("..");
+        }
+    }
+}
+
+static void make_listing(int size) {
+    int i;
+    char name[MAX_FILE_NAME + 1];
+
+    fs_mkdir("big");
+    fs_cd("big");
+    for (i = 0; i < LIST_FILES; i++) {
+        sprintf(name, "file%d", i);
+        fs_close(fs_open(name, FS_O_RDWR));
+    }
+}
+
+static void bench_listing(int size) {
+    int i, j;
+    char name[MAX_FILE_NAME + 1];
+
+    // Each operation lists every entry of the directory
+    for (i = 0; i < 200; i++) {
+        op_begin();
+        for (j = 0; fs_ls_one(j, name) == SUCCESS; j++) {
+        }
+        op_end((j >= LIST_FILES) ? SUCCESS : FAILURE);
+    }
+}
+
+/* Data benchmarks ***********************************************************/
+
+static void bench_seq_write(int size) {
+    int i, j, fd;
+    char name[MAX_FILE_NAME];
+
+    // Each operation appends size bytes to a new file
+    for (i = 0; i < DATA_FILES; i++) {
+        sprintf(name, "data%d", i);
+        fd = fs_open(name, FS_O_RDWR);
+        for (j = 0; j < DATA_FILE_SIZE; j += size) {
+            op_begin();
+            op_end(fs_write(fd, data_buf + j, size));
+        }
+        fs_close(fd);
+    }
+}
+
+static void bench_seq_read(int size) {
+    int i, j;
+
+    // Each operation reads the next size bytes of a file
+    for (i = 0; i < DATA_FILES; i++) {
+        for (j = 0; j < DATA_FILE_SIZE; j += size) {
+            op_begin();
+            op_end(fs_read(data_fds[i], data_buf, size));
+        }
+    }
+    close_data_files();
+}
+
+static void bench_random_read(int size) {
+    int i;
+
+    // Each operation reads size bytes at an aligned random place
+    for (i = 0; i < RANDOM_OPS; i++) {
+        op_begin();
+        op_end(fs_pread(data_fds[bench_rand() % DATA_FILES], data_buf, size,
+                        bench_rand() % (DATA_FILE_SIZE / size) * size));
+    }
+    close_data_files();
+}
+
+static void bench_random_write(int size) {
+    int i;
+
+    // Each operation overwrites size bytes at an aligned random place
+    for (i = 0; i < RANDOM_OPS; i++) {
+        op_begin();
+        op_end(fs_pwrite(data_fds[bench_rand() % DATA_FILES], data_buf,
+                         size, bench_rand() % (DATA_FILE_SIZE / size) * size));
+    }
+    close_data_files();
+}
+
+/* Driver ********************************************************************/
+
+static bench_t benches[] = {
+    {"create", make_storm_dirs, bench_create, 0},
+    {"stat", make_storm, bench_stat, 0},
+    {"unlink", make_storm, bench_unlink, 0},
+    {"deep-lookup", make_deep, bench_deep_lookup, 0},
+    {"listing", make_listing, bench_listing, 0},
+    {"seq-write-64", NULL, bench_seq_write, 64},
+    {"seq-write-512", NULL, bench_seq_write, 512},
+    {"seq-write-4096", NULL, bench_seq_write, 4096},
+    {"seq-read-64", setup_readers, bench_seq_read, 64},
+    {"seq-read-512", setup_readers, bench_seq_read, 512},
+    {"seq-read-4096", setup_readers, bench_seq_read, 4096},
+    {"rand-read-64", setup_readers, bench_random_read, 64},
+    {"rand-read-512", setup_readers, bench_random_read, 512},
+    {"rand-write-64", setup_writers, bench_random_write, 64},
+    {"rand-write-512", setup_writers, bench_random_write, 512},
+};
+
+#define BENCH_COUNT (sizeof(benches) / sizeof(benches[0]))
+
+static void bench_run(bench_t *bench, uint32_t seed) {
+    uint64_t start;
+    uint64_t elapsed;
+    int reads, writes;
+    int end_reads, end_writes;
+    int transfers;
+
+    // Start from a fresh file system, with setup I/O left uncounted
+    fs_mkfs(mkfs_flags);
+    if (bench->setup != NULL) {
+        bench->setup(bench->size);
+    }
+    fs_sync();
+    rand_state = seed;
+    op_count = 0;
+    op_errors = 0;
+    op_times[0] = 0;
+    block_counts(&reads, &writes, &transfers);
+    start = now_ns();
+    bench->run(bench->size);
+
+    // Charge deferred journal and write-back traffic to the benchmark
+    fs_sync();
+    elapsed = now_ns() - start;
+    block_counts(&end_reads, &end_writes, &transfers);
+    bench_report(bench, elapsed, end_reads - reads, end_writes - writes);
+}
+
+int main(int argc, char **argv) {
+    int i, j;
+    int named = 0;
+    uint32_t seed = 318;
+
+    // Parse options, leaving benchmark names in place
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && i + 1 < argc &&
+            (argv[i][1] == 'm' || argv[i][1] == 's')) {
+            if (argv[i][1] == 'm') {
+                mkfs_flags = atoi(argv[i + 1]);
+            } else {
+                seed = atoi(argv[i + 1]);
+            }
+            argv[i] = argv[i + 1] = NULL;
+            i++;
+        } else {
+            named++;
+        }
+    }
+    if (seed == 0) {
+        seed = 318;
+    }
+
+    // Every benchmark writes the same pattern
+    for (i = 0; i < DATA_FILE_SIZE; i++) {
+        data_buf[i] = 'a' + i % 26;
+    }
+    fs_init();
+    for (j = 0; j < BENCH_COUNT; j++) {
+        for (i = 1; i < argc; i++) {
+            if (argv[i] != NULL && prefix_of(argv[i], benches[j].name)) {
+                break;
+            }
+        }
+        if (named == 0 || i < argc) {
+            bench_run(&benches[j], seed);
+        }
+    }
+
+    return 0;
+}
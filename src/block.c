@@ -3,11 +3,88 @@
 #include "util.h"
 #include "block.h"
 #include "usb.h"
+#include "interrupt.h"
 
 #define START_SECTOR (MAX_IMAGE_SIZE/SECTOR_SIZE)
 
+static int blocks_read, blocks_written;
+
+/* Block request trace, see block.h */
+int (*block_trace_call)(void);
+
+static block_trace_t trace_ring[BLOCK_TRACE_ENTRIES];
+static int trace_count;	/* records waiting in the ring */
+static int trace_total;	/* records since tracing started */
+static bool_t tracing;
+
+void write_serial(int character);
+
+static void trace_put( char *s) {
+    while ( *s != 0)
+	write_serial( *s++);
+}
+
+static void trace_flush( void) {
+    block_trace_t *t;
+    char s[12];
+    int i;
+
+    for ( i = 0; i < trace_count; i++) {
+	t = &trace_ring[i];
+	itoa( t->time, s); trace_put( s);
+	write_serial( ' '); write_serial( t->op); write_serial( ' ');
+	itoa( t->block, s); trace_put( s); write_serial( ' ');
+	itoa( t->count, s); trace_put( s); write_serial( ' ');
+	itoa( t->call, s); trace_put( s); write_serial( '\n');
+    }
+    trace_count = 0;
+}
+
+static void trace_record( char op, int block, int count) {
+    block_trace_t *t;
+
+    if ( !tracing)
+	return;
+
+    /* Threads share the ring */
+    enter_critical();
+    if ( trace_count == BLOCK_TRACE_ENTRIES)
+	trace_flush();
+    t = &trace_ring[trace_count++];
+    t->time = ( get_timer() >> 10) & 0x7fffffff;
+    t->op = op;
+    t->call = block_trace_call ? block_trace_call() : FS_IO_OTHER;
+    t->count = count;
+    t->block = block;
+    trace_total++;
+    leave_critical();
+}
+
+void block_trace_start( void) {
+    enter_critical();
+    trace_count = trace_total = 0;
+    tracing = TRUE;
+    leave_critical();
+}
+
+int block_trace_stop( void) {
+    enter_critical();
+    trace_flush();
+    tracing = FALSE;
+    leave_critical();
+    return trace_total;
+}
+
 void block_init( void) {
     ASSERT( BLOCK_SIZE == SECTOR_SIZE );
+    blocks_read = blocks_written = 0;
+}
+
+/* Each block is its own transfer to the USB device */
+void block_counts( int *reads, int *writes, int *transfers) {
+    *reads = blocks_read;
+    *writes = blocks_written;
+    *transfers = blocks_read + blocks_written;
 }
 
 void block_read( int block, char *mem) {
@@ -15,6 +92,8 @@ void block_read( int block, char *mem) {
 	dprint("BUG READ?");
 	print_int(0,0, block);
     }
+    blocks_read++;
+    trace_record( BLOCK_TRACE_READ, block, 1);
     read(START_SECTOR+block, mem);
 }
 
@@ -22,9 +101,25 @@ void block_write( int block, char *mem) {
     if (block < 0 || block > 1024 * 2) {
 	dprint("BUG WRITE?");
     }
+    blocks_written++;
+    trace_record( BLOCK_TRACE_WRITE, block, 1);
     write(START_SECTOR+block, mem);
 }
 
+void block_read_many( int block, int count, char *mem) {
+    int i;
+
+    for ( i = 0; i < count; i++)
+	block_read( block + i, mem + i * BLOCK_SIZE);
+}
+
+void block_write_many( int block, int count, char *mem) {
+    int i;
+
+    for ( i = 0; i < count; i++)
+	block_write( block + i, mem + i * BLOCK_SIZE);
+}
+
 void bzero_block( char *block) {
     int i;
 
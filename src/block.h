@@ -12,5 +12,51 @@ void bzero_block(char *block);
 void block_init(void);
 void block_read(int block, char *mem);
 void block_write(int block, char *mem);
+void block_read_many(int block, int count, char *mem);
+void block_write_many(int block, int count, char *mem);
+
+/* Blocks read and written, and transfers made, since block_init */
+void block_counts(int *reads, int *writes, int *transfers);
+
+/* Trace of block requests. While tracing, every request is recorded in a
+ * ring of BLOCK_TRACE_ENTRIES, which is streamed out whenever it fills and
+ * when tracing stops: to the serial port in the kernel, and to
+ * BLOCK_TRACE_FILE in lnxsh. Each record is written as one line,
+ * "<time> <R|W> <block> <count> <call>", where time is in units of 2^10
+ * timestamp counter cycles in the kernel and microseconds in lnxsh, and
+ * call is the FS_IO_* file system call that made the request. */
+#define BLOCK_TRACE_ENTRIES 64
+#define BLOCK_TRACE_FILE "disk.trace"
+#define BLOCK_TRACE_READ 'R'
+#define BLOCK_TRACE_WRITE 'W'
+
+typedef struct {
+    uint32_t time;
+    char op;        /* BLOCK_TRACE_READ or BLOCK_TRACE_WRITE */
+    char call;      /* FS_IO_* */
+    short count;    /* blocks, starting at block */
+    int block;
+} block_trace_t;
+
+/* Set by the file system: the FS_IO_* call running on this thread */
+extern int (*block_trace_call)(void);
+
+void block_trace_start(void);
+int block_trace_stop(void); /* Requests recorded since the start */
+
+/* Page frames lent to the file system's block cache. The kernel takes them
+ * from the pageable pool in memory.c, so cached blocks and process pages
+ * share one replacement policy; the fake device keeps a small pool. Pinned
+ * frames are never asked back. */
+#define PAGE_CACHE_FRAME_SIZE 4096
+
+char *page_cache_alloc(bool_t pinned); /* NULL if no frame can be spared */
+void page_cache_free(char *frame);
+void page_cache_touch(char *frame); /* Frame was used, keep it longer */
+int page_cache_pressure(void); /* Frames the pool wants back */
+
+/* Contiguous frames pinned for good, for tables too large for the kernel
+ * image, which must stay below the V86 area usb.c reserves. Boot only. */
+char *page_static_alloc(int frames);
 
 #endif
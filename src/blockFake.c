@@ -1,9 +1,73 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <assert.h>
+#include <sys/time.h>
 #include "common.h"
 #include "block.h"
+#include "util.h"
 
 static FILE *fd;
+static int blocks_read, blocks_written, transfers;
+
+/* Block request trace, see block.h */
+int (*block_trace_call)(void);
+
+static block_trace_t trace_ring[BLOCK_TRACE_ENTRIES];
+static int trace_count;	/* records waiting in the ring */
+static int trace_total;	/* records since tracing started */
+static FILE *trace_file;
+
+static void
+trace_flush( void) {
+    block_trace_t *t;
+    int i;
+
+    for ( i = 0; i < trace_count; i++) {
+	t = &trace_ring[i];
+	fprintf( trace_file, "%u %c %d %d %d\n", t->time, t->op, t->block,
+		 t->count, t->call);
+    }
+    trace_count = 0;
+}
+
+static void
+trace_record( char op, int block, int count) {
+    block_trace_t *t;
+    struct timeval now;
+
+    if ( trace_file == NULL)
+	return;
+
+    if ( trace_count == BLOCK_TRACE_ENTRIES)
+	trace_flush();
+    gettimeofday( &now, NULL);
+    t = &trace_ring[trace_count++];
+    t->time = now.tv_sec * 1000000 + now.tv_usec;
+    t->op = op;
+    t->call = block_trace_call ? block_trace_call() : FS_IO_OTHER;
+    t->count = count;
+    t->block = block;
+    trace_total++;
+}
+
+void
+block_trace_start( void) {
+    if ( trace_file != NULL)
+	fclose( trace_file);
+    trace_file = fopen( BLOCK_TRACE_FILE, "w");
+    assert( trace_file);
+    trace_count = trace_total = 0;
+}
+
+int
+block_trace_stop( void) {
+    if ( trace_file != NULL) {
+	trace_flush();
+	fclose( trace_file);
+	trace_file = NULL;
+    }
+    return trace_total;
+}
 
 #include <errno.h>
 
@@ -18,12 +82,24 @@ block_init( void) {
 
     ret = fseek( fd, 0, SEEK_SET);
     assert( ret == 0);
+
+    blocks_read = blocks_written = transfers = 0;
+}
+
+void
+block_counts( int *reads, int *writes, int *transfers_made) {
+    *reads = blocks_read;
+    *writes = blocks_written;
+    *transfers_made = transfers;
 }
 
 void 
 block_read( int block, char *mem) {
     int ret;
 
+    blocks_read++;
+    transfers++;
+    trace_record( BLOCK_TRACE_READ, block, 1);
     ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
     assert( ret == 0);
     
@@ -38,7 +114,10 @@ block_read( int block, char *mem) {
 void 
 block_write( int block, char *mem) {
     int ret;
-    
+
+    blocks_written++;
+    transfers++;
+    trace_record( BLOCK_TRACE_WRITE, block, 1);
     ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
     assert( ret == 0);
     
@@ -46,6 +125,35 @@ block_write( int block, char *mem) {
     assert( ret == BLOCK_SIZE);
 }
 
+void 
+block_read_many( int block, int count, char *mem) {
+    int ret;
+
+    blocks_read += count;
+    transfers++;
+    trace_record( BLOCK_TRACE_READ, block, count);
+    ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
+    assert( ret == 0);
+
+    ret = fread( mem, 1, count * BLOCK_SIZE, fd);
+    /* Blocks past end of file read as zeros */
+    bzero( mem + ret, count * BLOCK_SIZE - ret);
+}
+
+void 
+block_write_many( int block, int count, char *mem) {
+    int ret;
+
+    blocks_written += count;
+    transfers++;
+    trace_record( BLOCK_TRACE_WRITE, block, count);
+    ret = fseek( fd, block * BLOCK_SIZE, SEEK_SET);
+    assert( ret == 0);
+    
+    ret = fwrite( mem, 1, count * BLOCK_SIZE, fd);
+    assert( ret == count * BLOCK_SIZE);
+}
+
 void
 bzero_block( char *block) {
     int i;
@@ -54,3 +162,48 @@ bzero_block( char *block) {
 	block[i] = 0;
 }
 
+/* Frames lent to the block cache. There is no virtual memory system here
+ * competing for them, so the pool never asks for frames back. */
+#define FAKE_CACHE_FRAMES 24
+
+static char cache_frames[FAKE_CACHE_FRAMES][PAGE_CACHE_FRAME_SIZE];
+static int cache_frame_used[FAKE_CACHE_FRAMES];
+
+char *
+page_cache_alloc( bool_t pinned) {
+    int i;
+
+    for ( i = 0; i < FAKE_CACHE_FRAMES; i++) {
+	if ( !cache_frame_used[i]) {
+	    cache_frame_used[i] = 1;
+	    return cache_frames[i];
+	}
+    }
+    return NULL;
+}
+
+void
+page_cache_free( char *frame) {
+    int i;
+
+    for ( i = 0; i < FAKE_CACHE_FRAMES; i++)
+	if ( frame == cache_frames[i])
+	    cache_frame_used[i] = 0;
+}
+
+void
+page_cache_touch( char *frame) {
+}
+
+int
+page_cache_pressure( void) {
+    return 0;
+}
+
+char *
+page_static_alloc( int frames) {
+    char *mem = calloc( frames, PAGE_CACHE_FRAME_SIZE);
+
+    assert( mem != NULL);
+    return mem;
+}
@@ -47,7 +47,29 @@ enum {
 	SYSCALL_READDIR,  /* 25 */
 	SYSCALL_LOADPROC,
 	SYSCALL_WRITE_SERIAL,
-	SYSCALL_COUNT
+	SYSCALL_PREAD,
+	SYSCALL_PWRITE,
+	SYSCALL_READV,   /* 30 */
+	SYSCALL_WRITEV,
+	SYSCALL_SYNC,
+	SYSCALL_FSYNC,
+	SYSCALL_FDATASYNC,
+	SYSCALL_MOUNT,   /* 35 */
+	SYSCALL_CLONE,
+	SYSCALL_SNAPSHOT,
+	SYSCALL_DEDUP_STAT,
+	SYSCALL_CHECKSUM_STAT,
+	SYSCALL_MMAP,   /* 40 */
+	SYSCALL_MUNMAP,
+	SYSCALL_TRUNCATE,
+	SYSCALL_FALLOCATE,
+	SYSCALL_LOCK_STAT,
+	SYSCALL_LOCKF,   /* 45 */
+	SYSCALL_RING_ENTER,
+	SYSCALL_ADVISE,
+	SYSCALL_IO_STAT,
+	SYSCALL_TRACE,
+	SYSCALL_COUNT    /* 50 */
 };
 
 
@@ -108,6 +130,27 @@ typedef unsigned long ulong_t;
 #define FS_O_WRONLY 2
 #define FS_O_RDWR 3
 
+#define FS_MKFS_LOG 1
+#define FS_MKFS_DEDUP 2
+#define FS_MKFS_COMPRESS 4
+#define FS_MKFS_CHECKSUM 8
+#define FS_MKFS_CHECKSUM_DATA 16
+
+#define FS_MOUNT_WRITE_THROUGH 0
+#define FS_MOUNT_WRITE_BACK 1
+#define FS_MOUNT_PRELOAD 2
+
+#define FS_F_ULOCK 0
+#define FS_F_LOCK 1
+#define FS_F_TLOCK 2
+#define FS_F_TEST 3
+
+#define FS_ADV_NORMAL 0
+#define FS_ADV_RANDOM 1
+#define FS_ADV_SEQUENTIAL 2
+#define FS_ADV_WILLNEED 3
+#define FS_ADV_DONTNEED 4
+
 typedef struct {
     // Fill in your stat here, this is just an example
     int inodeNo;        /* the file i-node number */
@@ -119,6 +162,147 @@ typedef struct {
     int numBlocks;      /* number of blocks used by the file */
 } fileStat;
 
+/*	Counters kept by a file system made with FS_MKFS_DEDUP */
+typedef struct {
+    int blocksWritten;  /* file data blocks written */
+    int blocksShared;   /* writes replaced by a reference to an identical
+    					   block already on disk */
+    int indexProbes;    /* hash index slots examined by lookups */
+    int compareReads;   /* candidate blocks compared byte by byte */
+} dedupStat;
+
+/*	Counters kept by a file system made with FS_MKFS_CHECKSUM, and the
+	cycle counts measured when fs_checksum_stat is asked to benchmark */
+typedef struct {
+    int hardware;       /* computed with the SSE4.2 crc32 instruction? */
+    int blocksSummed;   /* checksums computed for blocks being written */
+    int blocksVerified; /* blocks read from disk and checked */
+    int mismatches;     /* blocks whose contents did not match */
+    int damaged;        /* file blocks the last fsck left failing checks */
+    int hwCycles;       /* per block with the crc32 instruction, 0 if none */
+    int tableCycles;    /* per block with the lookup table */
+    int readCycles;     /* per block read from disk */
+} csumStat;
+
+/*	Classes of file system lock, in the order they are acquired */
+#define FS_LOCK_TXN 0       /* journal group; exclusive to commit */
+#define FS_LOCK_NAMESPACE 1 /* directory tree and working directory */
+#define FS_LOCK_INODE 2     /* one file's inode and data */
+#define FS_LOCK_RANGE 3     /* byte ranges read or written in place */
+#define FS_LOCK_CLUSTER 4   /* compressed cluster buffers */
+#define FS_LOCK_FD 5        /* file descriptor table pool */
+#define FS_LOCK_ALLOC 6     /* block and inode allocation, dedup index */
+#define FS_LOCK_CACHE 7     /* block cache, journal and checksum table */
+#define FS_LOCK_CLASSES 8
+
+/*	Counters kept for each class of file system lock (fs_lock_stat).
+	Times are in units of 2^10 timestamp counter cycles */
+typedef struct {
+    int acquires;       /* times a lock of the class was taken */
+    int contended;      /* times the taker had to wait for it */
+    int waitTime;       /* total time spent waiting */
+    int holdTime;       /* total time held */
+    int maxHold;        /* longest single hold */
+} lockStat;
+
+/*	File system calls counted by fs_io_stat, one per call that does I/O.
+	FS_IO_OTHER gathers device traffic outside any call, such as fs_init
+	and closing files at process exit; FS_IO_DEVICE is the block device's
+	own total */
+#define FS_IO_MKFS 0
+#define FS_IO_FSCK 1
+#define FS_IO_MOUNT 2
+#define FS_IO_OPEN 3
+#define FS_IO_CLOSE 4
+#define FS_IO_DUP 5
+#define FS_IO_READ 6
+#define FS_IO_WRITE 7
+#define FS_IO_PREAD 8
+#define FS_IO_PWRITE 9
+#define FS_IO_READV 10
+#define FS_IO_WRITEV 11
+#define FS_IO_LSEEK 12
+#define FS_IO_ADVISE 13
+#define FS_IO_LOCKF 14
+#define FS_IO_TRUNCATE 15
+#define FS_IO_FALLOCATE 16
+#define FS_IO_MKDIR 17
+#define FS_IO_RMDIR 18
+#define FS_IO_CD 19
+#define FS_IO_LINK 20
+#define FS_IO_CLONE 21
+#define FS_IO_SNAPSHOT 22
+#define FS_IO_UNLINK 23
+#define FS_IO_STAT 24
+#define FS_IO_LS 25
+#define FS_IO_SYNC 26
+#define FS_IO_FSYNC 27
+#define FS_IO_FDATASYNC 28
+#define FS_IO_RECLAIM 29
+#define FS_IO_OTHER 30
+#define FS_IO_DEVICE 31
+#define FS_IO_CLASSES 32
+
+/*	Work done by each file system call (fs_io_stat). For FS_IO_DEVICE,
+	calls counts device transfers */
+typedef struct {
+    int calls;          /* times the call was made */
+    int blocksRead;     /* blocks read from the device */
+    int blocksWritten;  /* blocks written to the device */
+    int cacheHits;      /* blocks served from memory instead */
+    int bytesCopied;    /* file data copied to or from the caller */
+} ioStat;
+
+/*	One buffer of a vectored read or write (fs_readv, fs_writev) */
+#define MAX_IOV_COUNT 16
+
+typedef struct {
+    char *base;         /* start of the buffer */
+    int len;            /* length of the buffer in bytes */
+} iovec_t;
+
+/*	Submission and completion ring shared by a process and fs_ring_enter.
+	The process fills sq[sq_tail % FS_RING_ENTRIES] and advances sq_tail;
+	fs_ring_enter runs queued entries in order, advancing sq_head and
+	posting to cq[cq_tail % FS_RING_ENTRIES]; the process reaps from cq_head.
+	Indices only ever grow, wrapping around together */
+#define FS_RING_ENTRIES 16
+
+#define FS_RING_READ 0      /* fs_read(fd, buf, len) */
+#define FS_RING_WRITE 1     /* fs_write(fd, buf, len) */
+#define FS_RING_OPEN 2      /* fs_open(name, len) */
+#define FS_RING_STAT 3      /* fs_stat(name, (fileStat *) buf) */
+#define FS_RING_CLOSE 4     /* fs_close(fd) */
+
+typedef struct {
+    int op;             /* one of FS_RING_* */
+    int fd;             /* file read, written or closed */
+    char *name;         /* file opened or stat'ed */
+    char *buf;          /* data read or written, or the fileStat filled */
+    int len;            /* bytes read or written, or flags opened with */
+    int user;           /* passed through to the completion */
+} fs_sqe_t;
+
+typedef struct {
+    int user;           /* from the submission */
+    int result;         /* what the call returned */
+} fs_cqe_t;
+
+typedef struct {
+    uint32_t sq_head;   /* next submission to run (fs_ring_enter) */
+    uint32_t sq_tail;   /* next submission slot to fill (process) */
+    fs_sqe_t sq[FS_RING_ENTRIES];
+    uint32_t cq_head;   /* next completion to reap (process) */
+    uint32_t cq_tail;   /* next completion slot to post (fs_ring_enter) */
+    fs_cqe_t cq[FS_RING_ENTRIES];
+} fs_ring_t;
+
+/*	File system state of a process, kept in its pcb (fs.c) */
+typedef struct {
+    struct fd_table *files; /* open files, NULL until the first open */
+    int wdir;           /* inode of the working directory */
+} fs_proc_t;
+
 /*	Note that this struct only allocates space for the size element.
 
 	To use a message with a body of 50 bytes we must first allocate space for 
@@ -29,375 +29,4482 @@ static void str_copy(char *src, char *dest) {
     bcopy((unsigned char *)src, (unsigned char *)dest, strlen(src) + 1);
 }
 
-/* Super block ***************************************************************/
+// What is left of the frames the large tables are carved from
+static char *static_next;
+static int static_room;
+
+static void *static_alloc(int bytes) {
+    char *table;
+    int frames;
+
+    // Carve the table from the last frames pinned, or pin more
+    bytes = (bytes + sizeof(int) - 1) & ~(sizeof(int) - 1);
+    if (bytes > static_room) {
+        frames = ceil_div(bytes, PAGE_CACHE_FRAME_SIZE);
+        static_next = page_static_alloc(frames);
+        static_room = frames * PAGE_CACHE_FRAME_SIZE;
+    }
+    table = static_next;
+    static_next += bytes;
+    static_room -= bytes;
 
-static sblock_t *sblock;
-static char sblock_buf[BLOCK_SIZE];
+    return table;
+}
 
-static void sblock_init(sblock_t *sblock) {
-    sblock->fs_size = FS_SIZE;
+static bool_t same_block(char *block1, char *block2) {
+    int i;
 
-    sblock->inode_start = SUPER_BLOCK + 1;
-    sblock->inode_count = MAX_FILE_COUNT;
-    sblock->inode_blocks = ceil_div(MAX_FILE_COUNT, BLOCK_SIZE/sizeof(inode_t));
-    
-    sblock->bamap_start = sblock->inode_start + sblock->inode_blocks;
-    sblock->bamap_blocks = ceil_div(MAX_FILE_COUNT*sizeof(uint8_t), BLOCK_SIZE);
-    
-    sblock->data_start = sblock->bamap_start + sblock->bamap_blocks;
-    sblock->data_blocks = MAX_FILE_COUNT;
+    for (i = 0; i < BLOCK_SIZE; i++) {
+        if (block1[i] != block2[i]) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
 }
 
-static sblock_t *sblock_read(char *block_buf) {
-    block_read(SUPER_BLOCK, block_buf);
-    return (sblock_t *)block_buf;
+/* Locking *******************************************************************/
+
+// The block cache, journal, checksum table and superblock
+static fs_lock_t cache_lock;
+
+// The allocation maps, orphan list and dedup index
+static fs_lock_t alloc_lock;
+
+// The buffers compressed clusters are expanded into
+static fs_lock_t cluster_lock;
+
+// Operations share the journal group; commits and repairs need it alone
+static fs_rwlock_t txn_lock;
+
+// The pool of descriptor tables processes take their tables from
+static fs_lock_t fd_lock;
+
+// Lookups share the directory tree; changes to it need it alone
+static fs_rwlock_t ns_lock;
+
+// Each inode is guarded by the lock its number hashes onto
+static fs_rwlock_t *inode_locks;
+
+// Byte ranges held by operations in progress, and record locks held by
+// processes, with the unused record locks
+static range_lock_t *op_ranges;
+static range_lock_t *record_ranges;
+static range_lock_t *record_free;
+static range_lock_t *record_locks;
+#ifndef FAKE
+static lock_t ranges_mutex;
+static condition_t ranges_changed;
+#endif
+
+// Operation each thread is running, innermost first
+static op_scope_t **op_scopes;
+
+static lockStat lock_stats[FS_LOCK_CLASSES];
+#ifndef FAKE
+static int lock_stats_spinlock;
+#endif
+
+static int lock_self(void) {
+#ifdef FAKE
+    return 0;
+#else
+    return current_running - pcb;
+#endif
 }
 
-static void sblock_write(char *block_buf) {
-    block_write(SUPER_BLOCK, block_buf);
+static int lock_time(uint64_t start, uint64_t end) {
+    return (int)((end - start) >> LOCK_TIME_SHIFT);
 }
 
-/* Block allocation map ******************************************************/
+static void lock_count_acquire(int class, uint64_t asked, uint64_t got,
+                               bool_t waited) {
+    lockStat *stat = &lock_stats[class];
 
-static int bamap_block(int index) {
-    return sblock->bamap_start + (index * sizeof(uint8_t) / BLOCK_SIZE);
+    // Shared holders update the counters together
+#ifndef FAKE
+    spinlock_acquire(&lock_stats_spinlock);
+#endif
+    stat->acquires++;
+    if (waited) {
+        stat->contended++;
+        stat->waitTime += lock_time(asked, got);
+    }
+#ifndef FAKE
+    spinlock_release(&lock_stats_spinlock);
+#endif
 }
 
-static uint8_t *bamap_read(int index, char *block_buf) {
-    block_read(bamap_block(index), block_buf);
-    return (uint8_t *)&block_buf[index % BLOCK_SIZE];
-}
+static void lock_count_release(int class, uint64_t since) {
+    lockStat *stat = &lock_stats[class];
+    int held = lock_time(since, get_timer());
 
-static void bamap_write(int index, char *block_buf) {
-    block_write(bamap_block(index), block_buf);
+#ifndef FAKE
+    spinlock_acquire(&lock_stats_spinlock);
+#endif
+    stat->holdTime += held;
+    if (held > stat->maxHold) {
+        stat->maxHold = held;
+    }
+#ifndef FAKE
+    spinlock_release(&lock_stats_spinlock);
+#endif
 }
 
-static int block_alloc(void) {
-    int i, j;
-    char block_buf[BLOCK_SIZE];
+static void mutex_init(fs_lock_t *l, int class) {
+#ifndef FAKE
+    lock_init(&l->lock);
+#endif
+    l->owner = FAILURE;
+    l->depth = 0;
+    l->class = class;
+}
 
-    // Search for flag indicating free block
-    for (i = 0; i < sblock->bamap_blocks; i++) {
-        block_read(sblock->bamap_start + i, block_buf);
-        for (j = 0; j < BLOCK_SIZE; j++) {
-            if (!block_buf[j]) {
-                // Mark block as used on disk
-                block_buf[j] = TRUE;
-                block_write(sblock->bamap_start + i, block_buf);
+static void mutex_acquire(fs_lock_t *l) {
+    uint64_t asked;
+    bool_t waited = FALSE;
 
-                // Return index of newly allocated block
-                return (i * BLOCK_SIZE) + j;
-            }
-        }
+    // The owner may take it again, from a nested call or operation
+    if (l->owner == lock_self()) {
+        l->depth++;
+        return;
     }
 
-    // No free blocks found
-    return FAILURE;
+    asked = get_timer();
+#ifndef FAKE
+    if (!lock_try_acquire(&l->lock)) {
+        waited = TRUE;
+        lock_acquire(&l->lock);
+    }
+#endif
+    l->owner = lock_self();
+    l->depth = 1;
+    l->since = get_timer();
+    lock_count_acquire(l->class, asked, l->since, waited);
 }
 
-static void block_free(int index) {
-    uint8_t *in_use;
-    char block_buf[BLOCK_SIZE];
+static bool_t mutex_try_acquire(fs_lock_t *l) {
+    uint64_t asked;
 
-    in_use = bamap_read(index, block_buf);
-    *in_use = FALSE;
-    bamap_write(index, block_buf);
+    // Unlike mutex_acquire, fail for the owner too: its caller may be in the
+    // middle of the work the lock protects
+    if (l->owner == lock_self()) {
+        return FALSE;
+    }
+
+    asked = get_timer();
+#ifndef FAKE
+    if (!lock_try_acquire(&l->lock)) {
+        return FALSE;
+    }
+#endif
+    l->owner = lock_self();
+    l->depth = 1;
+    l->since = get_timer();
+    lock_count_acquire(l->class, asked, l->since, FALSE);
+    return TRUE;
 }
 
-/* Data blocks ***************************************************************/
+static void mutex_release(fs_lock_t *l) {
+    if (--l->depth > 0) {
+        return;
+    }
 
-static void data_read(int index, char *block_buf) {
-    block_read(sblock->data_start + index, block_buf);
+    lock_count_release(l->class, l->since);
+    l->owner = FAILURE;
+#ifndef FAKE
+    lock_release(&l->lock);
+#endif
 }
 
-static void data_write(int index, char *block_buf) {
-    block_write(sblock->data_start + index, block_buf);
+static void rw_init(fs_rwlock_t *l, int class) {
+#ifndef FAKE
+    rwlock_init(&l->lock);
+#endif
+    l->class = class;
 }
 
-/* i-Nodes *******************************************************************/
+static held_lock_t *op_held(fs_rwlock_t *l) {
+    int i;
+    op_scope_t *scope;
+
+    // Look through every operation this thread has in progress
+    for (scope = op_scopes[lock_self()]; scope != NULL;
+         scope = scope->outer) {
+        for (i = 0; i < scope->count; i++) {
+            if (scope->held[i].lock == l) {
+                return &scope->held[i];
+            }
+        }
+    }
 
-static void inode_init(inode_t *inode, int type) {
-    inode->type = type;
-    inode->links = 1;
-    inode->fd_count = 0;
-    inode->size = 0;
-    bzero((char *)inode->blocks, sizeof(inode->blocks));
-    inode->used_blocks = 0;
+    return NULL;
 }
 
-static int inode_block(int index) {
-    int block_offset = index / (BLOCK_SIZE / sizeof(inode_t));
-    return sblock->inode_start + block_offset;
-}
+static void op_lock(fs_rwlock_t *l, bool_t write) {
+    op_scope_t *scope = op_scopes[lock_self()];
+    held_lock_t *held;
+    uint64_t asked;
+    bool_t waited = FALSE;
 
-static inode_t *inode_read(int index, char *block_buf) {
-    inode_t *inodes;
+    // A nested operation runs under the locks of the one it interrupted
+    if (op_held(l) != NULL) {
+        return;
+    }
 
-    // Read block containing inode from disk
-    block_read(inode_block(index), block_buf);
+    asked = get_timer();
+#ifndef FAKE
+    if (write && !rwlock_try_write(&l->lock)) {
+        waited = TRUE;
+        rwlock_acquire_write(&l->lock);
+    } else if (!write && !rwlock_try_read(&l->lock)) {
+        waited = TRUE;
+        rwlock_acquire_read(&l->lock);
+    }
+#endif
 
-    // Return pointer to inode struct in data buffer
-    inodes = (inode_t *)block_buf;
-    return &inodes[index % (BLOCK_SIZE / sizeof(inode_t))];
+    // Remember the lock so it is released when the operation ends
+    held = &scope->held[scope->count++];
+    held->lock = l;
+    held->write = write;
+    held->since = get_timer();
+    lock_count_acquire(l->class, asked, held->since, waited);
 }
 
-static void inode_write(int index, char *block_buf) {
-    block_write(inode_block(index), block_buf);
+static void op_unlock(void) {
+    op_scope_t *scope = op_scopes[lock_self()];
+    held_lock_t *held;
+
+    // Release the lock the operation took most recently
+    held = &scope->held[--scope->count];
+    lock_count_release(held->lock->class, held->since);
+#ifndef FAKE
+    if (held->write) {
+        rwlock_release_write(&held->lock->lock);
+    } else {
+        rwlock_release_read(&held->lock->lock);
+    }
+#endif
 }
 
-static int inode_create(int type) {
-    int block_inodes;
-    int block;
-    int inode;
-    char block_buf[BLOCK_SIZE];
-    inode_t *inodes;
+static fs_rwlock_t *inode_lock(int index) {
+    return &inode_locks[index % INODE_LOCKS];
+}
 
-    // Search for free inode entry
-    block_inodes = BLOCK_SIZE / sizeof(inode_t);
-    inodes = (inode_t *)block_buf;
-    for (block = 0; block < sblock->inode_blocks; block++) {
-        block_read(sblock->inode_start + block, block_buf);
-        for (inode = 0; inode < block_inodes; inode++) {
-            if (inodes[inode].type == FREE_INODE) {
-                // Write the new inode to disk
-                inode_init(&inodes[inode], type);
-                block_write(sblock->inode_start + block, block_buf);
+static void ranges_enter(void) {
+#ifndef FAKE
+    lock_acquire(&ranges_mutex);
+#endif
+}
 
-                // Return index of newly created inode
-                return (block * block_inodes) + inode;
-            }
-        }
+static void ranges_leave(bool_t changed) {
+#ifndef FAKE
+    // Let waiters look again once a range is released or shrunk
+    if (changed) {
+        condition_broadcast(&ranges_changed);
     }
-
-    // No free inode entry found
-    return FAILURE;
+    lock_release(&ranges_mutex);
+#endif
 }
 
-static void inode_free(int index) {
-    int i;
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
+static bool_t ranges_wait(void) {
+#ifdef FAKE
+    // Only one thread: nobody else can release the range
+    return FALSE;
+#else
+    condition_wait(&ranges_mutex, &ranges_changed);
+    return TRUE;
+#endif
+}
 
-    // Read inode from disk
-    inode = inode_read(index, inode_buf);
+static bool_t range_conflicts(range_lock_t *list, range_lock_t *r) {
+    range_lock_t *other;
 
-    // Free all data blocks used by inode
-    for (i = 0; i < inode->used_blocks; i++) {
-        block_free(inode->blocks[i]);
+    // Ranges of other holders conflict where they overlap, unless both
+    // only read
+    for (other = list; other != NULL; other = other->next) {
+        if (other->owner != r->owner && other->inode == r->inode &&
+            other->start < r->end && r->start < other->end &&
+            (other->write || r->write)) {
+            return TRUE;
+        }
     }
 
-    // Mark inode as free on disk
-    inode->type = FREE_INODE;
-    inode_write(index, inode_buf);
+    return FALSE;
 }
 
-/* Directories ***************************************************************/
-
-// Current working directory inode
-static int wdir;
+static bool_t range_acquire(range_lock_t **list, range_lock_t *r,
+                            bool_t wait) {
+    uint64_t asked = get_timer();
+    bool_t waited = FALSE;
+
+    // Wait for conflicting ranges to go, or fail if asked not to
+    ranges_enter();
+    while (range_conflicts(*list, r)) {
+        if (!wait || !ranges_wait()) {
+            ranges_leave(FALSE);
+            return FALSE;
+        }
+        waited = TRUE;
+    }
 
-static int dir_add_entry(int dir_inode, int entry_inode, char *name) {
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
-    char data_buf[BLOCK_SIZE];
-    int block_entries;
-    int curr_entries;
-    entry_t *entries;
-    int block_index;
-    int entry_offset;
-    int new_block;
+    r->next = *list;
+    *list = r;
+    r->since = get_timer();
+    ranges_leave(FALSE);
+    lock_count_acquire(FS_LOCK_RANGE, asked, r->since, waited);
 
-    // Read directory inode from disk
-    inode = inode_read(dir_inode, inode_buf);
+    return TRUE;
+}
 
+static void range_unlink(range_lock_t **list, range_lock_t *r) {
+    range_lock_t **link;
 
-    // Fail if too many entries in directory
-    block_entries = BLOCK_SIZE / sizeof(entry_t);
-    curr_entries = inode->size / sizeof(entry_t);
-    if (curr_entries >= block_entries * INODE_ADDRS) {
-        return FAILURE;
+    // Caller holds the ranges mutex
+    for (link = list; *link != NULL; link = &(*link)->next) {
+        if (*link == r) {
+            *link = r->next;
+            lock_count_release(FS_LOCK_RANGE, r->since);
+            return;
+        }
     }
+}
 
-    // Determine index of data block and offset within block
-    block_index = curr_entries / block_entries;
-    entry_offset = curr_entries % block_entries;
+static void op_range(int inode, int offset, int count, bool_t write) {
+    op_scope_t *scope = op_scopes[lock_self()];
+    int max_size = INODE_ADDRS * BLOCK_SIZE;
 
-    // Allocate new data block if necessary
-    if (block_index >= inode->used_blocks) {
-        new_block = block_alloc();
-        if (new_block == FAILURE) {
-            return FAILURE;
-        }
-        inode->blocks[block_index] = new_block;
-        inode->used_blocks++;
+    // Nothing to lock for empty or impossible ranges, where the operation
+    // fails or does nothing, or inside an operation that locked one
+    if (offset < 0 || count <= 0 || offset >= max_size || scope->ranged) {
+        return;
     }
 
-    // Add entry to data block
-    data_read(inode->blocks[block_index], data_buf);
-    entries = (entry_t *)data_buf;
-    entries[entry_offset].inode = entry_inode;
-    str_copy(name, entries[entry_offset].name);
-    data_write(inode->blocks[block_index], data_buf);
+    // Lock whole blocks, since writers change a block at a time
+    scope->range.owner = &op_scopes[lock_self()];
+    scope->range.inode = inode;
+    scope->range.start = offset / BLOCK_SIZE * BLOCK_SIZE;
+    scope->range.end = offset + min(count, max_size - offset);
+    scope->range.end = (scope->range.end + BLOCK_SIZE - 1) / BLOCK_SIZE *
+                       BLOCK_SIZE;
+    scope->range.write = write;
+    range_acquire(&op_ranges, &scope->range, TRUE);
+    scope->ranged = TRUE;
+}
 
-    // Write changes to inode on disk
-    inode->size += sizeof(entry_t);
-    inode_write(dir_inode, inode_buf);
+static void locks_init(void) {
+    int i;
 
-    return SUCCESS;
+    mutex_init(&cache_lock, FS_LOCK_CACHE);
+    mutex_init(&alloc_lock, FS_LOCK_ALLOC);
+    mutex_init(&cluster_lock, FS_LOCK_CLUSTER);
+    mutex_init(&fd_lock, FS_LOCK_FD);
+    rw_init(&txn_lock, FS_LOCK_TXN);
+    rw_init(&ns_lock, FS_LOCK_NAMESPACE);
+    for (i = 0; i < INODE_LOCKS; i++) {
+        rw_init(&inode_locks[i], FS_LOCK_INODE);
+    }
+
+    // All record locks start out unused
+    op_ranges = NULL;
+    record_ranges = NULL;
+    record_free = NULL;
+    for (i = 0; i < MAX_RECORD_LOCKS; i++) {
+        record_locks[i].next = record_free;
+        record_free = &record_locks[i];
+    }
+#ifndef FAKE
+    lock_init(&ranges_mutex);
+    condition_init(&ranges_changed);
+    spinlock_init(&lock_stats_spinlock);
+#endif
 }
 
-static int dir_remove_entry(int dir_inode, char *name) {
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
-    char data_buf[BLOCK_SIZE], last_data_buf[BLOCK_SIZE];
-    entry_t *entries, *last_entries;
-    int block, last_block;
-    int entry, last_entry;
-    int block_entries;
-    int curr_entries;
-    int entry_limit;
+/* I/O accounting ************************************************************/
 
-    // Read directory inode from disk
-    inode = inode_read(dir_inode, inode_buf);
+static ioStat io_stats[FS_IO_CLASSES];
+static ioStat io_device_base; // Device counts at the last reset
+#ifndef FAKE
+static int io_stats_spinlock;
+#endif
 
-    // Search for matching entry in used blocks
-    entries = (entry_t *)data_buf;
-    block_entries = BLOCK_SIZE / sizeof(entry_t);
-    curr_entries = inode->size / sizeof(entry_t);
-    for (block = 0; block < inode->used_blocks; block++) {
-        data_read(inode->blocks[block], data_buf);
-        entry_limit = min(block_entries, curr_entries - block*block_entries);
-        for (entry = 0; entry < entry_limit; entry++) {
-            if (same_string(entries[entry].name, name)) {
-                // Determine block index and offset of last entry
-                last_block = inode->used_blocks - 1;
-                last_entry = (curr_entries - 1) % block_entries;
+static int io_current_op(void) {
+    op_scope_t *scope = op_scopes[lock_self()];
 
-                // Replace removed entry with last entry from disk
-                data_read(inode->blocks[last_block], last_data_buf);
-                last_entries = (entry_t *)last_data_buf;
-                entries[entry] = last_entries[last_entry];
-                data_write(inode->blocks[block], data_buf);
+    return scope != NULL ? scope->op : FS_IO_OTHER;
+}
 
-                // Free last data block if necessary
-                if (last_entry == 0) {
-                    block_free(inode->blocks[last_block]);
-                    inode->used_blocks--;
-                }
+static void io_init(void) {
+    bzero((char *)io_stats, sizeof(io_stats));
+    bzero((char *)&io_device_base, sizeof(ioStat));
+#ifndef FAKE
+    spinlock_init(&io_stats_spinlock);
+#endif
 
-                // Update size of inode and write it to disk
-                inode->size -= sizeof(entry_t);
-                inode_write(dir_inode, inode_buf);
+    // Let traced block requests name the call that made them
+    block_trace_call = io_current_op;
+}
 
-                return SUCCESS;
-            }
-        }
+static void io_add(ioStat *stat, int reads, int writes, int hits,
+                   int bytes) {
+    stat->blocksRead += reads;
+    stat->blocksWritten += writes;
+    stat->cacheHits += hits;
+    stat->bytesCopied += bytes;
+}
+
+static void io_charge(int reads, int writes, int hits, int bytes) {
+    op_scope_t *scope = op_scopes[lock_self()];
+
+    // The innermost operation on this thread pays for its own work
+    if (scope != NULL) {
+        io_add(&scope->io, reads, writes, hits, bytes);
+        return;
     }
 
-    // No matching entry found
-    return FAILURE;
+    // Work outside any operation may come from several threads
+#ifndef FAKE
+    spinlock_acquire(&io_stats_spinlock);
+#endif
+    io_add(&io_stats[FS_IO_OTHER], reads, writes, hits, bytes);
+#ifndef FAKE
+    spinlock_release(&io_stats_spinlock);
+#endif
 }
 
-static int dir_find_entry(int dir_inode, char *name) {
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
-    char data_buf[BLOCK_SIZE];
-    entry_t *entries;
+static void io_count_op(op_scope_t *scope) {
+    ioStat *stat = &io_stats[scope->op];
+
+#ifndef FAKE
+    spinlock_acquire(&io_stats_spinlock);
+#endif
+    stat->calls++;
+    io_add(stat, scope->io.blocksRead, scope->io.blocksWritten,
+           scope->io.cacheHits, scope->io.bytesCopied);
+#ifndef FAKE
+    spinlock_release(&io_stats_spinlock);
+#endif
+}
+
+static void dev_read(int block, char *mem) {
+    io_charge(1, 0, 0, 0);
+    block_read(block, mem);
+}
+
+static void dev_write(int block, char *mem) {
+    io_charge(0, 1, 0, 0);
+    block_write(block, mem);
+}
+
+static void dev_read_many(int block, int count, char *mem) {
+    io_charge(count, 0, 0, 0);
+    block_read_many(block, count, mem);
+}
+
+static void dev_write_many(int block, int count, char *mem) {
+    io_charge(0, count, 0, 0);
+    block_write_many(block, count, mem);
+}
+
+/* Super block ***************************************************************/
+
+static sblock_t *sblock;
+static char sblock_buf[BLOCK_SIZE];
+
+static void sblock_init(sblock_t *sblock) {
+    sblock->magic_num = SUPER_MAGIC_NUM;
+    sblock->fs_size = FS_SIZE;
+
+    sblock->inode_start = SUPER_BLOCK + 1;
+    sblock->inode_count = MAX_FILE_COUNT;
+    sblock->inode_blocks = ceil_div(MAX_FILE_COUNT, BLOCK_SIZE/sizeof(inode_t));
+    
+    sblock->bamap_start = sblock->inode_start + sblock->inode_blocks;
+    sblock->bamap_blocks = ceil_div(MAX_FILE_COUNT*sizeof(uint8_t), BLOCK_SIZE);
+    
+    sblock->data_start = sblock->bamap_start + sblock->bamap_blocks;
+    sblock->data_blocks = MAX_FILE_COUNT;
+
+    sblock->journal_start = sblock->data_start + sblock->data_blocks;
+    sblock->journal_blocks = JOURNAL_BLOCKS;
+    sblock->journal_seq = 1;
+
+    sblock->hindex_start = sblock->journal_start + sblock->journal_blocks;
+    sblock->hindex_blocks = HINDEX_BLOCKS;
+
+    sblock->csum_start = sblock->hindex_start + sblock->hindex_blocks;
+    sblock->csum_blocks = CSUM_BLOCKS;
+
+    sblock->flags = 0;
+    sblock->clean = FALSE;
+}
+
+static sblock_t *sblock_read(char *block_buf) {
+    dev_read(SUPER_BLOCK, block_buf);
+    return (sblock_t *)block_buf;
+}
+
+static void sblock_write(char *block_buf) {
+    mutex_acquire(&cache_lock);
+    dev_write(SUPER_BLOCK, block_buf);
+    mutex_release(&cache_lock);
+}
+
+/* Data block cache **********************************************************/
+
+// Mount options selected by fs_mount
+static int mount_flags;
+
+// Cached file data blocks; entries of frame i start at i * CACHE_PAGE_BLOCKS
+static cblock_t cache[CACHE_BLOCKS];
+static uint32_t cache_clock;
+
+// Frames holding the cached blocks. The first is the cache's own, so it
+// always has room; the rest are borrowed from the shared page pool.
+static char cache_own_frame[PAGE_CACHE_FRAME_SIZE];
+static char *cache_frames[CACHE_PAGES];
+static int cache_frame_count;
+
+// Staging buffer for writing runs of adjacent dirty blocks
+static char (*cache_run_buf)[BLOCK_SIZE];
+
+// Staging buffer for reading runs of adjacent blocks ahead of use
+static char cache_ahead_buf[READAHEAD_BLOCKS][BLOCK_SIZE];
+
+// Data blocks allocated since the last journal commit
+static int fresh_blocks[MAX_FRESH_BLOCKS];
+static int fresh_count;
+
+static uint32_t cache_now(void) {
+    // Coarse time in units of 2^20 timestamp counter cycles
+    return (uint32_t)(get_timer() >> 20);
+}
+
+static void cache_map_frame(int frame) {
+    int i;
+    cblock_t *entry;
+
+    // Point each entry of the frame at its slice of the frame
+    for (i = 0; i < CACHE_PAGE_BLOCKS; i++) {
+        entry = &cache[frame * CACHE_PAGE_BLOCKS + i];
+        entry->data = cache_frames[frame] + i * BLOCK_SIZE;
+    }
+}
+
+static void cache_reset(void) {
+    int i;
+
+    // Forget every block but keep the frames
+    bzero((char *)cache, sizeof(cache));
+    if (cache_frame_count == 0) {
+        cache_frames[cache_frame_count++] = cache_own_frame;
+    }
+    for (i = 0; i < cache_frame_count; i++) {
+        cache_map_frame(i);
+    }
+    fresh_count = 0;
+}
+
+static cblock_t *cache_find(int block) {
+    int i;
+
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache[i].valid && cache[i].block == block) {
+            return &cache[i];
+        }
+    }
+
+    return NULL;
+}
+
+static cblock_t *cache_lookup(int block) {
+    cblock_t *entry;
+
+    // Find block and mark it and its frame as recently used
+    entry = cache_find(block);
+    if (entry != NULL) {
+        entry->last_used = ++cache_clock;
+        page_cache_touch(cache_frames[(entry - cache) / CACHE_PAGE_BLOCKS]);
+    }
+
+    return entry;
+}
+
+static bool_t cache_is_dirty(int block) {
+    cblock_t *entry = cache_find(block);
+    return entry != NULL && entry->dirty;
+}
+
+static void cache_clean(cblock_t *entry) {
+    int start;
+    int count;
+    cblock_t *run;
+
+    // Nothing to do if block is already on disk
+    if (!entry->valid || !entry->dirty) {
+        return;
+    }
+
+    // Find first block of the run of dirty neighbours around entry
+    start = entry->block;
+    while (start > entry->block - (CACHE_RUN_BLOCKS - 1) &&
+           cache_is_dirty(start - 1)) {
+        start--;
+    }
+
+    // Write the whole run back to the device in one sequential transfer
+    count = 0;
+    while (count < CACHE_RUN_BLOCKS && cache_is_dirty(start + count)) {
+        run = cache_find(start + count);
+        bcopy((unsigned char *)run->data,
+              (unsigned char *)cache_run_buf[count], BLOCK_SIZE);
+        run->dirty = FALSE;
+        count++;
+    }
+    dev_write_many(start, count, (char *)cache_run_buf);
+}
+
+static void cache_release(int frame) {
+    int i;
+    int last;
+    cblock_t *entry;
+
+    // Write back and forget the blocks held in the frame
+    for (i = 0; i < CACHE_PAGE_BLOCKS; i++) {
+        entry = &cache[frame * CACHE_PAGE_BLOCKS + i];
+        cache_clean(entry);
+        entry->valid = FALSE;
+    }
+    page_cache_free(cache_frames[frame]);
+
+    // Keep frames packed by moving the last one into the freed slot
+    last = --cache_frame_count;
+    if (frame != last) {
+        cache_frames[frame] = cache_frames[last];
+        bcopy((unsigned char *)&cache[last * CACHE_PAGE_BLOCKS],
+              (unsigned char *)&cache[frame * CACHE_PAGE_BLOCKS],
+              CACHE_PAGE_BLOCKS * sizeof(cblock_t));
+    }
+    bzero((char *)&cache[last * CACHE_PAGE_BLOCKS],
+          CACHE_PAGE_BLOCKS * sizeof(cblock_t));
+}
+
+static void cache_balance(void) {
+    int i, j;
+    int frame;
+    uint32_t newest;
+    uint32_t oldest;
+    cblock_t *entry;
+
+    // Give borrowed frames back while the page pool is short of memory,
+    // starting with the one whose blocks were used least recently
+    while (page_cache_pressure() > 0 && cache_frame_count > 1) {
+        frame = 1;
+        oldest = ~0;
+        for (i = 1; i < cache_frame_count; i++) {
+            newest = 0;
+            for (j = 0; j < CACHE_PAGE_BLOCKS; j++) {
+                entry = &cache[i * CACHE_PAGE_BLOCKS + j];
+                if (entry->valid && entry->last_used > newest) {
+                    newest = entry->last_used;
+                }
+            }
+            if (newest < oldest) {
+                frame = i;
+                oldest = newest;
+            }
+        }
+        cache_release(frame);
+    }
+}
+
+bool_t fs_cache_reclaim(char *frame) {
+    int i, j;
+    bool_t clean = FALSE;
+
+    // The page fault path calls this, so never wait for the cache
+    if (!mutex_try_acquire(&cache_lock)) {
+        return FALSE;
+    }
+
+    // Only a borrowed frame with nothing to write back can go at once
+    for (i = 1; i < cache_frame_count; i++) {
+        if (cache_frames[i] == frame) {
+            clean = TRUE;
+            for (j = 0; j < CACHE_PAGE_BLOCKS; j++) {
+                if (cache[i * CACHE_PAGE_BLOCKS + j].valid &&
+                    cache[i * CACHE_PAGE_BLOCKS + j].dirty) {
+                    clean = FALSE;
+                }
+            }
+            if (clean) {
+                cache_release(i);
+            }
+            break;
+        }
+    }
+    mutex_release(&cache_lock);
+
+    return clean;
+}
+
+static cblock_t *cache_insert(int block) {
+    int i;
+    char *frame;
+    cblock_t *victim;
+
+    cache_balance();
+
+    // Reuse an invalid entry, else evict the least recently used one
+    victim = &cache[0];
+    for (i = 0; i < cache_frame_count * CACHE_PAGE_BLOCKS; i++) {
+        if (!cache[i].valid) {
+            victim = &cache[i];
+            break;
+        }
+        if (cache[i].last_used < victim->last_used) {
+            victim = &cache[i];
+        }
+    }
+
+    // Borrow another frame rather than evict while memory is plentiful
+    if (victim->valid && cache_frame_count < CACHE_PAGES &&
+        page_cache_pressure() == 0) {
+        frame = page_cache_alloc(FALSE);
+        if (frame != NULL) {
+            cache_frames[cache_frame_count] = frame;
+            cache_map_frame(cache_frame_count);
+            victim = &cache[cache_frame_count * CACHE_PAGE_BLOCKS];
+            cache_frame_count++;
+        }
+    }
+    cache_clean(victim);
+
+    victim->valid = TRUE;
+    victim->dirty = FALSE;
+    victim->block = block;
+    victim->last_used = ++cache_clock;
+    page_cache_touch(cache_frames[(victim - cache) / CACHE_PAGE_BLOCKS]);
+    return victim;
+}
+
+static void cache_drop(int block) {
+    int i;
+
+    // Forget cached copy without writing it back
+    mutex_acquire(&cache_lock);
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache[i].valid && cache[i].block == block) {
+            cache[i].valid = FALSE;
+        }
+    }
+    mutex_release(&cache_lock);
+}
+
+static void cache_evict(int block) {
+    cblock_t *entry;
+
+    // Write back and forget cached copy
+    mutex_acquire(&cache_lock);
+    entry = cache_find(block);
+    if (entry != NULL) {
+        cache_clean(entry);
+        entry->valid = FALSE;
+    }
+    mutex_release(&cache_lock);
+}
+
+static void cache_flush_inode(int inode) {
+    int i;
+
+    mutex_acquire(&cache_lock);
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache[i].inode == inode) {
+            cache_clean(&cache[i]);
+        }
+    }
+    mutex_release(&cache_lock);
+}
+
+static void cache_flush_all(void) {
+    int i;
+
+    mutex_acquire(&cache_lock);
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        cache_clean(&cache[i]);
+    }
+    mutex_release(&cache_lock);
+}
+
+static void cache_flush_aged(void) {
+    int i;
+    uint32_t now;
+
+    // Bound data loss by writing back blocks dirty for too long
+    mutex_acquire(&cache_lock);
+    now = cache_now();
+    for (i = 0; i < CACHE_BLOCKS; i++) {
+        if (cache[i].dirty && now - cache[i].dirty_time > CACHE_MAX_AGE) {
+            cache_clean(&cache[i]);
+        }
+    }
+    mutex_release(&cache_lock);
+}
+
+static void cache_mark_fresh(int block) {
+    mutex_acquire(&cache_lock);
+
+    // Fall back to flushing everything if too many blocks to track
+    if (fresh_count == MAX_FRESH_BLOCKS) {
+        cache_flush_all();
+        fresh_count = 0;
+    }
+    fresh_blocks[fresh_count++] = block;
+    mutex_release(&cache_lock);
+}
+
+static bool_t cache_is_fresh(int block) {
+    int i;
+    bool_t fresh = FALSE;
+
+    mutex_acquire(&cache_lock);
+    for (i = 0; i < fresh_count; i++) {
+        if (fresh_blocks[i] == block) {
+            fresh = TRUE;
+        }
+    }
+    mutex_release(&cache_lock);
+
+    return fresh;
+}
+
+static void cache_flush_fresh(void) {
+    int i;
+    cblock_t *entry;
+
+    // Newly allocated blocks must reach the disk before metadata that
+    // points at them is committed
+    for (i = 0; i < fresh_count; i++) {
+        entry = cache_lookup(fresh_blocks[i]);
+        if (entry != NULL) {
+            cache_clean(entry);
+        }
+    }
+    fresh_count = 0;
+}
+
+/* Checksums *****************************************************************/
+
+// Checksum of every block, mirroring the checksum table on disk
+static uint32_t *csum_table;
+
+// Lookup table for CPUs without the crc32 instruction
+static uint32_t crc32c_table[256];
+static bool_t crc32c_hw;
+
+// Was metadata found not to match its checksum since the last check?
+static bool_t csum_damaged;
+
+// Activity counters reported by fs_checksum_stat
+static csumStat csum_stats;
+
+static uint32_t crc32c_sw(uint32_t crc, char *buf, int len) {
+    int i;
+
+    for (i = 0; i < len; i++) {
+        crc = crc32c_table[(crc ^ (uint8_t)buf[i]) & 0xff] ^ (crc >> 8);
+    }
+
+    return crc;
+}
+
+static uint32_t crc32c_sse42(uint32_t crc, char *buf, int len) {
+    int i;
+    uint32_t *words = (uint32_t *)buf;
+
+    // Fold in a 32-bit word per instruction; len is a multiple of 4
+    for (i = 0; i < len / sizeof(uint32_t); i++) {
+        asm volatile ("crc32l %1, %0" : "+r" (crc) : "rm" (words[i]));
+    }
+
+    return crc;
+}
+
+static void crc32c_init(void) {
+    int i, j;
+    uint32_t crc;
+    uint32_t eax, ebx, ecx, edx;
+
+    // Build the table for the byte-at-a-time fallback
+    for (i = 0; i < 256; i++) {
+        crc = i;
+        for (j = 0; j < 8; j++) {
+            crc = (crc & 1) ? (crc >> 1) ^ CRC32C_POLY : crc >> 1;
+        }
+        crc32c_table[i] = crc;
+    }
+
+    // Use the crc32 instruction if the CPU has SSE4.2
+    asm volatile ("cpuid"
+                  : "=a" (eax), "=b" (ebx), "=c" (ecx), "=d" (edx)
+                  : "a" (1));
+    crc32c_hw = (ecx & CPUID_ECX_SSE42) != 0;
+}
+
+static uint32_t crc32c(char *block_buf) {
+    uint32_t crc = ~0;
+
+    if (crc32c_hw) {
+        crc = crc32c_sse42(crc, block_buf, BLOCK_SIZE);
+    } else {
+        crc = crc32c_sw(crc, block_buf, BLOCK_SIZE);
+    }
+
+    return ~crc;
+}
+
+static bool_t csum_covers(int block) {
+    // Inode, allocation map and data blocks carry checksums; those of
+    // file data are only kept up to date with SBLOCK_CHECKSUM_DATA
+    return (sblock->flags & SBLOCK_CHECKSUM) &&
+           block >= sblock->inode_start &&
+           block < sblock->data_start + sblock->data_blocks;
+}
+
+static int csum_table_block(int block) {
+    return block / CSUM_BLOCK_ENTRIES;
+}
+
+static char *csum_table_image(int table_block) {
+    return (char *)&csum_table[table_block * CSUM_BLOCK_ENTRIES];
+}
+
+static bool_t csum_set(int block, char *block_buf) {
+    uint32_t crc;
+
+    if (!csum_covers(block)) {
+        return FALSE;
+    }
+
+    // Record the block's new checksum, reporting whether it changed
+    crc = crc32c(block_buf);
+    csum_stats.blocksSummed++;
+    if (csum_table[block] == crc) {
+        return FALSE;
+    }
+    csum_table[block] = crc;
+
+    return TRUE;
+}
+
+static bool_t csum_matches(int block, char *block_buf) {
+    return !csum_covers(block) || crc32c(block_buf) == csum_table[block];
+}
+
+static bool_t csum_check(int block, char *block_buf) {
+    if (!csum_covers(block)) {
+        return TRUE;
+    }
+
+    csum_stats.blocksVerified++;
+    if (crc32c(block_buf) != csum_table[block]) {
+        csum_stats.mismatches++;
+        return FALSE;
+    }
+
+    return TRUE;
+}
+
+static void csum_format(void) {
+    int i;
+    uint32_t crc;
+    char block_buf[BLOCK_SIZE];
+
+    csum_damaged = FALSE;
+    bzero((char *)&csum_stats, sizeof(csum_stats));
+    if (!(sblock->flags & SBLOCK_CHECKSUM)) {
+        return;
+    }
+
+    // Every covered block starts out zeroed
+    bzero_block(block_buf);
+    crc = crc32c(block_buf);
+    for (i = 0; i < FS_SIZE; i++) {
+        csum_table[i] = csum_covers(i) ? crc : 0;
+    }
+    for (i = 0; i < sblock->csum_blocks; i++) {
+        dev_write(sblock->csum_start + i, csum_table_image(i));
+    }
+}
+
+static void csum_load(void) {
+    int i;
+
+    csum_damaged = FALSE;
+    bzero((char *)&csum_stats, sizeof(csum_stats));
+    if (!(sblock->flags & SBLOCK_CHECKSUM)) {
+        return;
+    }
+
+    // Read the checksum table, which the journal has brought up to date
+    for (i = 0; i < sblock->csum_blocks; i++) {
+        dev_read(sblock->csum_start + i, csum_table_image(i));
+    }
+}
+
+/* Metadata preload **********************************************************/
+
+// Slot holding each preloaded block, FAILURE if the block is not held
+static short preload_slots[FS_SIZE];
+
+// Block held in each slot, FAILURE if the slot is free
+static short preload_blocks[PRELOAD_BLOCKS];
+
+// Pinned frames holding the slots, CACHE_PAGE_BLOCKS to a frame
+static char *preload_frames[PRELOAD_PAGES];
+static int preload_frame_count;
+
+static char *preload_image(int block) {
+    int slot;
+
+    // Nothing held unless a preloading mount is active
+    if (preload_frame_count == 0) {
+        return NULL;
+    }
+
+    slot = preload_slots[block];
+    if (slot == FAILURE) {
+        return NULL;
+    }
+    return preload_frames[slot / CACHE_PAGE_BLOCKS] +
+           (slot % CACHE_PAGE_BLOCKS) * BLOCK_SIZE;
+}
+
+static char *preload_add(int block) {
+    int slot;
+    char *frame;
+
+    // Find a free slot, pinning another frame if all are taken
+    for (slot = 0; slot < preload_frame_count * CACHE_PAGE_BLOCKS; slot++) {
+        if (preload_blocks[slot] == FAILURE) {
+            break;
+        }
+    }
+    if (slot == preload_frame_count * CACHE_PAGE_BLOCKS) {
+        if (preload_frame_count == PRELOAD_PAGES) {
+            return NULL;
+        }
+        frame = page_cache_alloc(TRUE);
+        if (frame == NULL) {
+            return NULL;
+        }
+        preload_frames[preload_frame_count++] = frame;
+    }
+
+    preload_blocks[slot] = block;
+    preload_slots[block] = slot;
+    return preload_image(block);
+}
+
+static void preload_drop(int block) {
+    // Freed blocks may be reused for file data, which bypasses the preload
+    mutex_acquire(&cache_lock);
+    if (preload_image(block) != NULL) {
+        preload_blocks[preload_slots[block]] = FAILURE;
+        preload_slots[block] = FAILURE;
+    }
+    mutex_release(&cache_lock);
+}
+
+static void preload_release(void) {
+    int i;
+
+    // Give the frames back and forget every block
+    for (i = 0; i < preload_frame_count; i++) {
+        page_cache_free(preload_frames[i]);
+    }
+    preload_frame_count = 0;
+    for (i = 0; i < FS_SIZE; i++) {
+        preload_slots[i] = FAILURE;
+    }
+    for (i = 0; i < PRELOAD_BLOCKS; i++) {
+        preload_blocks[i] = FAILURE;
+    }
+}
+
+static int preload_run(int start, int count) {
+    int i;
+    int run;
+    int loaded;
+    char *image;
+
+    // Read the blocks in large sequential transfers, keeping only those
+    // that match their checksums so damage is still found on the disk
+    loaded = 0;
+    for (; count > 0; start += run, count -= run) {
+        run = min(CACHE_RUN_BLOCKS, count);
+        dev_read_many(start, run, (char *)cache_run_buf);
+        for (i = 0; i < run; i++) {
+            if (!csum_check(start + i, cache_run_buf[i])) {
+                continue;
+            }
+            image = preload_add(start + i);
+            if (image == NULL) {
+                return loaded;
+            }
+            bcopy((unsigned char *)cache_run_buf[i], (unsigned char *)image,
+                  BLOCK_SIZE);
+            loaded++;
+        }
+    }
+
+    return loaded;
+}
+
+static int preload_load(void) {
+    int i, j, k;
+    int loaded;
+    int count;
+    int run;
+    short dirs[PRELOAD_BLOCKS];
+    inode_t *inodes;
+
+    // Home locations must be current; the caller checkpoints the journal
+    preload_release();
+
+    // Inode table and allocation map
+    loaded = preload_run(sblock->inode_start, sblock->inode_blocks);
+    loaded += preload_run(sblock->bamap_start, sblock->bamap_blocks);
+
+    // Collect directory blocks from the preloaded inode table, in disk order
+    count = 0;
+    for (i = 0; i < sblock->inode_blocks; i++) {
+        inodes = (inode_t *)preload_image(sblock->inode_start + i);
+        for (j = 0; inodes != NULL && j < BLOCK_SIZE / sizeof(inode_t); j++) {
+            if (inodes[j].type != DIRECTORY) {
+                continue;
+            }
+            for (k = 0; k < inodes[j].used_blocks && count < PRELOAD_BLOCKS;
+                 k++) {
+                if (inodes[j].blocks[k] >= 0 &&
+                    inodes[j].blocks[k] < sblock->data_blocks) {
+                    dirs[count++] = sblock->data_start + inodes[j].blocks[k];
+                }
+            }
+        }
+    }
+    for (i = 1; i < count; i++) {
+        for (j = i; j > 0 && dirs[j - 1] > dirs[j]; j--) {
+            run = dirs[j];
+            dirs[j] = dirs[j - 1];
+            dirs[j - 1] = run;
+        }
+    }
+
+    // Read adjacent directory blocks together
+    for (i = 0; i < count; i += run) {
+        for (run = 1; i + run < count && run < CACHE_RUN_BLOCKS &&
+                      dirs[i + run] == dirs[i] + run; run++) {
+        }
+        loaded += preload_run(dirs[i], run);
+    }
+
+    return loaded;
+}
+
+/* Journal *******************************************************************/
+
+// Metadata block images dirtied by the running (uncommitted) group
+static int group_blocks[GROUP_MAX_BLOCKS];
+static char (*group_images)[BLOCK_SIZE];
+static int group_count;
+static int group_ops;
+
+// Blocks held back for operations still adding to the group
+static int group_reserved;
+static uint32_t group_time;
+
+// Committed but not yet checkpointed blocks and their journal positions
+static int jmap_blocks[JOURNAL_BLOCKS];
+static int jmap_pos[JOURNAL_BLOCKS];
+static int jmap_count;
+
+// Next free journal block and sequence number of the next transaction
+static int journal_head;
+static int journal_seq;
+
+// Scratch buffer for journal descriptor, commit and checkpoint blocks
+static char journal_buf[BLOCK_SIZE];
+
+static void journal_reset(int seq) {
+    group_count = 0;
+    group_ops = 0;
+    jmap_count = 0;
+    journal_head = 0;
+    journal_seq = seq;
+}
+
+static char *group_lookup(int block) {
+    int i;
+
+    for (i = 0; i < group_count; i++) {
+        if (group_blocks[i] == block) {
+            return group_images[i];
+        }
+    }
+
+    return NULL;
+}
+
+static int jmap_lookup(int block) {
+    int i;
+
+    for (i = 0; i < jmap_count; i++) {
+        if (jmap_blocks[i] == block) {
+            return i;
+        }
+    }
+
+    return FAILURE;
+}
+
+static void journal_checkpoint(void) {
+    int i;
+
+    mutex_acquire(&cache_lock);
+
+    // Copy latest image of each logged block to its home location
+    for (i = 0; i < jmap_count; i++) {
+        dev_read(sblock->journal_start + jmap_pos[i], journal_buf);
+        dev_write(jmap_blocks[i], journal_buf);
+    }
+
+    // Retire checkpointed transactions so they are never replayed
+    jmap_count = 0;
+    journal_head = 0;
+    sblock->journal_seq = journal_seq;
+    sblock_write(sblock_buf);
+    mutex_release(&cache_lock);
+}
+
+static void journal_csum(void) {
+    int i;
+    int table_block;
+
+    if (!(sblock->flags & SBLOCK_CHECKSUM)) {
+        return;
+    }
+
+    // Checksum every logged block, then refresh the logged images of the
+    // checksum table so both reach the disk in the same transaction
+    for (i = 0; i < group_count; i++) {
+        csum_set(group_blocks[i], group_images[i]);
+    }
+    for (i = 0; i < group_count; i++) {
+        table_block = group_blocks[i] - sblock->csum_start;
+        if (table_block >= 0 && table_block < sblock->csum_blocks) {
+            bcopy((unsigned char *)csum_table_image(table_block),
+                  (unsigned char *)group_images[i], BLOCK_SIZE);
+        }
+    }
+}
+
+static void journal_commit(void) {
+    int i;
+    int entry;
+    jheader_t *header;
+
+    // Nothing to do if no blocks were dirtied
+    mutex_acquire(&cache_lock);
+    group_ops = 0;
+    if (group_count == 0) {
+        mutex_release(&cache_lock);
+        return;
+    }
+
+    // Ordered mode: write new data blocks before committing metadata
+    cache_flush_fresh();
+    journal_csum();
+
+    // Make room for descriptor, block images and commit record
+    if (journal_head + group_count + 2 > sblock->journal_blocks) {
+        journal_checkpoint();
+    }
+
+    // Write descriptor block listing home locations
+    header = (jheader_t *)journal_buf;
+    bzero_block(journal_buf);
+    header->magic = JOURNAL_DESC_MAGIC;
+    header->seq = journal_seq;
+    header->count = group_count;
+    for (i = 0; i < group_count; i++) {
+        header->blocks[i] = group_blocks[i];
+    }
+    dev_write(sblock->journal_start + journal_head, journal_buf);
+
+    // Write all block images in one sequential run
+    dev_write_many(
+        sblock->journal_start + journal_head + 1,
+        group_count,
+        (char *)group_images
+    );
+
+    // Write commit block, making the whole group durable at once
+    header->magic = JOURNAL_COMMIT_MAGIC;
+    dev_write(
+        sblock->journal_start + journal_head + group_count + 1,
+        journal_buf
+    );
+
+    // Remember where the latest image of each block now lives
+    for (i = 0; i < group_count; i++) {
+        entry = jmap_lookup(group_blocks[i]);
+        if (entry == FAILURE) {
+            entry = jmap_count++;
+            jmap_blocks[entry] = group_blocks[i];
+        }
+        jmap_pos[entry] = journal_head + 1 + i;
+    }
+
+    // Start a new empty group
+    journal_head += group_count + 2;
+    journal_seq++;
+    group_count = 0;
+    mutex_release(&cache_lock);
+}
+
+static void journal_recover(void) {
+    int i;
+    jheader_t *header;
+    jheader_t desc;
+    int seq;
+
+    // Replay each committed transaction in sequence order
+    header = (jheader_t *)journal_buf;
+    seq = sblock->journal_seq;
+    journal_head = 0;
+    while (journal_head + 2 <= sblock->journal_blocks) {
+        // Stop at first block that is not the next descriptor
+        dev_read(sblock->journal_start + journal_head, journal_buf);
+        desc = *header;
+        if (desc.magic != JOURNAL_DESC_MAGIC || desc.seq != seq ||
+            desc.count <= 0 || desc.count > GROUP_MAX_BLOCKS ||
+            journal_head + desc.count + 2 > sblock->journal_blocks) {
+            break;
+        }
+
+        // Stop if the transaction never committed
+        dev_read(
+            sblock->journal_start + journal_head + desc.count + 1,
+            journal_buf
+        );
+        if (header->magic != JOURNAL_COMMIT_MAGIC || header->seq != seq) {
+            break;
+        }
+
+        // Copy block images to their home locations
+        for (i = 0; i < desc.count; i++) {
+            dev_read(sblock->journal_start + journal_head + 1 + i,
+                       journal_buf);
+            dev_write(desc.blocks[i], journal_buf);
+        }
+
+        journal_head += desc.count + 2;
+        seq++;
+    }
+
+    // Journal is now empty; retire replayed transactions
+    journal_reset(seq);
+    if (sblock->journal_seq != seq) {
+        sblock->journal_seq = seq;
+        sblock_write(sblock_buf);
+    }
+}
+
+static int meta_read(int block, char *block_buf) {
+    char *image;
+    int entry;
+    int result = SUCCESS;
+
+    // Prefer the newest logged image, then a preloaded copy, over the home
+    // location
+    mutex_acquire(&cache_lock);
+    image = group_lookup(block);
+    if (image == NULL) {
+        image = preload_image(block);
+    }
+    if (image != NULL) {
+        bcopy((unsigned char *)image, (unsigned char *)block_buf, BLOCK_SIZE);
+        io_charge(0, 0, 1, 0);
+    } else {
+        entry = jmap_lookup(block);
+        if (entry != FAILURE) {
+            dev_read(sblock->journal_start + jmap_pos[entry], block_buf);
+        } else {
+            dev_read(block, block_buf);
+        }
+
+        // Damaged metadata is left for fsck, which must run before the
+        // disk is next considered clean
+        if (!csum_check(block, block_buf)) {
+            csum_damaged = TRUE;
+            result = FAILURE;
+        }
+    }
+    mutex_release(&cache_lock);
+
+    return result;
+}
+
+static void meta_write(int block, char *block_buf) {
+    char *image;
+    int table_block;
+    int needed;
+
+    // Journaled image supersedes any cached copy, and keeps a preloading
+    // mount's copy current
+    mutex_acquire(&cache_lock);
+    cache_drop(block);
+    if (preload_frame_count > 0 &&
+        block < sblock->data_start + sblock->data_blocks) {
+        image = preload_image(block);
+        if (image == NULL) {
+            image = preload_add(block);
+        }
+        if (image != NULL) {
+            bcopy((unsigned char *)block_buf, (unsigned char *)image,
+                  BLOCK_SIZE);
+        }
+    }
+
+    // Log block image in the running group, along with the checksum
+    // table block covering it; that image is filled in at commit
+    image = group_lookup(block);
+    if (image == NULL) {
+        table_block = FAILURE;
+        if (csum_covers(block)) {
+            table_block = sblock->csum_start + csum_table_block(block);
+        }
+        needed = 1;
+        if (table_block != FAILURE && group_lookup(table_block) == NULL) {
+            needed++;
+        }
+        if (group_count + needed > GROUP_MAX_BLOCKS) {
+            journal_commit();
+        }
+
+        group_blocks[group_count] = block;
+        image = group_images[group_count++];
+        if (table_block != FAILURE && group_lookup(table_block) == NULL) {
+            group_blocks[group_count++] = table_block;
+        }
+    }
+    bcopy((unsigned char *)block_buf, (unsigned char *)image, BLOCK_SIZE);
+    mutex_release(&cache_lock);
+}
+
+static void csum_log(int block) {
+    int table_block = csum_table_block(block);
+
+    // Log the checksum table block holding a block's changed checksum
+    mutex_acquire(&cache_lock);
+    meta_write(sblock->csum_start + table_block,
+               csum_table_image(table_block));
+    mutex_release(&cache_lock);
+}
+
+/* Deduplication index *******************************************************/
+
+// Index slot describing each data block's contents, FAILURE if none
+static short dedup_slots[MAX_FILE_COUNT];
+
+// Activity counters reported by fs_dedup_stat
+static dedupStat dedup_stats;
+
+static uint64_t dedup_hash(char *block_buf) {
+    int i;
+    uint32_t *words;
+    uint64_t hash;
+
+    // Mix one 32-bit word at a time with a multiply and xor-shift
+    words = (uint32_t *)block_buf;
+    hash = DEDUP_HASH_SEED;
+    for (i = 0; i < BLOCK_SIZE / sizeof(uint32_t); i++) {
+        hash ^= words[i];
+        hash *= DEDUP_HASH_PRIME;
+        hash ^= hash >> 29;
+    }
+
+    return hash;
+}
+
+static int hindex_block(int slot) {
+    return sblock->hindex_start + (slot / HINDEX_BLOCK_ENTRIES);
+}
+
+static hentry_t *hindex_read(int slot, char *block_buf) {
+    hentry_t *entries;
+
+    meta_read(hindex_block(slot), block_buf);
+    entries = (hentry_t *)block_buf;
+    return &entries[slot % HINDEX_BLOCK_ENTRIES];
+}
+
+static void hindex_write(int slot, char *block_buf) {
+    meta_write(hindex_block(slot), block_buf);
+}
+
+static void dedup_reset(void) {
+    int i;
+
+    for (i = 0; i < MAX_FILE_COUNT; i++) {
+        dedup_slots[i] = FAILURE;
+    }
+    bzero((char *)&dedup_stats, sizeof(dedup_stats));
+}
+
+static void dedup_load(void) {
+    int i, j;
+    int slot;
+    hentry_t *entries;
+    char block_buf[BLOCK_SIZE];
+
+    // Rebuild the block to slot map from the index on disk
+    dedup_reset();
+    if (!(sblock->flags & SBLOCK_DEDUP)) {
+        return;
+    }
+    entries = (hentry_t *)block_buf;
+    for (i = 0; i < sblock->hindex_blocks; i++) {
+        meta_read(sblock->hindex_start + i, block_buf);
+        for (j = 0; j < HINDEX_BLOCK_ENTRIES; j++) {
+            slot = (i * HINDEX_BLOCK_ENTRIES) + j;
+            if (entries[j].block > 0 &&
+                entries[j].block <= sblock->data_blocks) {
+                dedup_slots[entries[j].block - 1] = slot;
+            }
+        }
+    }
+}
+
+static void dedup_clear(void) {
+    int i;
+    char block_buf[BLOCK_SIZE];
+
+    // Forget every indexed block
+    bzero_block(block_buf);
+    for (i = 0; i < sblock->hindex_blocks; i++) {
+        meta_write(sblock->hindex_start + i, block_buf);
+    }
+    dedup_reset();
+}
+
+static void dedup_forget(int index) {
+    hentry_t *entry;
+    char block_buf[BLOCK_SIZE];
+
+    // Nothing to do if block is not indexed
+    if (dedup_slots[index] == FAILURE) {
+        return;
+    }
+
+    // Leave a tombstone so later probes continue past the slot
+    entry = hindex_read(dedup_slots[index], block_buf);
+    entry->block = HENTRY_DELETED;
+    hindex_write(dedup_slots[index], block_buf);
+    dedup_slots[index] = FAILURE;
+}
+
+static void dedup_insert(uint64_t hash, int index) {
+    int i;
+    int slot;
+    hentry_t *entry;
+    char block_buf[BLOCK_SIZE];
+
+    // Use the first unused slot along the probe sequence, leaving the
+    // block unindexed if there is none
+    for (i = 0; i < DEDUP_MAX_PROBES; i++) {
+        slot = ((uint32_t)(hash >> 32) + i) % HINDEX_ENTRIES;
+        entry = hindex_read(slot, block_buf);
+        if (entry->block == HENTRY_FREE || entry->block == HENTRY_DELETED) {
+            entry->hash = (uint32_t)hash;
+            entry->block = index + 1;
+            hindex_write(slot, block_buf);
+            dedup_slots[index] = slot;
+            return;
+        }
+    }
+}
+
+/* Compression ***************************************************************/
+
+// Latest input position seen with each 3-byte hash, FAILURE if none
+static short lz_table[LZ_HASH_SIZE];
+
+// Most recently expanded cluster, and the first block holding its
+// compressed form, FAILURE if none
+static char cluster_buf[CLUSTER_SIZE];
+static int cluster_block;
+
+// Compressed cluster as laid out on disk, header first
+static char packed_buf[CLUSTER_SIZE];
+
+static int lz_hash(uint8_t *bytes) {
+    uint32_t key = bytes[0] | (bytes[1] << 8) | (bytes[2] << 16);
+
+    // Multiplicative hash keeping the top LZ_HASH_BITS bits
+    return (key * 2654435761U) >> (32 - LZ_HASH_BITS);
+}
+
+static int lz_literals(uint8_t *src, int len, char *dst, int out, int max) {
+    int run;
+
+    // Copy bytes in runs of at most LZ_MAX_LITERALS, each after a token
+    while (len > 0) {
+        run = min(len, LZ_MAX_LITERALS);
+        if (out + 1 + run > max) {
+            return FAILURE;
+        }
+        dst[out++] = run - 1;
+        bcopy(src, (unsigned char *)&dst[out], run);
+        out += run;
+        src += run;
+        len -= run;
+    }
+
+    return out;
+}
+
+static int lz_compress(char *src, int len, char *dst, int max) {
+    int i;
+    uint8_t *in = (uint8_t *)src;
+    int pos;
+    int out;
+    int literal;
+    int hash;
+    int match;
+    int length;
+    int distance;
+
+    for (i = 0; i < LZ_HASH_SIZE; i++) {
+        lz_table[i] = FAILURE;
+    }
+
+    // Greedily replace repeated byte strings with back references,
+    // failing if the output would not fit in max bytes
+    pos = 0;
+    out = 0;
+    literal = 0;
+    while (pos + LZ_MIN_MATCH <= len) {
+        // Find the last position starting with the same 3 bytes
+        hash = lz_hash(&in[pos]);
+        match = lz_table[hash];
+        lz_table[hash] = pos;
+
+        // Measure the match, moving on if it is too short
+        length = 0;
+        if (match != FAILURE) {
+            while (pos + length < len && length < LZ_MAX_MATCH &&
+                   in[match + length] == in[pos + length]) {
+                length++;
+            }
+        }
+        if (length < LZ_MIN_MATCH) {
+            pos++;
+            continue;
+        }
+
+        // Emit pending literals, then the match
+        out = lz_literals(&in[literal], pos - literal, dst, out, max);
+        if (out == FAILURE || out + 3 > max) {
+            return FAILURE;
+        }
+        distance = pos - match;
+        dst[out++] = LZ_MATCH | (length - LZ_MIN_MATCH);
+        dst[out++] = distance & 0xff;
+        dst[out++] = distance >> 8;
+
+        pos += length;
+        literal = pos;
+    }
+
+    // Emit trailing literals
+    return lz_literals(&in[literal], len - literal, dst, out, max);
+}
+
+static int lz_decompress(char *src, int len, char *dst, int max) {
+    uint8_t *in = (uint8_t *)src;
+    int pos;
+    int out;
+    int token;
+    int length;
+    int distance;
+
+    // Expand tokens, failing on any that run outside src or dst
+    pos = 0;
+    out = 0;
+    while (pos < len) {
+        token = in[pos++];
+        if (token & LZ_MATCH) {
+            length = (token & ~LZ_MATCH) + LZ_MIN_MATCH;
+            if (pos + 2 > len) {
+                return FAILURE;
+            }
+            distance = in[pos] | (in[pos + 1] << 8);
+            pos += 2;
+            if (distance == 0 || distance > out || out + length > max) {
+                return FAILURE;
+            }
+
+            // Copy a byte at a time, as the match may overlap itself
+            for (; length > 0; length--, out++) {
+                dst[out] = dst[out - distance];
+            }
+        } else {
+            length = token + 1;
+            if (pos + length > len || out + length > max) {
+                return FAILURE;
+            }
+            bcopy(&in[pos], (unsigned char *)&dst[out], length);
+            pos += length;
+            out += length;
+        }
+    }
+
+    return out;
+}
+
+static void cluster_reset(void) {
+    cluster_block = FAILURE;
+}
+
+static void cluster_forget(int index) {
+    // Expanded copy is stale once its first compressed block is freed
+    if (index == cluster_block) {
+        cluster_block = FAILURE;
+    }
+}
+
+/* Block allocation map ******************************************************/
+
+// Number of unallocated data blocks, kept in step with the map
+static int free_blocks;
+
+static int bamap_block(int index) {
+    return sblock->bamap_start + (index * sizeof(uint8_t) / BLOCK_SIZE);
+}
+
+// Each map entry counts the inodes sharing a block, zero if it is free
+static uint8_t *bamap_read(int index, char *block_buf) {
+    meta_read(bamap_block(index), block_buf);
+    return (uint8_t *)&block_buf[index % BLOCK_SIZE];
+}
+
+static void bamap_write(int index, char *block_buf) {
+    meta_write(bamap_block(index), block_buf);
+}
+
+static void bamap_count_free(void) {
+    int i;
+    char block_buf[BLOCK_SIZE];
+
+    // Count blocks no inode refers to
+    mutex_acquire(&alloc_lock);
+    free_blocks = 0;
+    for (i = 0; i < sblock->data_blocks; i++) {
+        if (i % BLOCK_SIZE == 0) {
+            meta_read(bamap_block(i), block_buf);
+        }
+        if (block_buf[i % BLOCK_SIZE] == 0) {
+            free_blocks++;
+        }
+    }
+    mutex_release(&alloc_lock);
+}
+
+static int block_alloc_first_fit(int skip_segment) {
+    int i, j;
+    char block_buf[BLOCK_SIZE];
+
+    // Search for flag indicating free block
+    for (i = 0; i < sblock->bamap_blocks; i++) {
+        meta_read(sblock->bamap_start + i, block_buf);
+        for (j = 0; j < BLOCK_SIZE; j++) {
+            // Skip blocks in the segment being cleaned
+            if (((i * BLOCK_SIZE) + j) / LOG_SEGMENT_BLOCKS == skip_segment) {
+                continue;
+            }
+
+            if (!block_buf[j]) {
+                // Mark block as used on disk
+                block_buf[j] = TRUE;
+                meta_write(sblock->bamap_start + i, block_buf);
+                free_blocks--;
+
+                // Remember block so its data is written before commit
+                cache_mark_fresh(sblock->data_start + (i * BLOCK_SIZE) + j);
+
+                // Return index of newly allocated block
+                return (i * BLOCK_SIZE) + j;
+            }
+        }
+    }
+
+    // No free blocks found
+    return FAILURE;
+}
+
+static int block_refs(int index) {
+    int refs;
+    char block_buf[BLOCK_SIZE];
+
+    mutex_acquire(&alloc_lock);
+    refs = *bamap_read(index, block_buf);
+    mutex_release(&alloc_lock);
+
+    return refs;
+}
+
+static int block_ref(int index) {
+    uint8_t *refs;
+    char block_buf[BLOCK_SIZE];
+
+    // Fail if block already has as many sharers as can be counted
+    mutex_acquire(&alloc_lock);
+    refs = bamap_read(index, block_buf);
+    if (*refs >= MAX_BLOCK_REFS) {
+        mutex_release(&alloc_lock);
+        return FAILURE;
+    }
+
+    (*refs)++;
+    bamap_write(index, block_buf);
+    mutex_release(&alloc_lock);
+    return SUCCESS;
+}
+
+static void block_free(int index) {
+    uint8_t *refs;
+    char block_buf[BLOCK_SIZE];
+
+    // Drop one reference, freeing the block when none are left
+    mutex_acquire(&alloc_lock);
+    refs = bamap_read(index, block_buf);
+    (*refs)--;
+    bamap_write(index, block_buf);
+
+    // Contents of a freed block must never be written back or shared
+    if (*refs == 0) {
+        free_blocks++;
+        cache_drop(sblock->data_start + index);
+        preload_drop(sblock->data_start + index);
+        dedup_forget(index);
+        cluster_forget(index);
+    }
+    mutex_release(&alloc_lock);
+}
+
+/* Log-structured allocation *************************************************/
+
+// Segment currently being filled by log appends, and next offset in it
+static int log_segment;
+static int log_offset;
+
+// Live block counts per segment at last scan
+static int segment_live[MAX_SEGMENTS];
+static int segment_count;
+
+// Should the cleaner run before the next operation?
+static bool_t log_clean_needed;
+
+static void log_reset(void) {
+    log_segment = FAILURE;
+    log_offset = 0;
+    log_clean_needed = FALSE;
+    segment_count = sblock->data_blocks / LOG_SEGMENT_BLOCKS;
+}
+
+static int log_scan(void) {
+    int i, j;
+    char block_buf[BLOCK_SIZE];
+    int segment;
+    int free_segments;
+
+    // Count live blocks in every segment, reading each map block once
+    bzero((char *)segment_live, sizeof(segment_live));
+    for (i = 0; i < sblock->bamap_blocks; i++) {
+        meta_read(sblock->bamap_start + i, block_buf);
+        for (j = 0; j < BLOCK_SIZE; j++) {
+            segment = ((i * BLOCK_SIZE) + j) / LOG_SEGMENT_BLOCKS;
+            if (segment < segment_count && block_buf[j]) {
+                segment_live[segment]++;
+            }
+        }
+    }
+
+    // Count wholly free segments
+    free_segments = 0;
+    for (segment = 0; segment < segment_count; segment++) {
+        if (segment_live[segment] == 0) {
+            free_segments++;
+        }
+    }
+
+    return free_segments;
+}
+
+static int log_next_segment(void) {
+    int i;
+    int segment;
+
+    // Ask for cleaning once free segments run low
+    if (log_scan() <= LOG_CLEAN_THRESHOLD) {
+        log_clean_needed = TRUE;
+    }
+
+    // Continue with the first free segment after the current one
+    for (i = 1; i <= segment_count; i++) {
+        segment = (log_segment + i + segment_count) % segment_count;
+        if (segment_live[segment] == 0) {
+            return segment;
+        }
+    }
+
+    return FAILURE;
+}
+
+static int log_block_alloc(void) {
+    int index;
+    uint8_t *in_use;
+    char block_buf[BLOCK_SIZE];
+
+    while (TRUE) {
+        // Append at the log head if current segment has room
+        while (log_segment != FAILURE && log_offset < LOG_SEGMENT_BLOCKS) {
+            index = log_segment * LOG_SEGMENT_BLOCKS + log_offset++;
+            in_use = bamap_read(index, block_buf);
+            if (!*in_use) {
+                *in_use = TRUE;
+                bamap_write(index, block_buf);
+                free_blocks--;
+                cache_mark_fresh(sblock->data_start + index);
+                return index;
+            }
+        }
+
+        // Move log head to the next wholly free segment
+        log_segment = log_next_segment();
+        log_offset = 0;
+
+        // Fall back to any free block if there is no free segment
+        if (log_segment == FAILURE) {
+            return block_alloc_first_fit(FAILURE);
+        }
+    }
+}
+
+static int block_alloc(void) {
+    int index;
+
+    mutex_acquire(&alloc_lock);
+    if (sblock->flags & SBLOCK_LOG_STRUCTURED) {
+        index = log_block_alloc();
+    } else {
+        index = block_alloc_first_fit(FAILURE);
+    }
+    mutex_release(&alloc_lock);
+
+    return index;
+}
+
+static int block_alloc_run(short *blocks, int count) {
+    int i, j;
+    int run;
+    char block_buf[BLOCK_SIZE];
+
+    // Look for count adjacent free blocks in one pass over the map; the
+    // log head already hands out adjacent blocks in log-structured mode
+    mutex_acquire(&alloc_lock);
+    run = 0;
+    for (i = 0; i < sblock->data_blocks &&
+         !(sblock->flags & SBLOCK_LOG_STRUCTURED); i++) {
+        if (i % BLOCK_SIZE == 0) {
+            meta_read(bamap_block(i), block_buf);
+        }
+        run = block_buf[i % BLOCK_SIZE] ? 0 : run + 1;
+        if (run == count) {
+            break;
+        }
+    }
+
+    // Claim the run if one was found
+    if (run == count) {
+        for (j = 0; j < count; j++) {
+            blocks[j] = i - count + 1 + j;
+            *bamap_read(blocks[j], block_buf) = TRUE;
+            bamap_write(blocks[j], block_buf);
+            free_blocks--;
+            cache_mark_fresh(sblock->data_start + blocks[j]);
+        }
+        mutex_release(&alloc_lock);
+        return SUCCESS;
+    }
+
+    // Otherwise take blocks one at a time, undoing on failure
+    for (j = 0; j < count; j++) {
+        blocks[j] = block_alloc();
+        if (blocks[j] == FAILURE) {
+            while (--j >= 0) {
+                block_free(blocks[j]);
+            }
+            mutex_release(&alloc_lock);
+            return FAILURE;
+        }
+    }
+    mutex_release(&alloc_lock);
+
+    return SUCCESS;
+}
+
+static void log_relocate(short *block) {
+    int new_block;
+
+    // Blocks allocated since the last commit can be updated in place
+    if (cache_is_fresh(sblock->data_start + *block)) {
+        return;
+    }
+
+    // Otherwise move the block to the log head, keeping it in place if
+    // the disk is full
+    new_block = log_block_alloc();
+    if (new_block != FAILURE) {
+        block_free(*block);
+        *block = new_block;
+    }
+}
+
+static int block_unshare(short *block) {
+    int new_block;
+
+    // Blocks shared with another inode are copied before being changed
+    mutex_acquire(&alloc_lock);
+    if (block_refs(*block) > 1) {
+        new_block = block_alloc();
+        if (new_block == FAILURE) {
+            mutex_release(&alloc_lock);
+            return FAILURE;
+        }
+        block_free(*block);
+        *block = new_block;
+        mutex_release(&alloc_lock);
+        return SUCCESS;
+    }
+
+    // In log-structured mode, move overwritten blocks to the log head
+    if (sblock->flags & SBLOCK_LOG_STRUCTURED) {
+        log_relocate(block);
+    }
+    mutex_release(&alloc_lock);
+
+    return SUCCESS;
+}
+
+/* Data blocks ***************************************************************/
+
+static int data_read(int index, char *block_buf) {
+    int block = sblock->data_start + index;
+    cblock_t *entry;
+    int result = SUCCESS;
+
+    // Serve block from the cache if possible
+    mutex_acquire(&cache_lock);
+    entry = cache_lookup(block);
+    if (entry != NULL) {
+        bcopy((unsigned char *)entry->data, (unsigned char *)block_buf,
+              BLOCK_SIZE);
+        io_charge(0, 0, 1, 0);
+    } else if (group_lookup(block) != NULL || jmap_lookup(block) != FAILURE) {
+        // Blocks with a journaled image are read through the journal
+        result = meta_read(block, block_buf);
+    } else {
+        // Read block from disk, failing if it does not match its checksum
+        dev_read(block, block_buf);
+        if ((sblock->flags & SBLOCK_CHECKSUM_DATA) &&
+            !csum_check(block, block_buf)) {
+            result = FAILURE;
+        } else {
+            // Keep a clean copy
+            entry = cache_insert(block);
+            entry->inode = FAILURE;
+            bcopy((unsigned char *)block_buf, (unsigned char *)entry->data,
+                  BLOCK_SIZE);
+        }
+    }
+    mutex_release(&cache_lock);
+
+    return result;
+}
+
+static bool_t data_on_device(int block) {
+    // Caller holds the cache lock
+    return cache_find(block) == NULL && group_lookup(block) == NULL &&
+           jmap_lookup(block) == FAILURE;
+}
+
+static void data_prefetch(short *indexes, int count) {
+    int i, j;
+    int start;
+    int run;
+    cblock_t *entry;
+
+    mutex_acquire(&cache_lock);
+    for (i = 0; i < count; i += (run > 0) ? run : 1) {
+        // Gather the next run of blocks adjacent on disk that only the
+        // device holds
+        start = sblock->data_start + indexes[i];
+        run = 0;
+        while (i + run < count && run < READAHEAD_BLOCKS &&
+               sblock->data_start + indexes[i + run] == start + run &&
+               data_on_device(start + run)) {
+            run++;
+        }
+        if (run == 0) {
+            continue;
+        }
+
+        // Read the run in one transfer, keeping clean copies of the blocks
+        // that match their checksums. A damaged one is left for the read
+        // that needs it to find and report
+        dev_read_many(start, run, (char *)cache_ahead_buf);
+        for (j = 0; j < run; j++) {
+            if (sblock->flags & SBLOCK_CHECKSUM_DATA) {
+                if (!csum_matches(start + j, cache_ahead_buf[j])) {
+                    continue;
+                }
+                if (csum_covers(start + j)) {
+                    csum_stats.blocksVerified++;
+                }
+            }
+            entry = cache_insert(start + j);
+            entry->inode = FAILURE;
+            bcopy((unsigned char *)cache_ahead_buf[j],
+                  (unsigned char *)entry->data, BLOCK_SIZE);
+        }
+    }
+    mutex_release(&cache_lock);
+}
+
+static void data_write(int inode, int index, char *block_buf) {
+    int block = sblock->data_start + index;
+    cblock_t *entry;
+
+    // Keep logging blocks that still have a journaled image, so a lazy
+    // checkpoint can never overwrite newer contents
+    mutex_acquire(&cache_lock);
+    if (group_lookup(block) != NULL || jmap_lookup(block) != FAILURE) {
+        meta_write(block, block_buf);
+        mutex_release(&cache_lock);
+        return;
+    }
+
+    // Checksum the new contents, logging the changed checksum
+    if ((sblock->flags & SBLOCK_CHECKSUM_DATA) && csum_set(block, block_buf)) {
+        csum_log(block);
+    }
+
+    // File data is never served from the preload
+    preload_drop(block);
+
+    // Update cached copy of the block
+    entry = cache_lookup(block);
+    if (entry == NULL) {
+        entry = cache_insert(block);
+    }
+    entry->inode = inode;
+    bcopy((unsigned char *)block_buf, (unsigned char *)entry->data,
+          BLOCK_SIZE);
+
+    // Write through to disk, or leave dirty until flushed
+    if (mount_flags & FS_MOUNT_WRITE_BACK) {
+        if (!entry->dirty) {
+            entry->dirty = TRUE;
+            entry->dirty_time = cache_now();
+        }
+    } else {
+        dev_write(block, block_buf);
+    }
+    mutex_release(&cache_lock);
+}
+
+static int dedup_find(uint64_t hash, char *block_buf, int skip) {
+    int i;
+    int slot;
+    int index;
+    int loaded;
+    hentry_t *entry;
+    char index_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+
+    // Probe until an empty slot, reading each index block once
+    loaded = FAILURE;
+    for (i = 0; i < DEDUP_MAX_PROBES; i++) {
+        slot = ((uint32_t)(hash >> 32) + i) % HINDEX_ENTRIES;
+        if (hindex_block(slot) != loaded) {
+            loaded = hindex_block(slot);
+            meta_read(loaded, index_buf);
+        }
+        entry = &((hentry_t *)index_buf)[slot % HINDEX_BLOCK_ENTRIES];
+        dedup_stats.indexProbes++;
+        if (entry->block == HENTRY_FREE) {
+            break;
+        }
+        if (entry->block == HENTRY_DELETED || entry->hash != (uint32_t)hash ||
+            entry->block - 1 == skip) {
+            continue;
+        }
+
+        // Confirm candidate holds the same bytes
+        index = entry->block - 1;
+        dedup_stats.compareReads++;
+        if (data_read(index, data_buf) == SUCCESS &&
+            same_block(data_buf, block_buf)) {
+            return index;
+        }
+    }
+
+    return FAILURE;
+}
+
+static void data_write_dedup(int inode, short *block, char *block_buf) {
+    uint64_t hash;
+    int match;
+
+    mutex_acquire(&alloc_lock);
+    dedup_stats.blocksWritten++;
+
+    // Share an identical block instead of writing this one
+    hash = dedup_hash(block_buf);
+    match = dedup_find(hash, block_buf, *block);
+    if (match != FAILURE && block_ref(match) == SUCCESS) {
+        block_free(*block);
+        *block = match;
+        dedup_stats.blocksShared++;
+        mutex_release(&alloc_lock);
+        return;
+    }
+
+    // Otherwise write the block and index its new contents
+    dedup_forget(*block);
+    data_write(inode, *block, block_buf);
+    dedup_insert(hash, *block);
+    mutex_release(&alloc_lock);
+}
+
+/* i-Nodes *******************************************************************/
+
+static void inode_init(inode_t *inode, int type) {
+    inode->type = type;
+    inode->links = 1;
+    inode->fd_count = 0;
+    inode->size = 0;
+    bzero((char *)inode->blocks, sizeof(inode->blocks));
+    inode->used_blocks = 0;
+    inode->flags = 0;
+    bzero((char *)inode->packed, sizeof(inode->packed));
+    inode->unwritten = 0;
+}
+
+static int inode_block(int index) {
+    int block_offset = index / (BLOCK_SIZE / sizeof(inode_t));
+    return sblock->inode_start + block_offset;
+}
+
+static inode_t *inode_read(int index, char *block_buf) {
+    inode_t *inodes;
+
+    // Read block containing inode from disk
+    meta_read(inode_block(index), block_buf);
+
+    // Return pointer to inode struct in data buffer
+    inodes = (inode_t *)block_buf;
+    return &inodes[index % (BLOCK_SIZE / sizeof(inode_t))];
+}
+
+static void inode_write(int index, char *block_buf) {
+    int slot = index % (BLOCK_SIZE / sizeof(inode_t));
+    char table_buf[BLOCK_SIZE];
+
+    // Other inodes in the block may have changed since it was read, so
+    // write back only this one
+    mutex_acquire(&cache_lock);
+    meta_read(inode_block(index), table_buf);
+    ((inode_t *)table_buf)[slot] = ((inode_t *)block_buf)[slot];
+    meta_write(inode_block(index), table_buf);
+    mutex_release(&cache_lock);
+}
+
+static bool_t inode_is_read_only(int index) {
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    inode = inode_read(index, inode_buf);
+    return (inode->flags & INODE_READ_ONLY) != 0;
+}
+
+static bool_t inode_slot_used(inode_t *inode, int i) {
+    int packed = inode->packed[i / CLUSTER_BLOCKS];
+
+    // Compressed clusters leave their trailing block slots unused
+    return i < inode->used_blocks &&
+           (packed == 0 || i % CLUSTER_BLOCKS < packed);
+}
+
+static int inode_create(int type) {
+    int block_inodes;
+    int block;
+    int inode;
+    char block_buf[BLOCK_SIZE];
+    inode_t *inodes;
+
+    // Search for free inode entry
+    mutex_acquire(&alloc_lock);
+    block_inodes = BLOCK_SIZE / sizeof(inode_t);
+    inodes = (inode_t *)block_buf;
+    for (block = 0; block < sblock->inode_blocks; block++) {
+        meta_read(sblock->inode_start + block, block_buf);
+        for (inode = 0; inode < block_inodes; inode++) {
+            if (inodes[inode].type == FREE_INODE) {
+                // Write the new inode to disk
+                inode_init(&inodes[inode], type);
+                inode_write((block * block_inodes) + inode, block_buf);
+                mutex_release(&alloc_lock);
+
+                // Return index of newly created inode
+                return (block * block_inodes) + inode;
+            }
+        }
+    }
+    mutex_release(&alloc_lock);
+
+    // No free inode entry found
+    return FAILURE;
+}
+
+static void inode_free(int index) {
+    int i;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Read inode from disk
+    inode = inode_read(index, inode_buf);
+
+    // Free all data blocks used by inode
+    for (i = 0; i < inode->used_blocks; i++) {
+        if (inode_slot_used(inode, i)) {
+            block_free(inode->blocks[i]);
+        }
+    }
+
+    // Mark inode as free on disk
+    inode->type = FREE_INODE;
+    inode_write(index, inode_buf);
+}
+
+// Are there orphans on the list that have not been freed yet?
+static bool_t orphans_pending;
+
+// Do the open counts of listed orphans predate the mount?
+static bool_t orphans_stale;
+
+static void inode_orphan(int index, inode_t *inode, char *inode_buf) {
+    bool_t listed = (inode->flags & INODE_ORPHAN) != 0;
+
+    // Free small files at once, and any file if the list is full
+    mutex_acquire(&alloc_lock);
+    if (inode->used_blocks < ORPHAN_MIN_BLOCKS ||
+        (!listed && sblock->orphan_count == SBLOCK_MAX_ORPHANS)) {
+        mutex_release(&alloc_lock);
+        inode_free(index);
+        return;
+    }
+
+    // List the orphan before the unlink can be committed, so a crash can
+    // never leak its blocks. A file unlinked while open is listed already.
+    if (!listed) {
+        sblock->orphans[sblock->orphan_count++] = index;
+        sblock_write(sblock_buf);
+    }
+    orphans_pending = TRUE;
+    mutex_release(&alloc_lock);
+
+    // Leave the blocks allocated for the reclaimer
+    inode->flags |= INODE_ORPHAN;
+    inode_write(index, inode_buf);
+}
+
+static void inode_orphan_open(inode_t *inode, int index) {
+    // List a file unlinked while still open, so that its blocks are freed
+    // at the next mount if it is never closed; fsck frees it otherwise
+    mutex_acquire(&alloc_lock);
+    if (sblock->orphan_count < SBLOCK_MAX_ORPHANS) {
+        sblock->orphans[sblock->orphan_count++] = index;
+        sblock_write(sblock_buf);
+        inode->flags |= INODE_ORPHAN;
+    }
+    mutex_release(&alloc_lock);
+}
+
+static int orphan_reclaim(void) {
+    int i;
+    int index;
+    int freed;
+    int kept;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Free every listed inode that is still an unlinked, closed orphan and
+    // keep those still open; a crash, fsck or an earlier pass may have
+    // freed or reused the rest. Descriptors counted before the mount are
+    // gone, so nothing listed then is open.
+    freed = 0;
+    kept = 0;
+    for (i = 0; i < sblock->orphan_count; i++) {
+        index = sblock->orphans[i];
+        if (index < 0 || index >= sblock->inode_count) {
+            continue;
+        }
+        inode = inode_read(index, inode_buf);
+        if (inode->type == FREE_INODE || !(inode->flags & INODE_ORPHAN) ||
+            inode->links != 0) {
+            continue;
+        }
+        if (inode->fd_count == 0 || orphans_stale) {
+            inode_free(index);
+            freed++;
+        } else {
+            sblock->orphans[kept++] = index;
+        }
+    }
+
+    // Forget the freed orphans once their frees are durable
+    journal_commit();
+    sblock->orphan_count = kept;
+    sblock_write(sblock_buf);
+    orphans_pending = FALSE;
+    orphans_stale = FALSE;
+
+    return freed;
+}
+
+/* Compressed clusters *******************************************************/
+
+static int cluster_blocks(inode_t *inode, int cluster) {
+    // Blocks the cluster spans when stored uncompressed
+    return min(CLUSTER_BLOCKS, inode->used_blocks - cluster*CLUSTER_BLOCKS);
+}
+
+static char *cluster_read(inode_t *inode, int cluster) {
+    int i;
+    short *blocks = &inode->blocks[cluster * CLUSTER_BLOCKS];
+    int packed = inode->packed[cluster];
+    cluster_header_t *header = (cluster_header_t *)packed_buf;
+
+    // Serve the most recently expanded cluster from memory
+    if (blocks[0] == cluster_block) {
+        return cluster_buf;
+    }
+
+    // Read only the blocks holding the compressed data
+    cluster_block = FAILURE;
+    for (i = 0; i < packed; i++) {
+        if (data_read(blocks[i], &packed_buf[i * BLOCK_SIZE]) == FAILURE) {
+            return NULL;
+        }
+    }
+
+    // Expand it, zeroing the rest of the cluster; fail if it is corrupt
+    bzero(cluster_buf, CLUSTER_SIZE);
+    if (header->size < 0 || header->size > CLUSTER_SIZE ||
+        header->packed_size < 0 ||
+        header->packed_size > packed*BLOCK_SIZE - sizeof(cluster_header_t) ||
+        lz_decompress(&packed_buf[sizeof(cluster_header_t)],
+                      header->packed_size, cluster_buf, header->size) !=
+        header->size) {
+        return NULL;
+    }
+    cluster_block = blocks[0];
+
+    return cluster_buf;
+}
+
+static int cluster_expand(int inode_index, inode_t *inode, int cluster) {
+    int i;
+    short *blocks = &inode->blocks[cluster * CLUSTER_BLOCKS];
+    short plain[CLUSTER_BLOCKS];
+    int count;
+    char *data;
+
+    // Expand the cluster in memory
+    mutex_acquire(&cluster_lock);
+    data = cluster_read(inode, cluster);
+    if (data == NULL) {
+        mutex_release(&cluster_lock);
+        return FAILURE;
+    }
+
+    // Allocate a block for each slot, undoing on failure
+    count = cluster_blocks(inode, cluster);
+    for (i = 0; i < count; i++) {
+        plain[i] = block_alloc();
+        if (plain[i] == FAILURE) {
+            while (--i >= 0) {
+                block_free(plain[i]);
+            }
+            mutex_release(&cluster_lock);
+            return FAILURE;
+        }
+    }
+
+    // Write the data uncompressed, then release the compressed blocks
+    for (i = 0; i < count; i++) {
+        data_write(inode_index, plain[i], &data[i * BLOCK_SIZE]);
+    }
+    for (i = 0; i < inode->packed[cluster]; i++) {
+        block_free(blocks[i]);
+    }
+    for (i = 0; i < count; i++) {
+        blocks[i] = plain[i];
+    }
+    inode->packed[cluster] = 0;
+    mutex_release(&cluster_lock);
+
+    return SUCCESS;
+}
+
+static void cluster_pack(int inode_index, inode_t *inode, int cluster) {
+    int i;
+    short *blocks = &inode->blocks[cluster * CLUSTER_BLOCKS];
+    short packed[CLUSTER_BLOCKS];
+    cluster_header_t *header = (cluster_header_t *)packed_buf;
+    int count;
+    int size;
+    int packed_size;
+    int packed_blocks;
+
+    // Only whole uncompressed clusters of two or more blocks can shrink
+    count = cluster_blocks(inode, cluster);
+    if (inode->packed[cluster] != 0 || count < 2) {
+        return;
+    }
+
+    // Blocks shared with other inodes stay shared rather than copied
+    for (i = 0; i < count; i++) {
+        if (block_refs(blocks[i]) > 1) {
+            return;
+        }
+    }
+
+    // Gather the cluster's file data
+    cluster_block = FAILURE;
+    size = min(CLUSTER_SIZE, inode->size - cluster*CLUSTER_SIZE);
+    for (i = 0; i < count; i++) {
+        if (inode->unwritten & (1 << (cluster*CLUSTER_BLOCKS + i))) {
+            bzero_block(&cluster_buf[i * BLOCK_SIZE]);
+        } else if (data_read(blocks[i], &cluster_buf[i * BLOCK_SIZE]) ==
+                   FAILURE) {
+            return;
+        }
+    }
+
+    // Compress it, keeping the result only if it saves a block
+    bzero(packed_buf, CLUSTER_SIZE);
+    packed_size = lz_compress(
+        cluster_buf, size, &packed_buf[sizeof(cluster_header_t)],
+        (count - 1)*BLOCK_SIZE - sizeof(cluster_header_t)
+    );
+    if (packed_size == FAILURE) {
+        return;
+    }
+    header->packed_size = packed_size;
+    header->size = size;
+    packed_blocks = ceil_div(sizeof(cluster_header_t) + packed_size,
+                             BLOCK_SIZE);
+
+    // Allocate blocks for the compressed data, undoing on failure
+    for (i = 0; i < packed_blocks; i++) {
+        packed[i] = block_alloc();
+        if (packed[i] == FAILURE) {
+            while (--i >= 0) {
+                block_free(packed[i]);
+            }
+            return;
+        }
+    }
+
+    // Write the compressed data, then release the uncompressed blocks
+    for (i = 0; i < packed_blocks; i++) {
+        data_write(inode_index, packed[i], &packed_buf[i * BLOCK_SIZE]);
+    }
+    for (i = 0; i < count; i++) {
+        block_free(blocks[i]);
+        blocks[i] = i < packed_blocks ? packed[i] : 0;
+    }
+    inode->packed[cluster] = packed_blocks;
+    inode->unwritten &= ~(((1 << CLUSTER_BLOCKS) - 1) <<
+                          (cluster * CLUSTER_BLOCKS));
+
+    // The cluster's data is still in memory
+    cluster_block = packed[0];
+}
+
+/* Directories ***************************************************************/
+
+static void dir_block_read(int index, char *block_buf) {
+    meta_read(sblock->data_start + index, block_buf);
+}
+
+static void dir_block_write(int index, char *block_buf) {
+    // Directory contents are metadata, so log them in the journal
+    meta_write(sblock->data_start + index, block_buf);
+}
+
+static int dir_entry_read(int dir_inode, int index, entry_t *entry) {
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    int block_entries;
+    entry_t *entries;
+
+    // Fail if directory has no entry at index
+    inode = inode_read(dir_inode, inode_buf);
+    if (index >= inode->size / sizeof(entry_t)) {
+        return FAILURE;
+    }
+
+    // Copy entry out of its data block
+    block_entries = BLOCK_SIZE / sizeof(entry_t);
+    dir_block_read(inode->blocks[index / block_entries], data_buf);
+    entries = (entry_t *)data_buf;
+    *entry = entries[index % block_entries];
+
+    return SUCCESS;
+}
+
+static int dir_add_entry(int dir_inode, int entry_inode, char *name) {
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    int block_entries;
+    int curr_entries;
+    entry_t *entries;
+    int block_index;
+    int entry_offset;
+    int new_block;
+
+    // Read directory inode from disk
+    inode = inode_read(dir_inode, inode_buf);
+
+
+    // Fail if too many entries in directory
+    block_entries = BLOCK_SIZE / sizeof(entry_t);
+    curr_entries = inode->size / sizeof(entry_t);
+    if (curr_entries >= block_entries * INODE_ADDRS) {
+        return FAILURE;
+    }
+
+    // Determine index of data block and offset within block
+    block_index = curr_entries / block_entries;
+    entry_offset = curr_entries % block_entries;
+
+    // Allocate new data block if necessary
+    if (block_index >= inode->used_blocks) {
+        new_block = block_alloc();
+        if (new_block == FAILURE) {
+            return FAILURE;
+        }
+        inode->blocks[block_index] = new_block;
+        inode->used_blocks++;
+
+        // New block holds nothing worth reading
+        bzero_block(data_buf);
+    } else {
+        dir_block_read(inode->blocks[block_index], data_buf);
+    }
+
+    // Add entry to data block
+    entries = (entry_t *)data_buf;
+    entries[entry_offset].inode = entry_inode;
+    str_copy(name, entries[entry_offset].name);
+    dir_block_write(inode->blocks[block_index], data_buf);
+
+    // Write changes to inode on disk
+    inode->size += sizeof(entry_t);
+    inode_write(dir_inode, inode_buf);
+
+    return SUCCESS;
+}
+
+static int dir_remove_entry(int dir_inode, char *name) {
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE], last_data_buf[BLOCK_SIZE];
+    entry_t *entries, *last_entries;
+    int block, last_block;
+    int entry, last_entry;
+    int block_entries;
+    int curr_entries;
+    int entry_limit;
+
+    // Read directory inode from disk
+    inode = inode_read(dir_inode, inode_buf);
+
+    // Search for matching entry in used blocks
+    entries = (entry_t *)data_buf;
+    block_entries = BLOCK_SIZE / sizeof(entry_t);
+    curr_entries = inode->size / sizeof(entry_t);
+    for (block = 0; block < inode->used_blocks; block++) {
+        dir_block_read(inode->blocks[block], data_buf);
+        entry_limit = min(block_entries, curr_entries - block*block_entries);
+        for (entry = 0; entry < entry_limit; entry++) {
+            if (same_string(entries[entry].name, name)) {
+                // Determine block index and offset of last entry
+                last_block = inode->used_blocks - 1;
+                last_entry = (curr_entries - 1) % block_entries;
+
+                // Replace removed entry with last entry from disk
+                dir_block_read(inode->blocks[last_block], last_data_buf);
+                last_entries = (entry_t *)last_data_buf;
+                entries[entry] = last_entries[last_entry];
+                dir_block_write(inode->blocks[block], data_buf);
+
+                // Free last data block if necessary
+                if (last_entry == 0) {
+                    block_free(inode->blocks[last_block]);
+                    inode->used_blocks--;
+                }
+
+                // Update size of inode and write it to disk
+                inode->size -= sizeof(entry_t);
+                inode_write(dir_inode, inode_buf);
+
+                return SUCCESS;
+            }
+        }
+    }
+
+    // No matching entry found
+    return FAILURE;
+}
+
+static int dir_find_entry(int dir_inode, char *name) {
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    entry_t *entries;
+    int block_entries;
+    int curr_entries;
+    int block;
+    int entry;
+    int entry_limit;
+
+    // Read directory inode from disk
+    inode = inode_read(dir_inode, inode_buf);
+
+    // Search for matching entry in used blocks
+    entries = (entry_t *)data_buf;
+    block_entries = BLOCK_SIZE / sizeof(entry_t);
+    curr_entries = inode->size / sizeof(entry_t);
+    for (block = 0; block < inode->used_blocks; block++) {
+        dir_block_read(inode->blocks[block], data_buf);
+        entry_limit = min(block_entries, curr_entries - block*block_entries);
+        for (entry = 0; entry < entry_limit; entry++) {
+            // If entry matches, return its inode number
+            if (same_string(entries[entry].name, name)) {
+                return entries[entry].inode;
+            }
+        }
+    }
+
+    // No matching entry found
+    return FAILURE;
+}
+
+/* Segment cleaner ***********************************************************/
+
+static void log_clean(void) {
+    int i, j, k;
+    inode_t *inodes;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    int block_inodes;
+    int segment;
+    int victim;
+    int new_block;
+    bool_t changed;
+
+    log_clean_needed = FALSE;
+
+    // Pick partially used segment with fewest live blocks
+    log_scan();
+    victim = FAILURE;
+    for (segment = 0; segment < segment_count; segment++) {
+        if (segment == log_segment || segment_live[segment] == 0 ||
+            segment_live[segment] == LOG_SEGMENT_BLOCKS) {
+            continue;
+        }
+        if (victim == FAILURE || segment_live[segment] < segment_live[victim]) {
+            victim = segment;
+        }
+    }
+
+    // Nothing to clean if no segment is partially used
+    if (victim == FAILURE) {
+        return;
+    }
+
+    // Move every live block out of the victim, updating its owner
+    block_inodes = BLOCK_SIZE / sizeof(inode_t);
+    inodes = (inode_t *)inode_buf;
+    for (i = 0; i < sblock->inode_blocks; i++) {
+        meta_read(sblock->inode_start + i, inode_buf);
+        changed = FALSE;
+        for (j = 0; j < block_inodes; j++) {
+            if (inodes[j].type == FREE_INODE) {
+                continue;
+            }
+            for (k = 0; k < inodes[j].used_blocks; k++) {
+                if (!inode_slot_used(&inodes[j], k) ||
+                    inodes[j].blocks[k] / LOG_SEGMENT_BLOCKS != victim) {
+                    continue;
+                }
+
+                // Stop cleaning if there is nowhere to move the block
+                new_block = block_alloc_first_fit(victim);
+                if (new_block == FAILURE) {
+                    if (changed) {
+                        meta_write(sblock->inode_start + i, inode_buf);
+                    }
+                    return;
+                }
+
+                // Copy block contents and retarget the inode, leaving
+                // damaged blocks where fsck will find them
+                if (data_read(inodes[j].blocks[k], data_buf) == FAILURE) {
+                    block_free(new_block);
+                    continue;
+                }
+                if (inodes[j].type == DIRECTORY) {
+                    dir_block_write(new_block, data_buf);
+                } else {
+                    data_write((i * block_inodes) + j, new_block, data_buf);
+                }
+                block_free(inodes[j].blocks[k]);
+                inodes[j].blocks[k] = new_block;
+                changed = TRUE;
+            }
+        }
+
+        if (changed) {
+            meta_write(sblock->inode_start + i, inode_buf);
+        }
+    }
+}
+
+/* Transactions **************************************************************/
+
+static void op_begin(op_scope_t *scope, int op) {
+    int self = lock_self();
+
+    // Operations started from inside another one nest within it
+    scope->outer = op_scopes[self];
+    scope->count = 0;
+    scope->reserved = FALSE;
+    scope->ranged = FALSE;
+    scope->op = op;
+    bzero((char *)&scope->io, sizeof(ioStat));
+    op_scopes[self] = scope;
+}
+
+static int op_end(op_scope_t *scope, int result) {
+    // Give back the operation's room in the group
+    if (scope->reserved) {
+        mutex_acquire(&cache_lock);
+        group_reserved -= TXN_MAX_BLOCKS;
+        mutex_release(&cache_lock);
+    }
+
+    // Release locks in the reverse of the order they were taken
+    if (scope->ranged) {
+        ranges_enter();
+        range_unlink(&op_ranges, &scope->range);
+        ranges_leave(TRUE);
+    }
+    while (scope->count > 0) {
+        op_unlock();
+    }
+    op_scopes[lock_self()] = scope->outer;
+    io_count_op(scope);
+
+    return result;
+}
+
+static bool_t group_full(void) {
+    // Commit the group if it could not hold another whole operation, or
+    // if it has been waiting too long
+    return group_count + group_reserved > GROUP_MAX_BLOCKS - TXN_MAX_BLOCKS ||
+           group_ops >= GROUP_MAX_OPS ||
+           (group_count > 0 && cache_now() - group_time > CACHE_MAX_AGE);
+}
+
+static bool_t txn_due(void) {
+    // Does the next operation have to wait for maintenance?
+    return group_full() || log_clean_needed ||
+           (orphans_pending && free_blocks < ORPHAN_LOW_WATER);
+}
+
+static void txn_start(void) {
+    // Disk may be inconsistent until the next sync
+    if (sblock->clean) {
+        sblock->clean = FALSE;
+        sblock_write(sblock_buf);
+    }
+
+    if (group_ops == 0) {
+        group_time = cache_now();
+    }
+    group_ops++;
+}
+
+static void txn_maintain(void) {
+    if (group_full()) {
+        journal_commit();
+    }
+
+    // Reclaim a segment before the log runs out of free ones
+    if (log_clean_needed) {
+        log_clean();
+    }
+
+    // Free orphaned files now if the operation may need their space
+    if (orphans_pending && free_blocks < ORPHAN_LOW_WATER) {
+        orphan_reclaim();
+    }
+}
+
+static void txn_begin(void) {
+    held_lock_t *held = op_held(&txn_lock);
+    bool_t due;
+
+    // An operation running alone, or nested inside one already logging,
+    // joins the group directly
+    if (held != NULL) {
+        if (held->write) {
+            txn_maintain();
+        }
+        txn_start();
+        cache_flush_aged();
+        return;
+    }
+
+    // Otherwise share the group with other operations, taking it alone
+    // only to commit or clean up before joining
+    for (;;) {
+        op_lock(&txn_lock, FALSE);
+        mutex_acquire(&cache_lock);
+        due = txn_due();
+        if (!due) {
+            group_reserved += TXN_MAX_BLOCKS;
+            op_scopes[lock_self()]->reserved = TRUE;
+            txn_start();
+        }
+        mutex_release(&cache_lock);
+        if (!due) {
+            break;
+        }
+
+        op_unlock();
+        op_lock(&txn_lock, TRUE);
+        txn_maintain();
+        op_unlock();
+    }
+
+    cache_flush_aged();
+}
+
+static void txn_enter(void) {
+    // Reads leave the group alone but must not overlap a commit or repair
+    op_lock(&txn_lock, FALSE);
+}
+
+static void txn_exclusive(void) {
+    // Syncs, repairs and whole-tree changes run with no other operation
+    op_lock(&txn_lock, TRUE);
+}
+
+/* File descriptor table *****************************************************/
+
+#ifdef FAKE
+// The host shell is the only process
+static fs_proc_t shell_proc;
+#endif
+
+static fd_table_t *fd_tables;
+
+// Process each thread is acting for in place of its own, if any
+static fs_proc_t *fs_procs_borrowed[LOCK_THREADS];
+
+static fs_proc_t *fs_proc_at(int i) {
+#ifdef FAKE
+    return &shell_proc;
+#else
+    return &pcb[i].fs;
+#endif
+}
+
+static fs_proc_t *fs_proc(void) {
+    fs_proc_t *proc = fs_procs_borrowed[lock_self()];
+
+    // Use the running process unless it is acting for another
+    if (proc == NULL) {
+        proc = fs_proc_at(lock_self());
+    }
+
+    return proc;
+}
+
+static void fd_tables_reset(void) {
+    int i;
+
+    // A new or checked disk has no open files, and every process starts
+    // again at the root
+    for (i = 0; i < FD_TABLES; i++) {
+        bzero((char *)fd_tables[i].open_map, sizeof(fd_tables[i].open_map));
+    }
+    for (i = 0; i < FS_PROCS; i++) {
+        fs_proc_at(i)->wdir = ROOT_DIR;
+    }
+}
+
+static fd_table_t *fd_table_get(fs_proc_t *proc) {
+    int i;
+
+    // A process takes a table from the pool when it first opens a file
+    if (proc->files != NULL) {
+        return proc->files;
+    }
+    mutex_acquire(&fd_lock);
+    for (i = 0; i < FD_TABLES && proc->files == NULL; i++) {
+        if (!fd_tables[i].in_use) {
+            fd_tables[i].in_use = TRUE;
+            bzero((char *)fd_tables[i].open_map,
+                  sizeof(fd_tables[i].open_map));
+            proc->files = &fd_tables[i];
+        }
+    }
+    mutex_release(&fd_lock);
+
+    return proc->files;
+}
+
+static void fd_table_put(fs_proc_t *proc) {
+    // Return the table to the pool once the process is done with files
+    mutex_acquire(&fd_lock);
+    if (proc->files != NULL) {
+        proc->files->in_use = FALSE;
+        proc->files = NULL;
+    }
+    mutex_release(&fd_lock);
+}
+
+static bool_t fd_is_open(fd_table_t *table, int fd) {
+    return (table->open_map[fd / 32] & (1U << (fd % 32))) != 0;
+}
+
+static int fd_open(int inode, int mode) {
+    int i;
+    int fd;
+    fd_table_t *table;
+    file_t *file;
+
+    // Fail if the process cannot get a table
+    table = fd_table_get(fs_proc());
+    if (table == NULL) {
+        return FAILURE;
+    }
+
+    // Take the lowest free descriptor: the first zero bit of the map
+    for (i = 0; i < FD_MAP_WORDS; i++) {
+        if (table->open_map[i] != ~0U) {
+            fd = i*32 + __builtin_ctz(~table->open_map[i]);
+            table->open_map[i] |= 1U << (fd % 32);
+
+            // Set up fd table entry
+            file = &table->files[fd];
+            file->inode = inode;
+            file->mode = mode;
+            file->cursor = 0;
+            file->advice = FS_ADV_NORMAL;
+            file->ra_window = 0;
+            file->ra_next = 0;
+
+            return fd;
+        }
+    }
+
+    // No free fd table entries found
+    return FAILURE;
+}
+
+static void fd_close(int fd) {
+    fd_table_t *table = fs_proc()->files;
+
+    table->open_map[fd / 32] &= ~(1U << (fd % 32));
+}
+
+static int fd_count_open(int inode) {
+    int i;
+    int fd;
+    int count = 0;
+
+    // Count open descriptors of every process referring to inode
+    for (i = 0; i < FD_TABLES; i++) {
+        for (fd = 0; fd < PROC_MAX_FDS; fd++) {
+            if (fd_is_open(&fd_tables[i], fd) &&
+                fd_tables[i].files[fd].inode == inode) {
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+static bool_t fd_wdir_in_use(int inode) {
+    int i;
+
+    // Is inode the working directory of any process?
+    for (i = 0; i < FS_PROCS; i++) {
+        if (fs_proc_at(i)->wdir == inode) {
+            return TRUE;
+        }
+    }
+
+    return FALSE;
+}
+
+/* File system check *********************************************************/
+
+// Owner of every data block, rebuilt from the inode table
+static fsck_block_t *fsck_blocks;
+
+// What the directory tree says about every inode
+static fsck_inode_t *fsck_inodes;
+
+// Directory entries naming missing or doubly linked inodes
+static int fsck_bad_dirs[FSCK_MAX_BAD_ENTRIES];
+static char fsck_bad_names[FSCK_MAX_BAD_ENTRIES][MAX_FILE_NAME + 1];
+static int fsck_bad_count;
+
+// Number of problems repaired in the current round
+static int fsck_repairs;
+
+static void fsck_write_run(int start, int run) {
+    int i;
+
+    // Write repaired blocks home, keeping their checksums current
+    dev_write_many(start, run, (char *)cache_run_buf);
+    for (i = 0; i < run; i++) {
+        if (csum_set(start + i, cache_run_buf[i])) {
+            csum_log(start + i);
+        }
+    }
+}
+
+static void fsck_release(int index, inode_t *inode) {
+    int i;
+    fsck_block_t *block;
+
+    // Give back blocks claimed by an inode that is being dropped
+    for (i = 0; i < inode->used_blocks; i++) {
+        if (!inode_slot_used(inode, i)) {
+            continue;
+        }
+        block = &fsck_blocks[inode->blocks[i]];
+        if (--block->refs == 0) {
+            block->owner = FAILURE;
+            block->entries = 0;
+        }
+    }
+
+    inode->type = FREE_INODE;
+    fsck_inodes[index].type = FREE_INODE;
+}
+
+static bool_t fsck_check_packed(inode_t *inode) {
+    int i;
+    bool_t changed = FALSE;
+
+    // Only file clusters can be compressed, into fewer blocks than they
+    // span uncompressed
+    for (i = 0; i < INODE_CLUSTERS; i++) {
+        if (inode->packed[i] != 0 && (inode->type == DIRECTORY ||
+            inode->packed[i] >= cluster_blocks(inode, i))) {
+            inode->packed[i] = 0;
+            fsck_repairs++;
+            changed = TRUE;
+        }
+    }
+
+    return changed;
+}
+
+static bool_t fsck_check_inode(int index, inode_t *inode) {
+    int i;
+    fsck_block_t *block;
     int block_entries;
     int curr_entries;
-    int block;
-    int entry;
-    int entry_limit;
+    int max_size;
+    bool_t changed = FALSE;
+
+    fsck_inodes[index].type = inode->type;
+    fsck_inodes[index].links = 0;
+    fsck_inodes[index].parent = FAILURE;
+    fsck_inodes[index].unwritten = 0;
+    if (inode->type == FREE_INODE) {
+        return FALSE;
+    }
+
+    // Inodes of unknown type are freed
+    if (inode->type != FILE_TYPE && inode->type != DIRECTORY) {
+        inode->type = FREE_INODE;
+        fsck_inodes[index].type = FREE_INODE;
+        fsck_repairs++;
+        return TRUE;
+    }
+
+    // Only descriptors in the fd table can hold a file open
+    if (inode->fd_count != fd_count_open(index)) {
+        inode->fd_count = fd_count_open(index);
+        changed = TRUE;
+    }
+
+    // Block count must fit in the inode
+    if (inode->used_blocks < 0 || inode->used_blocks > INODE_ADDRS) {
+        inode->used_blocks = inode->used_blocks < 0 ? 0 : INODE_ADDRS;
+        fsck_repairs++;
+        changed = TRUE;
+    }
+    if (fsck_check_packed(inode)) {
+        changed = TRUE;
+    }
+
+    // Claim each block, truncating at the first bad one; only files may
+    // share blocks, and only with other files
+    for (i = 0; i < inode->used_blocks; i++) {
+        if (!inode_slot_used(inode, i)) {
+            continue;
+        }
+        if (inode->blocks[i] < 0 || inode->blocks[i] >= sblock->data_blocks) {
+            break;
+        }
+        block = &fsck_blocks[inode->blocks[i]];
+        if (block->owner == FAILURE) {
+            block->owner = index;
+            block->index = i;
+        } else if (inode->type == DIRECTORY ||
+                   fsck_inodes[block->owner].type == DIRECTORY ||
+                   block->refs == MAX_BLOCK_REFS) {
+            break;
+        }
+        block->refs++;
+    }
+    if (i < inode->used_blocks) {
+        inode->used_blocks = i;
+        fsck_repairs++;
+        changed = TRUE;
+
+        // A truncated compressed cluster is left as plain blocks
+        fsck_check_packed(inode);
+    }
+
+    // Size must be covered by the remaining blocks
+    max_size = inode->used_blocks * BLOCK_SIZE;
+    if (inode->size < 0 || inode->size > max_size) {
+        inode->size = inode->size < 0 ? 0 : max_size;
+        fsck_repairs++;
+        changed = TRUE;
+    }
+
+    // Only plain file blocks still in use can be reserved
+    for (i = 0; i < INODE_ADDRS; i++) {
+        if ((inode->unwritten & (1 << i)) &&
+            (inode->type == DIRECTORY || !inode_slot_used(inode, i) ||
+             inode->packed[i / CLUSTER_BLOCKS] != 0)) {
+            inode->unwritten &= ~(1 << i);
+            fsck_repairs++;
+            changed = TRUE;
+        }
+    }
+    fsck_inodes[index].unwritten = inode->unwritten;
+
+    if (inode->type != DIRECTORY) {
+        return changed;
+    }
+
+    // Directory must hold whole entries, starting with "." and ".."
+    if (inode->size % sizeof(entry_t) != 0 ||
+        inode->size < 2 * sizeof(entry_t) ||
+        inode->used_blocks != ceil_div(inode->size, BLOCK_SIZE)) {
+        fsck_release(index, inode);
+        fsck_repairs++;
+        return TRUE;
+    }
+
+    // Remember how many entries each directory block holds
+    block_entries = BLOCK_SIZE / sizeof(entry_t);
+    curr_entries = inode->size / sizeof(entry_t);
+    for (i = 0; i < inode->used_blocks; i++) {
+        fsck_blocks[inode->blocks[i]].entries =
+            min(block_entries, curr_entries - i*block_entries);
+    }
+
+    return changed;
+}
+
+static void fsck_scan_inodes(void) {
+    int i, j;
+    int run;
+    int block_inodes;
+    inode_t *inodes;
+    bool_t changed;
+
+    // Stream the inode table, checking each inode and claiming its blocks
+    block_inodes = BLOCK_SIZE / sizeof(inode_t);
+    inodes = (inode_t *)cache_run_buf;
+    for (i = 0; i < sblock->inode_blocks; i += CACHE_RUN_BLOCKS) {
+        run = min(CACHE_RUN_BLOCKS, sblock->inode_blocks - i);
+        dev_read_many(sblock->inode_start + i, run, (char *)cache_run_buf);
+
+        changed = FALSE;
+        for (j = 0; j < run * block_inodes; j++) {
+            if (fsck_check_inode((i * block_inodes) + j, &inodes[j])) {
+                changed = TRUE;
+            }
+        }
+
+        if (changed) {
+            fsck_write_run(sblock->inode_start + i, run);
+        }
+    }
+}
+
+static void fsck_bad_entry(int dir, char *name) {
+    fsck_repairs++;
+
+    // Leave the entry for the next round if the list is full
+    if (fsck_bad_count == FSCK_MAX_BAD_ENTRIES) {
+        return;
+    }
+
+    fsck_bad_dirs[fsck_bad_count] = dir;
+    str_copy(name, fsck_bad_names[fsck_bad_count]);
+    fsck_bad_count++;
+}
+
+static bool_t fsck_check_dir_block(int index, entry_t *entries) {
+    int i;
+    int dir;
+    int target;
+    fsck_block_t *block;
+    fsck_inode_t *info;
+    bool_t changed = FALSE;
+
+    block = &fsck_blocks[index];
+    dir = block->owner;
+    for (i = 0; i < block->entries; i++) {
+        entries[i].name[MAX_FILE_NAME] = '\0';
+
+        // First entry of a directory must be its "." self link
+        if (block->index == 0 && i == 0) {
+            if (!same_string(entries[i].name, ".") ||
+                entries[i].inode != dir) {
+                entries[i].inode = dir;
+                str_copy(".", entries[i].name);
+                fsck_repairs++;
+                changed = TRUE;
+            }
+            continue;
+        }
+
+        // Second entry must be ".."; its target is checked once all
+        // parents are known
+        if (block->index == 0 && i == 1) {
+            if (!same_string(entries[i].name, "..")) {
+                str_copy("..", entries[i].name);
+                fsck_repairs++;
+                changed = TRUE;
+            }
+            continue;
+        }
+
+        // Entry must name a live inode other than the root, and a
+        // directory may only be named once
+        target = entries[i].inode;
+        if (target < 0 || target >= sblock->inode_count ||
+            target == ROOT_DIR || target == dir) {
+            fsck_bad_entry(dir, entries[i].name);
+            continue;
+        }
+        info = &fsck_inodes[target];
+        if (info->type == FREE_INODE ||
+            (info->type == DIRECTORY && info->parent != FAILURE)) {
+            fsck_bad_entry(dir, entries[i].name);
+            continue;
+        }
+
+        // Count link and remember where directories hang in the tree
+        info->links++;
+        if (info->type == DIRECTORY) {
+            info->parent = dir;
+        }
+    }
+
+    return changed;
+}
+
+static bool_t fsck_check_parent(int index, entry_t *entries) {
+    int dir;
+    int parent;
+
+    // Nothing to do for unreachable directories, which are freed later
+    dir = fsck_blocks[index].owner;
+    parent = (dir == ROOT_DIR) ? ROOT_DIR : fsck_inodes[dir].parent;
+    if (parent == FAILURE || entries[1].inode == parent) {
+        return FALSE;
+    }
+
+    // Point ".." back at the directory that names this one
+    entries[1].inode = parent;
+    fsck_repairs++;
+    return TRUE;
+}
+
+static bool_t fsck_is_dir_block(int index, bool_t first_only) {
+    fsck_block_t *block = &fsck_blocks[index];
+
+    if (block->owner == FAILURE ||
+        fsck_inodes[block->owner].type != DIRECTORY) {
+        return FALSE;
+    }
+
+    return !first_only || block->index == 0;
+}
+
+static void fsck_scan_dirs(bool_t first_only) {
+    int i, j;
+    int run;
+    bool_t found;
+    bool_t changed;
+    entry_t *entries;
+
+    // Stream the data region, reading only runs that hold directory blocks
+    for (i = 0; i < sblock->data_blocks; i += CACHE_RUN_BLOCKS) {
+        run = min(CACHE_RUN_BLOCKS, sblock->data_blocks - i);
+        found = FALSE;
+        for (j = 0; j < run; j++) {
+            if (fsck_is_dir_block(i + j, first_only)) {
+                found = TRUE;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+
+        dev_read_many(sblock->data_start + i, run, (char *)cache_run_buf);
+        changed = FALSE;
+        for (j = 0; j < run; j++) {
+            if (!fsck_is_dir_block(i + j, first_only)) {
+                continue;
+            }
+            entries = (entry_t *)cache_run_buf[j];
+            if (first_only) {
+                changed |= fsck_check_parent(i + j, entries);
+            } else {
+                changed |= fsck_check_dir_block(i + j, entries);
+            }
+        }
+
+        if (changed) {
+            fsck_write_run(sblock->data_start + i, run);
+        }
+    }
+}
+
+static void fsck_scan_links(void) {
+    int i, j;
+    int run;
+    int index;
+    int links;
+    int block_inodes;
+    inode_t *inodes;
+    bool_t changed;
+
+    // Stream the inode table again, fixing link counts
+    block_inodes = BLOCK_SIZE / sizeof(inode_t);
+    inodes = (inode_t *)cache_run_buf;
+    for (i = 0; i < sblock->inode_blocks; i += CACHE_RUN_BLOCKS) {
+        run = min(CACHE_RUN_BLOCKS, sblock->inode_blocks - i);
+        dev_read_many(sblock->inode_start + i, run, (char *)cache_run_buf);
+
+        changed = FALSE;
+        for (j = 0; j < run * block_inodes; j++) {
+            index = (i * block_inodes) + j;
+            if (inodes[j].type == FREE_INODE) {
+                continue;
+            }
+
+            // Free inodes no directory names, unless a file is still open
+            links = (index == ROOT_DIR) ? 1 : fsck_inodes[index].links;
+            if (links == 0 && inodes[j].fd_count == 0) {
+                fsck_release(index, &inodes[j]);
+                fsck_repairs++;
+                changed = TRUE;
+            } else if (inodes[j].links != links) {
+                inodes[j].links = links;
+                fsck_repairs++;
+                changed = TRUE;
+            }
+        }
+
+        if (changed) {
+            fsck_write_run(sblock->inode_start + i, run);
+        }
+    }
+}
+
+static void fsck_scan_bamap(void) {
+    int i, j;
+    int run;
+    int index;
+    uint8_t *refs;
+    bool_t changed;
+
+    // Replace the block reference counts with those rebuilt in memory
+    for (i = 0; i < sblock->bamap_blocks; i += CACHE_RUN_BLOCKS) {
+        run = min(CACHE_RUN_BLOCKS, sblock->bamap_blocks - i);
+        dev_read_many(sblock->bamap_start + i, run, (char *)cache_run_buf);
+
+        changed = FALSE;
+        refs = (uint8_t *)cache_run_buf;
+        for (j = 0; j < run * BLOCK_SIZE; j++) {
+            index = (i * BLOCK_SIZE) + j;
+            if (index >= sblock->data_blocks) {
+                break;
+            }
+            if (refs[j] != fsck_blocks[index].refs) {
+                refs[j] = fsck_blocks[index].refs;
+                fsck_repairs++;
+                changed = TRUE;
+            }
+        }
+
+        if (changed) {
+            fsck_write_run(sblock->bamap_start + i, run);
+        }
+    }
+}
+
+static bool_t fsck_has_csum(int block) {
+    fsck_block_t *owner;
+
+    // Inode and allocation map blocks always have checksums; data blocks
+    // have them if they belong to a directory, or to any file with
+    // SBLOCK_CHECKSUM_DATA. A reserved block was never written, so its
+    // entry may still be that of an earlier owner whose write was dropped
+    if (block < sblock->data_start) {
+        return TRUE;
+    }
+    owner = &fsck_blocks[block - sblock->data_start];
+    return owner->owner != FAILURE &&
+           !(fsck_inodes[owner->owner].unwritten & (1 << owner->index)) &&
+           ((sblock->flags & SBLOCK_CHECKSUM_DATA) ||
+            fsck_inodes[owner->owner].type == DIRECTORY);
+}
+
+static bool_t fsck_is_file_data(int block) {
+    return block >= sblock->data_start &&
+           fsck_inodes[fsck_blocks[block - sblock->data_start].owner].type ==
+               FILE_TYPE;
+}
+
+static void fsck_scan_csums(void) {
+    int i, j;
+    int run;
+    int end;
+    bool_t found;
+
+    csum_stats.damaged = 0;
+    if (!(sblock->flags & SBLOCK_CHECKSUM)) {
+        return;
+    }
+
+    // Stream every block with a checksum. Metadata that does not match
+    // has been through the earlier passes, so its contents are accepted;
+    // file data cannot be checked further, so it is counted as damaged and
+    // keeps failing reads until it is written again
+    end = sblock->data_start + sblock->data_blocks;
+    for (i = sblock->inode_start; i < end; i += CACHE_RUN_BLOCKS) {
+        run = min(CACHE_RUN_BLOCKS, end - i);
+        found = FALSE;
+        for (j = 0; j < run; j++) {
+            if (fsck_has_csum(i + j)) {
+                found = TRUE;
+            }
+        }
+        if (!found) {
+            continue;
+        }
+
+        dev_read_many(i, run, (char *)cache_run_buf);
+        for (j = 0; j < run; j++) {
+            if (!fsck_has_csum(i + j) || csum_check(i + j, cache_run_buf[j])) {
+                continue;
+            }
+            if (fsck_is_file_data(i + j)) {
+                csum_stats.damaged++;
+            } else {
+                csum_set(i + j, cache_run_buf[j]);
+                csum_log(i + j);
+                fsck_repairs++;
+            }
+        }
+    }
+}
+
+static int fsck_round(void) {
+    int i;
+
+    fsck_repairs = 0;
+    fsck_bad_count = 0;
+    for (i = 0; i < sblock->data_blocks; i++) {
+        fsck_blocks[i].owner = FAILURE;
+        fsck_blocks[i].entries = 0;
+        fsck_blocks[i].refs = 0;
+    }
+
+    // Pass 1: inode table, rebuilding block ownership
+    fsck_scan_inodes();
+    if (fsck_inodes[ROOT_DIR].type != DIRECTORY) {
+        return FAILURE;
+    }
+
+    // Pass 2: directory blocks, counting links and finding parents
+    fsck_scan_dirs(FALSE);
+
+    // Pass 3: first directory blocks, fixing ".." entries
+    fsck_scan_dirs(TRUE);
+
+    // Pass 4: inode table, fixing link counts and freeing orphans
+    fsck_scan_links();
+
+    // Pass 5: block allocation map
+    fsck_scan_bamap();
+
+    // Pass 6: block checksums
+    fsck_scan_csums();
+
+    // Remove bad entries through the journal, skipping freed directories
+    for (i = 0; i < fsck_bad_count; i++) {
+        if (fsck_inodes[fsck_bad_dirs[i]].type == DIRECTORY) {
+            dir_remove_entry(fsck_bad_dirs[i], fsck_bad_names[i]);
+        }
+    }
+    journal_commit();
+    journal_checkpoint();
+
+    return fsck_repairs;
+}
+
+/* Snapshots *****************************************************************/
+
+// Directories being copied, one frame per level of the tree
+static snap_frame_t snap_stack[SNAPSHOT_MAX_DEPTH];
+
+static int inode_count_free(void) {
+    int i, j;
+    int count = 0;
+    inode_t *inodes;
+    char block_buf[BLOCK_SIZE];
+
+    inodes = (inode_t *)block_buf;
+    for (i = 0; i < sblock->inode_blocks; i++) {
+        meta_read(sblock->inode_start + i, block_buf);
+        for (j = 0; j < BLOCK_SIZE / sizeof(inode_t); j++) {
+            if (inodes[j].type == FREE_INODE) {
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+static int block_count_free(void) {
+    int i, j;
+    int count = 0;
+    char block_buf[BLOCK_SIZE];
+
+    for (i = 0; i < sblock->bamap_blocks; i++) {
+        meta_read(sblock->bamap_start + i, block_buf);
+        for (j = 0; j < BLOCK_SIZE; j++) {
+            if ((i * BLOCK_SIZE) + j < sblock->data_blocks && !block_buf[j]) {
+                count++;
+            }
+        }
+    }
+
+    return count;
+}
+
+static int snap_copy_file(int index) {
+    int i;
+    int copy;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    inode_t file;
+
+    // Remember file extent
+    inode = inode_read(index, inode_buf);
+    file = *inode;
+
+    // Create read-only inode sharing the file's data blocks
+    copy = inode_create(FILE_TYPE);
+    inode = inode_read(copy, inode_buf);
+    inode->size = file.size;
+    inode->used_blocks = file.used_blocks;
+    inode->flags |= INODE_READ_ONLY;
+    for (i = 0; i < file.used_blocks; i++) {
+        inode->blocks[i] = file.blocks[i];
+        if (inode_slot_used(&file, i)) {
+            block_ref(file.blocks[i]);
+        }
+    }
+    for (i = 0; i < INODE_CLUSTERS; i++) {
+        inode->packed[i] = file.packed[i];
+    }
+    inode->unwritten = file.unwritten;
+    inode_write(copy, inode_buf);
+
+    return copy;
+}
+
+static int snap_make_dir(int parent, char *name) {
+    int dir;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Create read-only directory and link it below parent
+    dir = inode_create(DIRECTORY);
+    dir_add_entry(dir, dir, ".");
+    dir_add_entry(dir, parent, "..");
+    dir_add_entry(parent, dir, name);
+
+    inode = inode_read(dir, inode_buf);
+    inode->flags |= INODE_READ_ONLY;
+    inode_write(dir, inode_buf);
+
+    return dir;
+}
 
-    // Read directory inode from disk
-    inode = inode_read(dir_inode, inode_buf);
+static int snap_walk(int snap_dir, int *inodes, int *blocks) {
+    int i;
+    int depth;
+    snap_frame_t *frame;
+    entry_t entry;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Walk the live tree depth first from the root, skipping "." and ".."
+    // and earlier snapshots. Only count the inodes and blocks a copy needs
+    // if snap_dir is FAILURE, else copy the tree below snap_dir
+    depth = 0;
+    snap_stack[0].src = ROOT_DIR;
+    snap_stack[0].dst = snap_dir;
+    snap_stack[0].entry = 2;
+    while (depth >= 0) {
+        frame = &snap_stack[depth];
+        if (dir_entry_read(frame->src, frame->entry++, &entry) == FAILURE) {
+            depth--;
+            continue;
+        }
+
+        inode = inode_read(entry.inode, inode_buf);
+        if (inode->flags & INODE_READ_ONLY) {
+            continue;
+        }
+
+        if (inode->type == FILE_TYPE) {
+            if (snap_dir == FAILURE) {
+                // Fail if a block cannot take another sharer
+                for (i = 0; i < inode->used_blocks; i++) {
+                    if (inode_slot_used(inode, i) &&
+                        block_refs(inode->blocks[i]) + inode->links >
+                        MAX_BLOCK_REFS) {
+                        return FAILURE;
+                    }
+                }
+                (*inodes)++;
+            } else {
+                dir_add_entry(frame->dst, snap_copy_file(entry.inode),
+                              entry.name);
+            }
+            continue;
+        }
+
+        // Fail if the tree is too deep to copy
+        if (depth + 1 == SNAPSHOT_MAX_DEPTH) {
+            return FAILURE;
+        }
+
+        // Descend into subdirectory, copying it first
+        depth++;
+        snap_stack[depth].src = entry.inode;
+        snap_stack[depth].entry = 2;
+        if (snap_dir == FAILURE) {
+            (*inodes)++;
+            *blocks += inode->used_blocks;
+        } else {
+            snap_stack[depth].dst = snap_make_dir(frame->dst, entry.name);
+        }
+    }
+
+    return SUCCESS;
+}
+
+/* File data *****************************************************************/
+
+static file_t *file_lookup(int fd) {
+    fd_table_t *table = fs_proc()->files;
+
+    // Fail if given bad file descriptor
+    if (fd < 0 || fd >= PROC_MAX_FDS || table == NULL) {
+        return NULL;
+    }
+
+    // Fail if fd entry not open
+    if (!fd_is_open(table, fd)) {
+        return NULL;
+    }
+
+    return &table->files[fd];
+}
+
+static void op_lock_file(int fd, bool_t write) {
+    file_t *file;
+
+    // Lock the inode the fd refers to; only this process can close the
+    // fd, so it still refers to the same inode once the lock is held
+    file = file_lookup(fd);
+    if (file != NULL) {
+        op_lock(inode_lock(file->inode), write);
+    }
+}
+
+static int fd_cursor(int fd) {
+    file_t *file = file_lookup(fd);
+
+    return (file != NULL) ? file->cursor : 0;
+}
+
+static void op_lock_read(int fd, int offset, int count) {
+    file_t *file;
+
+    // Readers share the file, and keep writers off the blocks they read
+    file = file_lookup(fd);
+    if (file != NULL) {
+        op_lock(inode_lock(file->inode), FALSE);
+        op_range(file->inode, offset, count, FALSE);
+    }
+}
+
+static bool_t file_write_in_place(inode_t *inode, int offset, int count) {
+    int i;
+
+    // Writes that grow the file, or move blocks in log-structured or
+    // dedup mode, change the inode
+    if ((sblock->flags & (SBLOCK_LOG_STRUCTURED | SBLOCK_DEDUP)) ||
+        offset < 0 || count <= 0 || count > inode->size - offset) {
+        return FALSE;
+    }
+
+    // So do writes to compressed, reserved or shared blocks
+    for (i = offset / BLOCK_SIZE; i <= (offset + count - 1) / BLOCK_SIZE;
+         i++) {
+        if (inode->packed[i / CLUSTER_BLOCKS] != 0 ||
+            (inode->unwritten & (1 << i)) ||
+            block_refs(inode->blocks[i]) > 1) {
+            return FALSE;
+        }
+    }
+
+    return TRUE;
+}
+
+static void op_lock_write(int fd, int offset, int count) {
+    file_t *file;
+    fs_rwlock_t *l;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // A nested operation writes under its outer operation's locks
+    file = file_lookup(fd);
+    if (file == NULL || op_held(inode_lock(file->inode)) != NULL) {
+        return;
+    }
+
+    // Writers that leave the inode alone share the file, and lock only
+    // the blocks they overwrite, so writes to other parts of it proceed
+    l = inode_lock(file->inode);
+    op_lock(l, FALSE);
+    inode = inode_read(file->inode, inode_buf);
+    if (file_write_in_place(inode, offset, count)) {
+        op_range(file->inode, offset, count, TRUE);
+        return;
+    }
+
+    // Other writers have the file to themselves
+    op_unlock();
+    op_lock(l, TRUE);
+}
+
+static int file_block_read(inode_t *inode, int i, char *block_buf) {
+    int cluster = i / CLUSTER_BLOCKS;
+    char *data;
+
+    // Reserved blocks have never been written and read as zeroes
+    if (inode->unwritten & (1 << i)) {
+        bzero_block(block_buf);
+        return SUCCESS;
+    }
+
+    // Read plain blocks directly
+    if (inode->packed[cluster] == 0) {
+        return data_read(inode->blocks[i], block_buf);
+    }
+
+    // Copy blocks of a compressed cluster out of its expanded form
+    mutex_acquire(&cluster_lock);
+    data = cluster_read(inode, cluster);
+    if (data == NULL) {
+        mutex_release(&cluster_lock);
+        return FAILURE;
+    }
+    bcopy((unsigned char *)&data[(i % CLUSTER_BLOCKS) * BLOCK_SIZE],
+          (unsigned char *)block_buf, BLOCK_SIZE);
+    mutex_release(&cluster_lock);
+
+    return SUCCESS;
+}
+
+static int file_plain_blocks(inode_t *inode, int first, int last,
+                             short *indexes) {
+    int i;
+    int count = 0;
+
+    // Blocks of the range stored as they are: not reserved or compressed
+    for (i = first; i <= last && i < inode->used_blocks; i++) {
+        if (!(inode->unwritten & (1 << i)) &&
+            inode->packed[i / CLUSTER_BLOCKS] == 0) {
+            indexes[count++] = inode->blocks[i];
+        }
+    }
+
+    return count;
+}
+
+static void file_prefetch(inode_t *inode, int first, int last) {
+    short indexes[INODE_ADDRS];
+
+    data_prefetch(indexes, file_plain_blocks(inode, first, last, indexes));
+}
+
+static void file_evict(inode_t *inode, int first, int last) {
+    int i;
+    int count;
+    short indexes[INODE_ADDRS];
+
+    count = file_plain_blocks(inode, first, last, indexes);
+    for (i = 0; i < count; i++) {
+        cache_evict(sblock->data_start + indexes[i]);
+    }
+}
+
+static void file_readahead(file_t *file, inode_t *inode, int offset,
+                           int count) {
+    int first = offset / BLOCK_SIZE;
+    int last = (offset + count - 1) / BLOCK_SIZE;
+
+    // Reads picking up where the last one stopped grow the window, others
+    // close it, unless the application declared its access pattern
+    if (file->advice == FS_ADV_SEQUENTIAL) {
+        file->ra_window = READAHEAD_BLOCKS;
+    } else if (file->advice == FS_ADV_RANDOM) {
+        file->ra_window = 0;
+    } else if (first == file->ra_next || first == file->ra_next - 1) {
+        file->ra_window = min(READAHEAD_BLOCKS, 2 * file->ra_window + 1);
+    } else {
+        file->ra_window = 0;
+    }
+    file->ra_next = last + 1;
+
+    // Bring in the blocks to read, and the window after them, in as few
+    // transfers as possible
+    if (last > first || file->ra_window > 0) {
+        file_prefetch(inode, first, last + file->ra_window);
+    }
+}
+
+static int file_read(file_t *file, char *buf, int count, int offset) {
+    int i;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    int avail_bytes;
+    int index_start;
+    int bytes_read;
+    int block_offset;
+    int block_bytes;
+    int to_read;
+
+    // Read file inode from disk
+    inode = inode_read(file->inode, inode_buf);
+
+    // Read no more than remaining bytes in file
+    avail_bytes = inode->size - offset;
+    count = min(count, avail_bytes);
+    if (count > 0) {
+        file_readahead(file, inode, offset, count);
+    }
+
+    // Read count bytes from file blocks to buffer
+    bytes_read = 0;
+    index_start = offset / BLOCK_SIZE;
+    for (i = index_start; bytes_read < count; i++) {
+        // Read file data block from disk
+        if (file_block_read(inode, i, data_buf) == FAILURE) {
+            return FAILURE;
+        }
+
+        // Determine offset and bytes to read in block
+        block_offset = offset % BLOCK_SIZE;
+        block_bytes = BLOCK_SIZE - block_offset;
+        to_read = min(count - bytes_read, block_bytes);
+
+        // Read bytes from data block to buffer
+        bcopy(
+            (unsigned char *)&data_buf[block_offset],
+            (unsigned char *)&buf[bytes_read],
+            to_read
+        );
+
+        // Update offset and byte count
+        offset += to_read;
+        bytes_read += to_read;
+    }
+    io_charge(0, 0, 0, bytes_read);
+
+    return bytes_read;
+}
+
+static void file_block_write(int inode, short *block, char *block_buf) {
+    // In dedup mode, identical blocks are shared rather than written
+    if (sblock->flags & SBLOCK_DEDUP) {
+        data_write_dedup(inode, block, block_buf);
+    } else {
+        data_write(inode, *block, block_buf);
+    }
+}
+
+static void file_block_filled(inode_t *inode, int i) {
+    // A reserved block's data must reach the disk before the inode that
+    // stops reading it as zeroes is committed
+    if (inode->unwritten & (1 << i)) {
+        inode->unwritten &= ~(1 << i);
+        cache_mark_fresh(sblock->data_start + inode->blocks[i]);
+    }
+}
+
+static int file_write_abort(int inode_index, char *inode_buf,
+                            inode_t *inode, int old_used_blocks,
+                            int old_size) {
+    int j;
+
+    // Free any newly allocated blocks
+    for (j = old_used_blocks; j < inode->used_blocks; j++) {
+        block_free(inode->blocks[j]);
+    }
+
+    // Restore old file extent, keeping any blocks moved to the log head
+    inode->used_blocks = old_used_blocks;
+    inode->size = old_size;
+    inode_write(inode_index, inode_buf);
+
+    return FAILURE;
+}
+
+static int file_write(file_t *file, char *buf, int count, int offset) {
+    int i;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    char data_buf[BLOCK_SIZE];
+    int index_start;
+    int last_cluster;
+    int old_used_blocks;
+    int old_size;
+    int bytes_written;
+    int block_offset;
+    int block_bytes;
+    int to_write;
+
+    // Fail if offset after end of last data block
+    if (offset >= INODE_ADDRS * BLOCK_SIZE) {
+        return FAILURE;
+    }
+
+    // Read file inode from disk
+    inode = inode_read(file->inode, inode_buf);
+
+    // Expand any compressed clusters that padding or data will change
+    last_cluster = min(INODE_CLUSTERS - 1, (offset + count) / CLUSTER_SIZE);
+    for (i = min(inode->size, offset) / CLUSTER_SIZE; i <= last_cluster;
+         i++) {
+        if (inode->packed[i] != 0 &&
+            cluster_expand(file->inode, inode, i) == FAILURE) {
+            inode_write(file->inode, inode_buf);
+            return FAILURE;
+        }
+    }
+
+    // If offset after end of file, pad with zeros up to offset
+    index_start = inode->size / BLOCK_SIZE;
+    old_used_blocks = inode->used_blocks;
+    old_size = inode->size;
+    for (i = index_start; inode->size < offset; i++) {
+        // Allocate new data block if necessary
+        if (i >= inode->used_blocks) {
+            inode->blocks[i] = block_alloc();
+            if (inode->blocks[i] == FAILURE) {
+                // Undo any newly allocated blocks on failure
+                return file_write_abort(file->inode, inode_buf, inode,
+                                        old_used_blocks, old_size);
+            }
+            inode->used_blocks++;
+
+            // New blocks start out zeroed, so equal files get equal blocks
+            bzero_block(data_buf);
+        } else if (file_block_read(inode, i, data_buf) == FAILURE) {
+            // Fail rather than overwrite a damaged block's checksum
+            return file_write_abort(file->inode, inode_buf, inode,
+                                    old_used_blocks, old_size);
+        }
+
+        // Get a private copy of the block if it is shared or logged
+        if (block_unshare(&inode->blocks[i]) == FAILURE) {
+            return file_write_abort(file->inode, inode_buf, inode,
+                                    old_used_blocks, old_size);
+        }
+
+        // Determine offset and bytes to write in block
+        block_offset = inode->size % BLOCK_SIZE;
+        block_bytes = BLOCK_SIZE - block_offset;
+        to_write = min(offset - inode->size, block_bytes);
+
+        // Write zero padding bytes to block on disk
+        bzero(&data_buf[block_offset], to_write);
+        file_block_write(file->inode, &inode->blocks[i], data_buf);
+        file_block_filled(inode, i);
+
+        // Update file size
+        inode->size += to_write;
+    }
+
+    // Write count bytes from buffer to file blocks on disk
+    bytes_written = 0;
+    index_start = offset / BLOCK_SIZE;
+    for (i = index_start; bytes_written < count && i < INODE_ADDRS; i++) {
+        // Allocate new data block if necessary
+        if (i >= inode->used_blocks) {
+            inode->blocks[i] = block_alloc();
+            if (inode->blocks[i] == FAILURE) {
+                // Undo any newly allocated blocks on failure
+                return file_write_abort(file->inode, inode_buf, inode,
+                                        old_used_blocks, old_size);
+            }
+            inode->used_blocks++;
+
+            // New blocks start out zeroed, so equal files get equal blocks
+            bzero_block(data_buf);
+        } else if (file_block_read(inode, i, data_buf) == FAILURE) {
+            // Fail rather than overwrite a damaged block's checksum
+            return file_write_abort(file->inode, inode_buf, inode,
+                                    old_used_blocks, old_size);
+        }
+
+        // Get a private copy of the block if it is shared or logged
+        if (block_unshare(&inode->blocks[i]) == FAILURE) {
+            return file_write_abort(file->inode, inode_buf, inode,
+                                    old_used_blocks, old_size);
+        }
+
+        // Determine offset and bytes to write in block
+        block_offset = offset % BLOCK_SIZE;
+        block_bytes = BLOCK_SIZE - block_offset;
+        to_write = min(count - bytes_written, block_bytes);
+
+        // Write bytes to data block on disk
+        bcopy(
+            (unsigned char *)&buf[bytes_written],
+            (unsigned char *)&data_buf[block_offset],
+            to_write
+        );
+        file_block_write(file->inode, &inode->blocks[i], data_buf);
+        file_block_filled(inode, i);
+
+        // Update offset and byte count
+        offset += to_write;
+        bytes_written += to_write;
+
+        // Update file size if necessary
+        if (inode->size < offset) {
+            inode->size = offset;
+        }
+    }
+    io_charge(0, 0, 0, bytes_written);
+
+    // Write updated inode to disk
+    inode_write(file->inode, inode_buf);
+
+    return bytes_written;
+}
+
+static int file_reserve(int inode_index, inode_t *inode, int length) {
+    int first;
+    int count;
+    int cluster;
+
+    // Files have no holes, so every block up to the new end is needed
+    first = inode->used_blocks;
+    count = (length + BLOCK_SIZE - 1) / BLOCK_SIZE - first;
+    if (count > 0) {
+        // Expand a compressed last cluster the new blocks would join
+        cluster = first / CLUSTER_BLOCKS;
+        if (first % CLUSTER_BLOCKS != 0 && inode->packed[cluster] != 0 &&
+            cluster_expand(inode_index, inode, cluster) == FAILURE) {
+            return FAILURE;
+        }
+
+        // Reserve the new blocks together, reading as zeroes until written
+        if (block_alloc_run(&inode->blocks[first], count) == FAILURE) {
+            return FAILURE;
+        }
+        inode->unwritten |= ((1 << count) - 1) << first;
+        inode->used_blocks += count;
+    }
+
+    // Update file size if necessary
+    if (inode->size < length) {
+        inode->size = length;
+    }
+
+    return SUCCESS;
+}
+
+static int file_trim(int inode_index, inode_t *inode, int length) {
+    int i;
+    int keep;
+    int tail;
+    int cluster;
+    char data_buf[BLOCK_SIZE];
+
+    keep = (length + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    tail = length % BLOCK_SIZE;
+
+    // Expand a compressed cluster the new end cuts into
+    cluster = (keep - 1) / CLUSTER_BLOCKS;
+    if (keep > 0 && inode->packed[cluster] != 0 &&
+        (keep % CLUSTER_BLOCKS != 0 || tail != 0) &&
+        cluster_expand(inode_index, inode, cluster) == FAILURE) {
+        return FAILURE;
+    }
+
+    // Zero the dropped bytes of a partial last block, so growing the file
+    // again reads them as zeroes
+    i = keep - 1;
+    if (tail != 0 && !(inode->unwritten & (1 << i))) {
+        if (data_read(inode->blocks[i], data_buf) == FAILURE ||
+            block_unshare(&inode->blocks[i]) == FAILURE) {
+            return FAILURE;
+        }
+        bzero(&data_buf[tail], BLOCK_SIZE - tail);
+        file_block_write(inode_index, &inode->blocks[i], data_buf);
+    }
 
-    // Search for matching entry in used blocks
-    entries = (entry_t *)data_buf;
-    block_entries = BLOCK_SIZE / sizeof(entry_t);
-    curr_entries = inode->size / sizeof(entry_t);
-    for (block = 0; block < inode->used_blocks; block++) {
-        data_read(inode->blocks[block], data_buf);
-        entry_limit = min(block_entries, curr_entries - block*block_entries);
-        for (entry = 0; entry < entry_limit; entry++) {
-            // If entry matches, return its inode number
-            if (same_string(entries[entry].name, name)) {
-                return entries[entry].inode;
-            }
+    // Free the blocks past the new end, along with whole compressed
+    // clusters there
+    for (i = keep; i < inode->used_blocks; i++) {
+        if (inode_slot_used(inode, i)) {
+            block_free(inode->blocks[i]);
         }
     }
+    for (i = ceil_div(keep, CLUSTER_BLOCKS); i < INODE_CLUSTERS; i++) {
+        inode->packed[i] = 0;
+    }
+    inode->unwritten &= (1 << keep) - 1;
+    inode->used_blocks = keep;
+    inode->size = length;
 
-    // No matching entry found
-    return FAILURE;
+    return SUCCESS;
 }
 
-/* File descriptor table *****************************************************/
+static int iov_bytes(iovec_t *iov, int iovcnt) {
+    int i;
+    int total = 0;
 
-static file_t fd_table[MAX_FD_ENTRIES];
+    // Total length of a checked iovec array, stopping short of overflow
+    for (i = 0; i < iovcnt && total <= INODE_ADDRS * BLOCK_SIZE; i++) {
+        total += iov[i].len;
+    }
 
-static int fd_open(int inode, int mode) {
+    return total;
+}
+
+static int iov_check(iovec_t *iov, int iovcnt) {
     int i;
 
-    // Search for and open free fd table entry
-    for (i = 0; i < MAX_FD_ENTRIES; i++) {
-        if (!fd_table[i].is_open) {
-            // Set up fd table entry
-            fd_table[i].is_open = TRUE;
-            fd_table[i].inode = inode;
-            fd_table[i].mode = mode;
-            fd_table[i].cursor = 0;
+    // Fail if iov is NULL or iovcnt is out of range
+    if (iov == NULL || iovcnt < 0 || iovcnt > MAX_IOV_COUNT) {
+        return FAILURE;
+    }
 
-            // Return index of entry in fd table
-            return i;
+    // Fail if any buffer is NULL or has negative length
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].base == NULL || iov[i].len < 0) {
+            return FAILURE;
         }
     }
 
-    // No free fd table entries found
-    return FAILURE;
-}
-
-static void fd_close(int fd) {
-    fd_table[fd].is_open = FALSE;
+    return SUCCESS;
 }
 
 /* File system operations ****************************************************/
 
+static void tables_init(void) {
+    // The largest tables live in frames pinned at boot, which keeps the
+    // kernel image below the V86 area usb.c reserves under the stacks
+    if (csum_table != NULL) {
+        return;
+    }
+    csum_table = static_alloc(FS_SIZE * sizeof(uint32_t));
+    cache_run_buf = static_alloc(CACHE_RUN_BLOCKS * BLOCK_SIZE);
+    group_images = static_alloc(GROUP_MAX_BLOCKS * BLOCK_SIZE);
+    fsck_blocks = static_alloc(MAX_FILE_COUNT * sizeof(fsck_block_t));
+    inode_locks = static_alloc(INODE_LOCKS * sizeof(fs_rwlock_t));
+    record_locks = static_alloc(MAX_RECORD_LOCKS * sizeof(range_lock_t));
+    op_scopes = static_alloc(LOCK_THREADS * sizeof(op_scope_t *));
+    fd_tables = static_alloc(FD_TABLES * sizeof(fd_table_t));
+    fsck_inodes = static_alloc(MAX_FILE_COUNT * sizeof(fsck_inode_t));
+}
+
 void fs_init(void) {
-    // Initialize block device
+    // Initialize the large tables, locks, block device, I/O counters and
+    // checksums
+    tables_init();
+    locks_init();
     block_init();
+    io_init();
+    crc32c_init();
+
+    // Start with an empty write-through cache and nothing preloaded
+    cache_reset();
+    cluster_reset();
+    preload_release();
+    mount_flags = FS_MOUNT_WRITE_THROUGH;
 
     // Format disk if necessary
     sblock = sblock_read(sblock_buf);
     if (sblock->magic_num != SUPER_MAGIC_NUM) {
-        fs_mkfs();
+        fs_mkfs(0);
     }
 
     // Set up working directory and file descriptor table
     else {
-        // Mount root as current working directory
-        wdir = ROOT_DIR;
+        // Replay any committed metadata left in the journal
+        journal_recover();
+        log_reset();
+        dedup_load();
+        csum_load();
+
+        // Start every process at the root with no files open
+        fd_tables_reset();
+
+        // Files unlinked before the last shutdown still need freeing,
+        // including those still open then
+        orphans_pending = sblock->orphan_count > 0;
+        orphans_stale = orphans_pending;
+
+        // Check the disk unless it was synced and left untouched
+        if (!sblock->clean) {
+            fs_fsck();
+        }
+        bamap_count_free();
 
-        // Initialize the file descriptor table
-        bzero((char *)fd_table, sizeof(fd_table));
+        // Free the orphans fsck did not, before any file can be opened
+        if (orphans_pending) {
+            fs_reclaim();
+        }
     }
 }
 
-int fs_mkfs(void) {
+static int op_mkfs(int flags) {
     int i;
     char block_buf[BLOCK_SIZE];
     inode_t *inode;
     int result;
 
+    // Discard any data and metadata still waiting to be written
+    cache_reset();
+    preload_release();
+    journal_reset(1);
+    dedup_reset();
+    cluster_reset();
+
     // Zero out all file system blocks
     bzero_block(block_buf);
     for (i = 0; i < FS_SIZE; i++) {
-        block_write(i, block_buf);
+        dev_write(i, block_buf);
     }
 
     // Write super block to disk
     bzero_block(sblock_buf);
     sblock_init(sblock);
+    if (flags & FS_MKFS_LOG) {
+        sblock->flags |= SBLOCK_LOG_STRUCTURED;
+    }
+    if (flags & FS_MKFS_DEDUP) {
+        sblock->flags |= SBLOCK_DEDUP;
+    }
+    if (flags & FS_MKFS_COMPRESS) {
+        sblock->flags |= SBLOCK_COMPRESS;
+    }
+    if (flags & (FS_MKFS_CHECKSUM | FS_MKFS_CHECKSUM_DATA)) {
+        sblock->flags |= SBLOCK_CHECKSUM;
+    }
+    if (flags & FS_MKFS_CHECKSUM_DATA) {
+        sblock->flags |= SBLOCK_CHECKSUM_DATA;
+    }
     sblock_write(sblock_buf);
+    log_reset();
+    csum_format();
 
     // Create inode for root directory
     inode = inode_read(ROOT_DIR, block_buf);
@@ -418,16 +4525,116 @@ int fs_mkfs(void) {
         return FAILURE;
     }
 
-    // Mount root as current working directory
-    wdir = ROOT_DIR;
+    // Start every process at the root with no files open
+    fd_tables_reset();
+
+    // Make the new root directory durable
+    journal_commit();
+    bamap_count_free();
+    orphans_pending = FALSE;
 
-    // Initialize the file descriptor table
-    bzero((char *)fd_table, sizeof(fd_table));
+    // Disk is consistent until the next operation
+    sblock->clean = TRUE;
+    sblock_write(sblock_buf);
+
+    // Preload the new metadata if the mount asks for it
+    if (mount_flags & FS_MOUNT_PRELOAD) {
+        journal_checkpoint();
+        preload_load();
+    }
 
     return SUCCESS;
 }
 
-int fs_open(char *fileName, int flags) {
+int fs_mkfs(int flags) {
+    op_scope_t scope;
+
+    // Formatting replaces everything under every other operation
+    op_begin(&scope, FS_IO_MKFS);
+    txn_exclusive();
+    return op_end(&scope, op_mkfs(flags));
+}
+
+static int op_fsck(void) {
+    int i;
+    fs_proc_t *proc;
+    int round;
+    int repairs;
+    int total;
+
+    // Orphans are not damage: free them before looking
+    if (orphans_pending) {
+        orphan_reclaim();
+    }
+
+    // Put every block in its home location so the disk can be read
+    // directly in large runs
+    cache_flush_all();
+    journal_commit();
+    journal_checkpoint();
+    cache_reset();
+    cluster_reset();
+    preload_release();
+
+    // Check and repair until a round finds nothing wrong
+    total = 0;
+    for (round = 0; round < FSCK_MAX_ROUNDS; round++) {
+        repairs = fsck_round();
+        if (repairs == FAILURE) {
+            return FAILURE;
+        }
+        if (repairs == 0) {
+            break;
+        }
+        total += repairs;
+    }
+
+    // Give up if repairs keep turning up new problems
+    if (round == FSCK_MAX_ROUNDS) {
+        return FAILURE;
+    }
+
+    // Working directories may have been removed
+    for (i = 0; i < FS_PROCS; i++) {
+        proc = fs_proc_at(i);
+        if (fsck_inodes[proc->wdir].type != DIRECTORY) {
+            proc->wdir = ROOT_DIR;
+        }
+    }
+    log_reset();
+
+    // Repairs may have changed indexed blocks, so start a new index
+    if (total > 0 && (sblock->flags & SBLOCK_DEDUP)) {
+        dedup_clear();
+        journal_commit();
+    }
+    csum_damaged = FALSE;
+    bamap_count_free();
+
+    // Disk is consistent until the next operation
+    sblock->clean = TRUE;
+    sblock_write(sblock_buf);
+
+    // Preload the repaired metadata if the mount asks for it
+    if (mount_flags & FS_MOUNT_PRELOAD) {
+        journal_checkpoint();
+        preload_load();
+    }
+
+    return total;
+}
+
+int fs_fsck(void) {
+    op_scope_t scope;
+
+    // Repairs need the disk to themselves
+    op_begin(&scope, FS_IO_FSCK);
+    txn_exclusive();
+    return op_end(&scope, op_fsck());
+}
+
+static int op_open(char *fileName, int flags) {
+    int wdir = fs_proc()->wdir;
     int entry_inode;
     int is_new_file = FALSE;
     int result;
@@ -455,6 +4662,11 @@ int fs_open(char *fileName, int flags) {
             return FAILURE;
         }
 
+        // Fail if working directory belongs to a snapshot
+        if (inode_is_read_only(wdir)) {
+            return FAILURE;
+        }
+
         // Create new inode for file
         entry_inode = inode_create(FILE_TYPE);
         if (entry_inode == FAILURE) {
@@ -472,11 +4684,13 @@ int fs_open(char *fileName, int flags) {
         is_new_file = TRUE;
     }
     
-    // Read inode from disk
+    // Read inode from disk, locked while its open count changes
+    op_lock(inode_lock(entry_inode), TRUE);
     inode = inode_read(entry_inode, inode_buf);
 
-    // Fail if attempting to open directory in write mode
-    if (inode->type == DIRECTORY && flags != FS_O_RDONLY) {
+    // Fail if attempting to open directory or snapshot file in write mode
+    if ((inode->type == DIRECTORY || (inode->flags & INODE_READ_ONLY)) &&
+        flags != FS_O_RDONLY) {
         return FAILURE;
     }
 
@@ -498,76 +4712,431 @@ int fs_open(char *fileName, int flags) {
     return fd;
 }
 
-int fs_close(int fd) {
+int fs_open(char *fileName, int flags) {
+    op_scope_t scope;
+
+    // Opening may add a name to the working directory
+    op_begin(&scope, FS_IO_OPEN);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_open(fileName, flags));
+}
+
+static void record_put(range_lock_t **link) {
+    range_lock_t *r = *link;
+
+    // Caller holds the ranges mutex
+    *link = r->next;
+    r->next = record_free;
+    record_free = r;
+}
+
+static void record_release(fs_proc_t *proc, int inode_index) {
+    range_lock_t **link;
+    bool_t changed = FALSE;
+
+    // Drop every record lock the process holds on the file
+    ranges_enter();
+    link = &record_ranges;
+    while (*link != NULL) {
+        if ((*link)->owner == proc && (*link)->inode == inode_index) {
+            record_put(link);
+            changed = TRUE;
+        } else {
+            link = &(*link)->next;
+        }
+    }
+    ranges_leave(changed);
+}
+
+static int record_lock(range_lock_t *r, bool_t wait) {
+    range_lock_t **link;
+    range_lock_t *merged;
+    bool_t touches = FALSE;
+
+    // Wait for other processes' locks on the region to go
+    while (range_conflicts(record_ranges, r)) {
+        if (!wait || !ranges_wait()) {
+            return FAILURE;
+        }
+    }
+
+    // Fail before changing anything if no entry will be free to take
+    for (merged = record_ranges; merged != NULL; merged = merged->next) {
+        touches |= merged->owner == r->owner && merged->inode == r->inode &&
+                   merged->start <= r->end && r->start <= merged->end;
+    }
+    if (!touches && record_free == NULL) {
+        return FAILURE;
+    }
+
+    // Merge the process's locks that overlap or adjoin the region
+    link = &record_ranges;
+    while (*link != NULL) {
+        merged = *link;
+        if (merged->owner == r->owner && merged->inode == r->inode &&
+            merged->start <= r->end && r->start <= merged->end) {
+            r->start = min(r->start, merged->start);
+            r->end = r->end > merged->end ? r->end : merged->end;
+            record_put(link);
+        } else {
+            link = &(*link)->next;
+        }
+    }
+
+    // Add the merged region as one entry
+    merged = record_free;
+    record_free = merged->next;
+    *merged = *r;
+    merged->since = get_timer();
+    merged->next = record_ranges;
+    record_ranges = merged;
+
+    return SUCCESS;
+}
+
+static int record_unlock(range_lock_t *r) {
+    range_lock_t **link;
+    range_lock_t *held;
+    range_lock_t *split;
+
+    // Fail before changing anything if a lock must be split in two and no
+    // entry is free for its second half
+    for (held = record_ranges; held != NULL; held = held->next) {
+        if (held->owner == r->owner && held->inode == r->inode &&
+            held->start < r->start && r->end < held->end &&
+            record_free == NULL) {
+            return FAILURE;
+        }
+    }
+
+    // Remove, trim or split the process's locks the region overlaps
+    link = &record_ranges;
+    while (*link != NULL) {
+        held = *link;
+        if (held->owner != r->owner || held->inode != r->inode ||
+            held->end <= r->start || r->end <= held->start) {
+            link = &held->next;
+        } else if (r->start <= held->start && held->end <= r->end) {
+            record_put(link);
+        } else if (held->start < r->start && r->end < held->end) {
+            split = record_free;
+            record_free = split->next;
+            *split = *held;
+            split->start = r->end;
+            held->end = r->start;
+            held->next = split;
+            link = &split->next;
+        } else {
+            if (held->start < r->start) {
+                held->end = r->start;
+            } else {
+                held->start = r->end;
+            }
+            link = &held->next;
+        }
+    }
+
+    return SUCCESS;
+}
+
+static int op_close(int fd) {
+    int i;
+    file_t *file;
     int inode_index;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
+    bool_t was_writer;
+
+    // Fail if given bad or already closed file descriptor
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Read corresponding inode from disk
+    inode_index = file->inode;
+    inode = inode_read(inode_index, inode_buf);
+    was_writer = file->mode != FS_O_RDONLY;
+
+    // Close fd table entry, and drop the process's record locks on the
+    // file along with it
+    fd_close(fd);
+    record_release(fs_proc(), inode_index);
+
+    // Decrement open fd count and delete file if necessary
+    inode->fd_count--;
+    if (inode->links == 0 && inode->fd_count == 0) {
+        inode_orphan(inode_index, inode, inode_buf);
+    } else {
+        // Compress file data once the last writer is done with it
+        if ((sblock->flags & SBLOCK_COMPRESS) && was_writer &&
+            inode->fd_count == 0) {
+            mutex_acquire(&cluster_lock);
+            for (i = 0; i < INODE_CLUSTERS; i++) {
+                cluster_pack(inode_index, inode, i);
+            }
+            mutex_release(&cluster_lock);
+        }
+
+        // Write updated inode to disk
+        inode_write(inode_index, inode_buf);
+    }
+
+    return SUCCESS;
+}
+
+int fs_close(int fd) {
+    op_scope_t scope;
+
+    // Closing updates the open count and may free the file
+    op_begin(&scope, FS_IO_CLOSE);
+    txn_begin();
+    op_lock_file(fd, TRUE);
+    return op_end(&scope, op_close(fd));
+}
+
+static int op_dup(int fd) {
+    file_t *file;
+    int new_fd;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Fail if given bad or closed file descriptor
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Open a second entry on the same inode with the same mode
+    new_fd = fd_open(file->inode, file->mode);
+    if (new_fd == FAILURE) {
+        return FAILURE;
+    }
+
+    // Increment open fd count for inode
+    inode = inode_read(file->inode, inode_buf);
+    inode->fd_count++;
+    inode_write(file->inode, inode_buf);
+
+    return new_fd;
+}
+
+int fs_dup(int fd) {
+    op_scope_t scope;
+
+    // Duplicating updates the open count
+    op_begin(&scope, FS_IO_DUP);
+    txn_begin();
+    op_lock_file(fd, TRUE);
+    return op_end(&scope, op_dup(fd));
+}
+
+int fs_fd_mode(int fd) {
+    file_t *file;
+
+    // Fail if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    return file->mode;
+}
+
+static int op_read(int fd, char *buf, int count) {
+    file_t *file;
+    int bytes_read;
+
+    // If count is 0, return 0 immediately
+    if (count == 0) {
+        return 0;
+    }
+
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    // Fail if attempting to read negative number of bytes
+    if (count < 0) {
+        return FAILURE;
+    }
+
+    // Cannot read from file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Cannot read from file if opened write-only
+    if (file->mode == FS_O_WRONLY) {
+        return FAILURE;
+    }
+
+    // Read bytes at cursor and advance it
+    bytes_read = file_read(file, buf, count, file->cursor);
+    file->cursor += bytes_read;
+
+    return bytes_read;
+}
+
+int fs_read(int fd, char *buf, int count) {
+    op_scope_t scope;
+
+    op_begin(&scope, FS_IO_READ);
+    txn_enter();
+    op_lock_read(fd, fd_cursor(fd), count);
+    return op_end(&scope, op_read(fd, buf, count));
+}
+    
+static int op_write(int fd, char *buf, int count) {
+    file_t *file;
+    int bytes_written;
+
+    // If count is 0, return 0 immediately
+    if (count == 0) {
+        return 0;
+    }
+
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    // Fail if attempting to write negative number of bytes
+    if (count < 0) {
+        return FAILURE;
+    }
+
+    // Cannot write to file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Cannot write to file if opened read-only
+    if (file->mode == FS_O_RDONLY) {
+        return FAILURE;
+    }
+
+    // Write bytes at cursor and advance it
+    bytes_written = file_write(file, buf, count, file->cursor);
+    if (bytes_written == FAILURE) {
+        return FAILURE;
+    }
+    file->cursor += bytes_written;
+
+    return bytes_written;
+}
+
+int fs_write(int fd, char *buf, int count) {
+    op_scope_t scope;
+
+    op_begin(&scope, FS_IO_WRITE);
+    txn_begin();
+    op_lock_write(fd, fd_cursor(fd), count);
+    return op_end(&scope, op_write(fd, buf, count));
+}
+
+static int op_pread(int fd, char *buf, int count, int offset) {
+    file_t *file;
+
+    // If count is 0, return 0 immediately
+    if (count == 0) {
+        return 0;
+    }
 
-    // Fail if given bad file descriptor
-    if (fd < 0 || fd >= MAX_FD_ENTRIES) {
+    // Fail if buf is NULL
+    if (buf == NULL) {
         return FAILURE;
     }
 
-    // Fail if fd table entry is already closed
-    if (!fd_table[fd].is_open) {
+    // Fail if count or offset is negative
+    if (count < 0 || offset < 0) {
         return FAILURE;
     }
 
-    // Read corresponding inode from disk
-    inode_index = fd_table[fd].inode;
-    inode = inode_read(inode_index, inode_buf);
-
-    // Close fd table entry
-    fd_close(fd);
+    // Cannot read from file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
 
-    // Decrement open fd count and delete file if necessary
-    inode->fd_count--;
-    if (inode->links == 0 && inode->fd_count == 0) {
-        inode_free(inode_index);
-    } else {
-        // Write updated inode to disk
-        inode_write(inode_index, inode_buf);
+    // Cannot read from file if opened write-only
+    if (file->mode == FS_O_WRONLY) {
+        return FAILURE;
     }
 
-    return SUCCESS;
+    // Read bytes at offset, leaving cursor unchanged
+    return file_read(file, buf, count, offset);
 }
 
-int fs_read(int fd, char *buf, int count) {
-    int i;
+int fs_pread(int fd, char *buf, int count, int offset) {
+    op_scope_t scope;
+
+    op_begin(&scope, FS_IO_PREAD);
+    txn_enter();
+    op_lock_read(fd, offset, count);
+    return op_end(&scope, op_pread(fd, buf, count, offset));
+}
+
+static int op_pwrite(int fd, char *buf, int count, int offset) {
     file_t *file;
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
-    char data_buf[BLOCK_SIZE];
-    int avail_bytes;
-    int index_start;
-    int bytes_read;
-    int block_offset;
-    int block_bytes;
-    int to_read;
 
     // If count is 0, return 0 immediately
     if (count == 0) {
         return 0;
     }
 
-    // Fail if given bad file descriptor
-    if (fd < 0 || fd >= MAX_FILE_COUNT) {
+    // Fail if buf is NULL
+    if (buf == NULL) {
         return FAILURE;
     }
 
-    // Fail if buf is NULL
-    if (buf == NULL) {
+    // Fail if count or offset is negative
+    if (count < 0 || offset < 0) {
         return FAILURE;
     }
 
-    // Fail if attempting to read negative number of bytes
-    if (count < 0) {
+    // Cannot write to file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Cannot write to file if opened read-only
+    if (file->mode == FS_O_RDONLY) {
+        return FAILURE;
+    }
+
+    // Write bytes at offset, leaving cursor unchanged
+    return file_write(file, buf, count, offset);
+}
+
+int fs_pwrite(int fd, char *buf, int count, int offset) {
+    op_scope_t scope;
+
+    op_begin(&scope, FS_IO_PWRITE);
+    txn_begin();
+    op_lock_write(fd, offset, count);
+    return op_end(&scope, op_pwrite(fd, buf, count, offset));
+}
+
+static int op_readv(int fd, iovec_t *iov, int iovcnt) {
+    int i;
+    file_t *file;
+    int bytes_read;
+    int total_read;
+
+    // Fail if iovec array is invalid
+    if (iov_check(iov, iovcnt) == FAILURE) {
         return FAILURE;
     }
 
     // Cannot read from file if fd entry not open
-    file = &fd_table[fd];
-    if (!file->is_open) {
+    file = file_lookup(fd);
+    if (file == NULL) {
         return FAILURE;
     }
 
@@ -576,201 +5145,299 @@ int fs_read(int fd, char *buf, int count) {
         return FAILURE;
     }
 
-    // Read file inode from disk
-    inode = inode_read(file->inode, inode_buf);
-
-    // Read no more than remaining bytes in file
-    avail_bytes = inode->size - file->cursor;
-    count = min(count, avail_bytes);
+    // Fill each buffer in turn, stopping early at end of file
+    total_read = 0;
+    for (i = 0; i < iovcnt; i++) {
+        bytes_read = file_read(file, iov[i].base, iov[i].len, file->cursor);
+        file->cursor += bytes_read;
+        total_read += bytes_read;
 
-    // Read count bytes from file blocks to buffer
-    bytes_read = 0;
-    index_start = file->cursor / BLOCK_SIZE;
-    for (i = index_start; bytes_read < count; i++) {
-        // Read file data block from disk
-        data_read(inode->blocks[i], data_buf);
+        if (bytes_read < iov[i].len) {
+            break;
+        }
+    }
 
-        // Determine offset and bytes to read in block
-        block_offset = file->cursor % BLOCK_SIZE;
-        block_bytes = BLOCK_SIZE - block_offset;
-        to_read = min(count - bytes_read, block_bytes);
+    return total_read;
+}
 
-        // Read bytes from data block to buffer
-        bcopy(
-            (unsigned char *)&data_buf[block_offset],
-            (unsigned char *)&buf[bytes_read],
-            to_read
-        );
+int fs_readv(int fd, iovec_t *iov, int iovcnt) {
+    op_scope_t scope;
 
-        // Update cursor and byte count
-        file->cursor += to_read;
-        bytes_read += to_read;
+    op_begin(&scope, FS_IO_READV);
+    txn_enter();
+    if (iov_check(iov, iovcnt) == SUCCESS) {
+        op_lock_read(fd, fd_cursor(fd), iov_bytes(iov, iovcnt));
     }
-
-    return bytes_read;
+    return op_end(&scope, op_readv(fd, iov, iovcnt));
 }
-    
-int fs_write(int fd, char *buf, int count) {
-    int i, j;
+
+static int op_writev(int fd, iovec_t *iov, int iovcnt) {
+    int i;
     file_t *file;
-    inode_t *inode;
-    char inode_buf[BLOCK_SIZE];
-    char data_buf[BLOCK_SIZE];
-    int index_start;
-    int old_used_blocks;
     int bytes_written;
-    int block_offset;
-    int block_bytes;
-    int to_write;
+    int total_written;
 
-    // If count is 0, return 0 immediately
-    if (count == 0) {
-        return 0;
+    // Fail if iovec array is invalid
+    if (iov_check(iov, iovcnt) == FAILURE) {
+        return FAILURE;
     }
 
-    // Fail if given bad file descriptor
-    if (fd < 0 || fd >= MAX_FILE_COUNT) {
+    // Cannot write to file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
         return FAILURE;
     }
 
-    // Fail if buf is NULL
-    if (buf == NULL) {
+    // Cannot write to file if opened read-only
+    if (file->mode == FS_O_RDONLY) {
         return FAILURE;
     }
 
-    // Fail if attempting to write negative number of bytes
-    if (count < 0) {
-        return FAILURE;
+    // Write each buffer in turn, stopping early if the file fills up
+    total_written = 0;
+    for (i = 0; i < iovcnt; i++) {
+        if (iov[i].len == 0) {
+            continue;
+        }
+
+        bytes_written = file_write(file, iov[i].base, iov[i].len, file->cursor);
+        if (bytes_written == FAILURE) {
+            // Report failure only if nothing was written
+            return (total_written > 0) ? total_written : FAILURE;
+        }
+        file->cursor += bytes_written;
+        total_written += bytes_written;
+
+        if (bytes_written < iov[i].len) {
+            break;
+        }
     }
 
-    // Cannot write to file if fd entry not open
-    file = &fd_table[fd];
-    if (!file->is_open) {
+    return total_written;
+}
+
+int fs_writev(int fd, iovec_t *iov, int iovcnt) {
+    op_scope_t scope;
+
+    op_begin(&scope, FS_IO_WRITEV);
+    txn_begin();
+    if (iov_check(iov, iovcnt) == SUCCESS) {
+        op_lock_write(fd, fd_cursor(fd), iov_bytes(iov, iovcnt));
+    }
+    return op_end(&scope, op_writev(fd, iov, iovcnt));
+}
+
+static int op_lseek(int fd, int offset) {
+    file_t *file;
+
+    // Fail if offset is negative
+    if (offset < 0) {
         return FAILURE;
     }
 
-    // Cannot write to file if opened read-only
-    if (file->mode == FS_O_RDONLY) {
+    // Cannot set cursor if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
         return FAILURE;
     }
 
-    // Fail if cursor set after end of last data block
-    if (file->cursor >= INODE_ADDRS * BLOCK_SIZE) {
+    // Set the cursor position and return it
+    file->cursor = offset;
+    return offset;
+}
+
+int fs_lseek(int fd, int offset) {
+    op_scope_t scope;
+
+    // The cursor belongs to this process alone
+    op_begin(&scope, FS_IO_LSEEK);
+    return op_end(&scope, op_lseek(fd, offset));
+}
+
+static int op_advise(int fd, int offset, int len, int advice) {
+    file_t *file;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    int last;
+
+    // Fail if given bad file descriptor, range or advice
+    file = file_lookup(fd);
+    if (file == NULL || offset < 0 || len < 0 || advice < FS_ADV_NORMAL ||
+        advice > FS_ADV_DONTNEED) {
         return FAILURE;
     }
 
-    // Read file inode from disk
+    // Access patterns steer readahead for later reads of the descriptor
+    if (advice != FS_ADV_WILLNEED && advice != FS_ADV_DONTNEED) {
+        file->advice = advice;
+        file->ra_window = 0;
+        return SUCCESS;
+    }
+
+    // Fetch the range now, or write it back and drop it from the cache; a
+    // length of zero reaches the end of the file
     inode = inode_read(file->inode, inode_buf);
+    last = (len == 0 || len > inode->size - offset) ?
+           inode->used_blocks - 1 : (offset + len - 1) / BLOCK_SIZE;
+    if (advice == FS_ADV_WILLNEED) {
+        file_prefetch(inode, offset / BLOCK_SIZE, last);
+    } else {
+        file_evict(inode, offset / BLOCK_SIZE, last);
+    }
 
-    // If cursor after end of file, pad with zeros up to cursor
-    index_start = inode->size / BLOCK_SIZE;
-    old_used_blocks = inode->used_blocks;
-    for (i = index_start; inode->size < file->cursor; i++) {
-        // Allocate new data block if necessary
-        if (i >= inode->used_blocks) {
-            inode->blocks[i] = block_alloc();
-            if (inode->blocks[i] == FAILURE) {
-                // Free any newly allocated blocks on failure
-                for (j = old_used_blocks; j < inode->used_blocks; j++) {
-                    block_free(inode->blocks[j]);
-                }
+    return SUCCESS;
+}
 
-                return FAILURE;
-            }
-            inode->used_blocks++;
-        }
+int fs_advise(int fd, int offset, int len, int advice) {
+    op_scope_t scope;
 
-        // Read file data block from disk
-        data_read(inode->blocks[i], data_buf);
+    // Keep writers off the range while it moves in or out of the cache
+    op_begin(&scope, FS_IO_ADVISE);
+    txn_enter();
+    op_lock_read(fd, offset, (len == 0) ? INODE_ADDRS * BLOCK_SIZE : len);
+    return op_end(&scope, op_advise(fd, offset, len, advice));
+}
 
-        // Determine offset and bytes to write in block
-        block_offset = inode->size % BLOCK_SIZE;
-        block_bytes = BLOCK_SIZE - block_offset;
-        to_write = min(file->cursor - inode->size, block_bytes);
+static int op_lockf(int fd, int cmd, int len) {
+    file_t *file;
+    range_lock_t r;
+    int result;
 
-        // Write zero padding bytes to block on disk
-        bzero(&data_buf[block_offset], to_write);
-        data_write(inode->blocks[i], data_buf);
+    // Fail if given bad file descriptor or command
+    file = file_lookup(fd);
+    if (file == NULL || cmd < FS_F_ULOCK || cmd > FS_F_TEST) {
+        return FAILURE;
+    }
 
-        // Update file size
-        inode->size += to_write;
+    // The region starts at the cursor; a negative length covers the bytes
+    // before it, and zero the rest of the file however far it grows
+    r.owner = fs_proc();
+    r.inode = file->inode;
+    r.write = TRUE;
+    if (len < 0) {
+        r.start = file->cursor + len;
+        r.end = file->cursor;
+    } else if (len == 0 || len > RECORD_LOCK_END - file->cursor) {
+        r.start = file->cursor;
+        r.end = RECORD_LOCK_END;
+    } else {
+        r.start = file->cursor;
+        r.end = file->cursor + len;
+    }
+    if (r.start < 0) {
+        return FAILURE;
     }
 
-    // Write count bytes from buffer to file blocks on disk
-    bytes_written = 0;
-    index_start = file->cursor / BLOCK_SIZE;
-    for (i = index_start; bytes_written < count && i < INODE_ADDRS; i++) {
-        // Allocate new data block if necessary
-        if (i >= inode->used_blocks) {
-            inode->blocks[i] = block_alloc();
-            if (inode->blocks[i] == FAILURE) {
-                // Free any newly allocated blocks on failure
-                for (j = old_used_blocks; j < inode->used_blocks; j++) {
-                    block_free(inode->blocks[j]);
-                }
+    // Test, take or drop the lock, waking waiters if any was dropped
+    ranges_enter();
+    if (cmd == FS_F_TEST) {
+        result = range_conflicts(record_ranges, &r) ? FAILURE : SUCCESS;
+    } else if (cmd == FS_F_ULOCK) {
+        result = record_unlock(&r);
+    } else {
+        result = record_lock(&r, cmd == FS_F_LOCK);
+    }
+    ranges_leave(cmd == FS_F_ULOCK && result == SUCCESS);
 
-                return FAILURE;
-            }
-            inode->used_blocks++;
-        }
+    return result;
+}
 
-        // Read file data block from disk
-        data_read(inode->blocks[i], data_buf);
+int fs_lockf(int fd, int cmd, int len) {
+    op_scope_t scope;
 
-        // Determine offset and bytes to write in block
-        block_offset = file->cursor % BLOCK_SIZE;
-        block_bytes = BLOCK_SIZE - block_offset;
-        to_write = min(count - bytes_written, block_bytes);
+    // Record locks are kept under their own mutex, so a process waiting
+    // for one holds no other file system lock
+    op_begin(&scope, FS_IO_LOCKF);
+    return op_end(&scope, op_lockf(fd, cmd, len));
+}
 
-        // Write bytes to data block on disk
-        bcopy(
-            (unsigned char *)&buf[bytes_written],
-            (unsigned char *)&data_buf[block_offset],
-            to_write
-        );
-        data_write(inode->blocks[i], data_buf);
+static int op_truncate(int fd, int length) {
+    file_t *file;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    int result;
 
-        // Update cursor and byte count
-        file->cursor += to_write;
-        bytes_written += to_write;
+    // Fail if length is negative or past the largest possible file
+    if (length < 0 || length > INODE_ADDRS * BLOCK_SIZE) {
+        return FAILURE;
+    }
 
-        // Update file size if necessary
-        if (inode->size < file->cursor) {
-            inode->size = file->cursor;
-        }
+    // Cannot truncate file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
     }
 
-    // Write updated inode to disk
+    // Cannot truncate file if opened read-only
+    if (file->mode == FS_O_RDONLY) {
+        return FAILURE;
+    }
+
+    // Free tail blocks when shrinking; grow with blocks reading as zeroes
+    inode = inode_read(file->inode, inode_buf);
+    if (length < inode->size) {
+        result = file_trim(file->inode, inode, length);
+    } else {
+        result = file_reserve(file->inode, inode, length);
+    }
     inode_write(file->inode, inode_buf);
 
-    return bytes_written;
+    return result;
 }
 
-int fs_lseek(int fd, int offset) {
+int fs_truncate(int fd, int length) {
+    op_scope_t scope;
+
+    // Resizing needs the file to itself
+    op_begin(&scope, FS_IO_TRUNCATE);
+    txn_begin();
+    op_lock_file(fd, TRUE);
+    return op_end(&scope, op_truncate(fd, length));
+}
+
+static int op_fallocate(int fd, int offset, int length) {
     file_t *file;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    int result;
 
-    // Fail if given bad file descriptor
-    if (fd < 0 || fd >= MAX_FILE_COUNT) {
+    // Fail if range is empty, negative or past the largest possible file
+    if (offset < 0 || length <= 0 ||
+        length > INODE_ADDRS * BLOCK_SIZE - offset) {
         return FAILURE;
     }
 
-    // Fail if offset is negative
-    if (offset < 0) {
+    // Cannot allocate for file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
         return FAILURE;
     }
 
-    // Cannot set cursor if fd entry not open
-    file = &fd_table[fd];
-    if (!file->is_open) {
+    // Cannot allocate for file if opened read-only
+    if (file->mode == FS_O_RDONLY) {
         return FAILURE;
     }
 
-    // Set the cursor position and return it
-    file->cursor = offset;
-    return offset;
+    // Reserve blocks through the end of the range, growing the file
+    inode = inode_read(file->inode, inode_buf);
+    result = file_reserve(file->inode, inode, offset + length);
+    inode_write(file->inode, inode_buf);
+
+    return result;
 }
 
-int fs_mkdir(char *fileName) {
+int fs_fallocate(int fd, int offset, int length) {
+    op_scope_t scope;
+
+    // Resizing needs the file to itself
+    op_begin(&scope, FS_IO_FALLOCATE);
+    txn_begin();
+    op_lock_file(fd, TRUE);
+    return op_end(&scope, op_fallocate(fd, offset, length));
+}
+
+static int op_mkdir(char *fileName) {
+    int wdir = fs_proc()->wdir;
     int inode_index;
     int result;
 
@@ -784,6 +5451,11 @@ int fs_mkdir(char *fileName) {
         return FAILURE;
     }
 
+    // Fail if working directory belongs to a snapshot
+    if (inode_is_read_only(wdir)) {
+        return FAILURE;
+    }
+
     // Create inode for new directory if possible
     inode_index = inode_create(DIRECTORY);
     if (inode_index == FAILURE) {
@@ -814,7 +5486,18 @@ int fs_mkdir(char *fileName) {
     return SUCCESS;
 }
 
-int fs_rmdir(char *fileName) {
+int fs_mkdir(char *fileName) {
+    op_scope_t scope;
+
+    // Directory changes exclude lookups
+    op_begin(&scope, FS_IO_MKDIR);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_mkdir(fileName));
+}
+
+static int op_rmdir(char *fileName) {
+    int wdir = fs_proc()->wdir;
     int inode_index;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
@@ -846,6 +5529,11 @@ int fs_rmdir(char *fileName) {
         return FAILURE;
     }
 
+    // Fail if some process is working in the directory
+    if (fd_wdir_in_use(inode_index)) {
+        return FAILURE;
+    }
+
     // Remove entry from working directory
     dir_remove_entry(wdir, fileName);
 
@@ -861,7 +5549,18 @@ int fs_rmdir(char *fileName) {
     return SUCCESS;
 }
 
-int fs_cd(char *dirName) {
+int fs_rmdir(char *fileName) {
+    op_scope_t scope;
+
+    // Directory changes exclude lookups
+    op_begin(&scope, FS_IO_RMDIR);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_rmdir(fileName));
+}
+
+static int op_cd(char *dirName) {
+    int wdir = fs_proc()->wdir;
     int inode_index;
 
     // Don't change directory if attempting to cd to "."
@@ -875,7 +5574,7 @@ int fs_cd(char *dirName) {
         inode_index = dir_find_entry(wdir, "..");
 
         // Set working directory to parent
-        wdir = inode_index;
+        fs_proc()->wdir = inode_index;
 
         return SUCCESS;
     }
@@ -887,12 +5586,23 @@ int fs_cd(char *dirName) {
     }
 
     // Update working directory
-    wdir = inode_index;
+    fs_proc()->wdir = inode_index;
 
     return SUCCESS;
 }
 
-int fs_link(char *old_fileName, char *new_fileName) {
+int fs_cd(char *dirName) {
+    op_scope_t scope;
+
+    // Lookups share the directory tree
+    op_begin(&scope, FS_IO_CD);
+    txn_enter();
+    op_lock(&ns_lock, FALSE);
+    return op_end(&scope, op_cd(dirName));
+}
+
+static int op_link(char *old_fileName, char *new_fileName) {
+    int wdir = fs_proc()->wdir;
     int inode_index;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
@@ -913,16 +5623,22 @@ int fs_link(char *old_fileName, char *new_fileName) {
         return FAILURE;
     }
 
+    // Fail if working directory belongs to a snapshot
+    if (inode_is_read_only(wdir)) {
+        return FAILURE;
+    }
+
     // Attempt to find old file in working directory
     inode_index = dir_find_entry(wdir, old_fileName);
     if (inode_index == FAILURE) {
         return FAILURE;
     }
 
-    // Read old file inode from disk, fail if not a file
+    // Read old file inode from disk, fail if not a writable file
+    op_lock(inode_lock(inode_index), TRUE);
     inode = inode_read(inode_index, inode_buf);
 
-    if (inode->type == DIRECTORY) {
+    if (inode->type == DIRECTORY || (inode->flags & INODE_READ_ONLY)) {
         return FAILURE;
     }
 
@@ -940,7 +5656,169 @@ int fs_link(char *old_fileName, char *new_fileName) {
     return SUCCESS;
 }
 
-int fs_unlink(char *fileName) {
+int fs_link(char *old_fileName, char *new_fileName) {
+    op_scope_t scope;
+
+    // Directory changes exclude lookups
+    op_begin(&scope, FS_IO_LINK);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_link(old_fileName, new_fileName));
+}
+
+static int op_clone(char *src_fileName, char *dst_fileName) {
+    int wdir = fs_proc()->wdir;
+    int i;
+    int src_index;
+    int dst_index;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+    inode_t src;
+    int result;
+
+    // Fail if src_fileName is NULL
+    if (src_fileName == NULL) {
+        return FAILURE;
+    }
+
+    // Fail if dst_fileName is NULL
+    if (dst_fileName == NULL) {
+        return FAILURE;
+    }
+
+    // Fail if directory has file with same name as clone
+    if (dir_find_entry(wdir, dst_fileName) != FAILURE) {
+        return FAILURE;
+    }
+
+    // Fail if working directory belongs to a snapshot
+    if (inode_is_read_only(wdir)) {
+        return FAILURE;
+    }
+
+    // Attempt to find source file in working directory
+    src_index = dir_find_entry(wdir, src_fileName);
+    if (src_index == FAILURE) {
+        return FAILURE;
+    }
+
+    // Read source file inode from disk, fail if not a file
+    op_lock(inode_lock(src_index), FALSE);
+    inode = inode_read(src_index, inode_buf);
+
+    if (inode->type == DIRECTORY) {
+        return FAILURE;
+    }
+
+    // Remember source file extent
+    src = *inode;
+    for (i = 0; i < src.used_blocks; i++) {
+        // Fail if a block cannot take another sharer
+        if (inode_slot_used(&src, i) &&
+            block_refs(src.blocks[i]) >= MAX_BLOCK_REFS) {
+            return FAILURE;
+        }
+    }
+
+    // Shared blocks are never dirtied again, so write back buffered data
+    cache_flush_inode(src_index);
+
+    // Create inode for clone if possible
+    dst_index = inode_create(FILE_TYPE);
+    if (dst_index == FAILURE) {
+        return FAILURE;
+    }
+
+    // Point clone at the source's data blocks
+    inode = inode_read(dst_index, inode_buf);
+    inode->size = src.size;
+    inode->used_blocks = src.used_blocks;
+    for (i = 0; i < src.used_blocks; i++) {
+        inode->blocks[i] = src.blocks[i];
+        if (inode_slot_used(&src, i)) {
+            block_ref(src.blocks[i]);
+        }
+    }
+    for (i = 0; i < INODE_CLUSTERS; i++) {
+        inode->packed[i] = src.packed[i];
+    }
+    inode->unwritten = src.unwritten;
+    inode_write(dst_index, inode_buf);
+
+    // Attempt to add clone to working directory
+    result = dir_add_entry(wdir, dst_index, dst_fileName);
+    if (result == FAILURE) {
+        inode_free(dst_index);
+        return FAILURE;
+    }
+
+    return SUCCESS;
+}
+
+int fs_clone(char *src_fileName, char *dst_fileName) {
+    op_scope_t scope;
+
+    // Directory changes exclude lookups
+    op_begin(&scope, FS_IO_CLONE);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_clone(src_fileName, dst_fileName));
+}
+
+static int op_snapshot(char *snapName) {
+    int snap_dir;
+    int inodes;
+    int blocks;
+    inode_t *inode;
+    char inode_buf[BLOCK_SIZE];
+
+    // Log metadata changes as one journal transaction
+    txn_begin();
+
+    // Fail if snapName is NULL
+    if (snapName == NULL) {
+        return FAILURE;
+    }
+
+    // Fail if root directory already has an entry with same name
+    if (dir_find_entry(ROOT_DIR, snapName) != FAILURE) {
+        return FAILURE;
+    }
+
+    // Count inodes and directory blocks needed, including the snapshot
+    // root, and fail unless the whole copy fits
+    inode = inode_read(ROOT_DIR, inode_buf);
+    inodes = 1;
+    blocks = inode->used_blocks;
+    if (snap_walk(FAILURE, &inodes, &blocks) == FAILURE ||
+        inodes > inode_count_free() || blocks >= block_count_free()) {
+        return FAILURE;
+    }
+
+    // Shared blocks are never dirtied again, so write back buffered data
+    cache_flush_all();
+
+    // Copy the directory tree, sharing all file data blocks
+    snap_dir = snap_make_dir(ROOT_DIR, snapName);
+    snap_walk(snap_dir, &inodes, &blocks);
+
+    // Make the whole snapshot durable
+    journal_commit();
+
+    return SUCCESS;
+}
+
+int fs_snapshot(char *snapName) {
+    op_scope_t scope;
+
+    // Snapshots copy the whole tree at one instant
+    op_begin(&scope, FS_IO_SNAPSHOT);
+    txn_exclusive();
+    return op_end(&scope, op_snapshot(snapName));
+}
+
+static int op_unlink(char *fileName) {
+    int wdir = fs_proc()->wdir;
     int inode_index;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
@@ -957,6 +5835,7 @@ int fs_unlink(char *fileName) {
     }
 
     // Read file inode from disk, fail if not a file
+    op_lock(inode_lock(inode_index), TRUE);
     inode = inode_read(inode_index, inode_buf);
 
     if (inode->type == DIRECTORY) {
@@ -970,8 +5849,12 @@ int fs_unlink(char *fileName) {
     inode = inode_read(inode_index, inode_buf);
     inode->links--;
     if (inode->links == 0 && inode->fd_count == 0) {
-        inode_free(inode_index);
+        inode_orphan(inode_index, inode, inode_buf);
     } else {
+        if (inode->links == 0) {
+            inode_orphan_open(inode, inode_index);
+        }
+
         // Write updated inode to disk
         inode_write(inode_index, inode_buf);
     }
@@ -979,7 +5862,19 @@ int fs_unlink(char *fileName) {
     return SUCCESS;
 }
 
-int fs_stat(char *fileName, fileStat *buf) {
+int fs_unlink(char *fileName) {
+    op_scope_t scope;
+
+    // Directory changes exclude lookups
+    op_begin(&scope, FS_IO_UNLINK);
+    txn_begin();
+    op_lock(&ns_lock, TRUE);
+    return op_end(&scope, op_unlink(fileName));
+}
+
+static int op_stat(char *fileName, fileStat *buf) {
+    int wdir = fs_proc()->wdir;
+    int i;
     int inode_index;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
@@ -1002,6 +5897,7 @@ int fs_stat(char *fileName, fileStat *buf) {
     }
 
     // Read inode from disk
+    op_lock(inode_lock(inode_index), FALSE);
     inode = inode_read(inode_index, inode_buf);
 
     // Copy fields from inode to fileStat
@@ -1009,12 +5905,30 @@ int fs_stat(char *fileName, fileStat *buf) {
     buf->type = inode->type;
     buf->links = inode->links;
     buf->size = inode->size;
-    buf->numBlocks = inode->used_blocks;
+
+    // Count blocks on disk, which compressed clusters make fewer
+    buf->numBlocks = 0;
+    for (i = 0; i < inode->used_blocks; i++) {
+        if (inode_slot_used(inode, i)) {
+            buf->numBlocks++;
+        }
+    }
 
     return SUCCESS;
 }
 
-int fs_ls_one(int index, char *buf) {
+int fs_stat(char *fileName, fileStat *buf) {
+    op_scope_t scope;
+
+    // Lookups share the directory tree
+    op_begin(&scope, FS_IO_STAT);
+    txn_enter();
+    op_lock(&ns_lock, FALSE);
+    return op_end(&scope, op_stat(fileName, buf));
+}
+
+static int op_ls_one(int index, char *buf) {
+    int wdir = fs_proc()->wdir;
     inode_t *inode;
     char inode_buf[BLOCK_SIZE];
     char data_buf[BLOCK_SIZE];
@@ -1047,9 +5961,349 @@ int fs_ls_one(int index, char *buf) {
     entry_offset = index % block_entries;
 
     // Copy entry name from disk to string buffer
-    data_read(inode->blocks[block_index], data_buf);
+    dir_block_read(inode->blocks[block_index], data_buf);
     entries = (entry_t *)data_buf;
     str_copy(entries[entry_offset].name, buf);
 
     return SUCCESS;
 }
+
+int fs_ls_one(int index, char *buf) {
+    op_scope_t scope;
+
+    // Lookups share the directory tree
+    op_begin(&scope, FS_IO_LS);
+    txn_enter();
+    op_lock(&ns_lock, FALSE);
+    return op_end(&scope, op_ls_one(index, buf));
+}
+
+static int op_sync(void) {
+    // Write back all dirty data, then commit pending metadata
+    cache_flush_all();
+    journal_commit();
+
+    // Disk is consistent until the next operation, unless metadata was
+    // found damaged
+    if (!sblock->clean && !csum_damaged) {
+        sblock->clean = TRUE;
+        sblock_write(sblock_buf);
+    }
+
+    return SUCCESS;
+}
+
+int fs_sync(void) {
+    op_scope_t scope;
+
+    // Commits wait for operations adding to the group
+    op_begin(&scope, FS_IO_SYNC);
+    txn_exclusive();
+    return op_end(&scope, op_sync());
+}
+
+static int op_reclaim(void) {
+    // Nothing to do unless files were orphaned since the last pass
+    if (!orphans_pending) {
+        return 0;
+    }
+
+    // Free all orphans in one batch
+    txn_begin();
+    return orphan_reclaim();
+}
+
+int fs_reclaim(void) {
+    op_scope_t scope;
+
+    // Reclaiming commits the group it frees orphans in
+    op_begin(&scope, FS_IO_RECLAIM);
+    txn_exclusive();
+    return op_end(&scope, op_reclaim());
+}
+
+int fs_dedup_stat(dedupStat *buf) {
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    *buf = dedup_stats;
+    return SUCCESS;
+}
+
+int fs_checksum_stat(csumStat *buf, int bench) {
+    int i;
+    uint64_t start;
+    char block_buf[BLOCK_SIZE];
+    volatile uint32_t crc;
+
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    *buf = csum_stats;
+    buf->hardware = crc32c_hw;
+    if (!bench) {
+        return SUCCESS;
+    }
+
+    // Time checksumming a block each way, and reading one from disk
+    sblock_read(block_buf);
+    crc = ~0;
+    if (crc32c_hw) {
+        start = get_timer();
+        for (i = 0; i < CSUM_BENCH_ROUNDS; i++) {
+            crc = crc32c_sse42(crc, block_buf, BLOCK_SIZE);
+        }
+        buf->hwCycles = (get_timer() - start) >> CSUM_BENCH_SHIFT;
+    }
+
+    start = get_timer();
+    for (i = 0; i < CSUM_BENCH_ROUNDS; i++) {
+        crc = crc32c_sw(crc, block_buf, BLOCK_SIZE);
+    }
+    buf->tableCycles = (get_timer() - start) >> CSUM_BENCH_SHIFT;
+
+    start = get_timer();
+    for (i = 0; i < CSUM_BENCH_ROUNDS; i++) {
+        dev_read(SUPER_BLOCK, block_buf);
+    }
+    buf->readCycles = (get_timer() - start) >> CSUM_BENCH_SHIFT;
+
+    return SUCCESS;
+}
+
+int fs_lock_stat(lockStat *buf, int reset) {
+    int i;
+
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    // Copy every class's counters, clearing them if asked
+#ifndef FAKE
+    spinlock_acquire(&lock_stats_spinlock);
+#endif
+    for (i = 0; i < FS_LOCK_CLASSES; i++) {
+        buf[i] = lock_stats[i];
+        if (reset) {
+            bzero((char *)&lock_stats[i], sizeof(lockStat));
+        }
+    }
+#ifndef FAKE
+    spinlock_release(&lock_stats_spinlock);
+#endif
+
+    return SUCCESS;
+}
+
+int fs_io_stat(ioStat *buf, int reset) {
+    ioStat *device;
+
+    // Fail if buf is NULL
+    if (buf == NULL) {
+        return FAILURE;
+    }
+
+    // Copy every call's counters, clearing them if asked
+#ifndef FAKE
+    spinlock_acquire(&io_stats_spinlock);
+#endif
+    bcopy((unsigned char *)io_stats, (unsigned char *)buf, sizeof(io_stats));
+    if (reset) {
+        bzero((char *)io_stats, sizeof(io_stats));
+    }
+
+    // The device keeps its own totals, counted from the last reset
+    device = &buf[FS_IO_DEVICE];
+    block_counts(&device->blocksRead, &device->blocksWritten,
+                 &device->calls);
+    device->blocksRead -= io_device_base.blocksRead;
+    device->blocksWritten -= io_device_base.blocksWritten;
+    device->calls -= io_device_base.calls;
+    if (reset) {
+        io_device_base.blocksRead += device->blocksRead;
+        io_device_base.blocksWritten += device->blocksWritten;
+        io_device_base.calls += device->calls;
+    }
+#ifndef FAKE
+    spinlock_release(&io_stats_spinlock);
+#endif
+
+    return SUCCESS;
+}
+
+int fs_trace(int on) {
+    // Stopping streams out what is left and reports how much was traced
+    if (!on) {
+        return block_trace_stop();
+    }
+    block_trace_start();
+
+    return SUCCESS;
+}
+
+void fs_proc_init(fs_proc_t *proc) {
+    // A new process starts at the root with no files open
+    proc->files = NULL;
+    proc->wdir = ROOT_DIR;
+}
+
+void fs_proc_exit(void) {
+    int fd;
+    fs_proc_t *proc = fs_proc();
+
+    // Close every file the exiting process left open
+    for (fd = 0; proc->files != NULL && fd < PROC_MAX_FDS; fd++) {
+        if (fd_is_open(proc->files, fd)) {
+            fs_close(fd);
+        }
+    }
+
+    // Its pcb is reused, so leave no table or working directory behind
+    fd_table_put(proc);
+    proc->wdir = ROOT_DIR;
+}
+
+void fs_proc_enter(fs_proc_t *proc) {
+    // Following calls from this thread use another process's files
+    fs_procs_borrowed[lock_self()] = proc;
+}
+
+void fs_proc_leave(void) {
+    fs_procs_borrowed[lock_self()] = NULL;
+}
+
+static int op_fsync(int fd) {
+    file_t *file;
+
+    // Cannot sync file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Write back the file's dirty data, then commit its metadata
+    cache_flush_inode(file->inode);
+    journal_commit();
+
+    return SUCCESS;
+}
+
+int fs_fsync(int fd) {
+    op_scope_t scope;
+
+    // Commits wait for operations adding to the group
+    op_begin(&scope, FS_IO_FSYNC);
+    txn_exclusive();
+    return op_end(&scope, op_fsync(fd));
+}
+
+static int op_fdatasync(int fd) {
+    file_t *file;
+
+    // Cannot sync file if fd entry not open
+    file = file_lookup(fd);
+    if (file == NULL) {
+        return FAILURE;
+    }
+
+    // Write back the file's dirty data
+    cache_flush_inode(file->inode);
+
+    // Commit metadata only if the file's inode has pending changes
+    if (group_lookup(inode_block(file->inode)) != NULL) {
+        journal_commit();
+    }
+
+    return SUCCESS;
+}
+
+int fs_fdatasync(int fd) {
+    op_scope_t scope;
+
+    // Commits wait for operations adding to the group
+    op_begin(&scope, FS_IO_FDATASYNC);
+    txn_exclusive();
+    return op_end(&scope, op_fdatasync(fd));
+}
+
+static int op_mount(int flags) {
+    // Fail if flags is not valid
+    if ((flags & ~(FS_MOUNT_WRITE_BACK | FS_MOUNT_PRELOAD)) != 0) {
+        return FAILURE;
+    }
+
+    // Make everything durable before switching modes
+    fs_sync();
+    mount_flags = flags;
+
+    // Read metadata into memory from its home locations, reporting the
+    // number of blocks read
+    preload_release();
+    if (flags & FS_MOUNT_PRELOAD) {
+        journal_checkpoint();
+        return preload_load();
+    }
+
+    return SUCCESS;
+}
+
+int fs_mount(int flags) {
+    op_scope_t scope;
+
+    // Switching modes flushes everything under every other operation
+    op_begin(&scope, FS_IO_MOUNT);
+    txn_exclusive();
+    return op_end(&scope, op_mount(flags));
+}
+
+/* Submission ring ***********************************************************/
+
+static int ring_run(fs_sqe_t *sqe) {
+    // Each entry is an ordinary call, taking its own locks
+    if (sqe->op == FS_RING_READ) {
+        return fs_read(sqe->fd, sqe->buf, sqe->len);
+    } else if (sqe->op == FS_RING_WRITE) {
+        return fs_write(sqe->fd, sqe->buf, sqe->len);
+    } else if (sqe->op == FS_RING_OPEN) {
+        return fs_open(sqe->name, sqe->len);
+    } else if (sqe->op == FS_RING_STAT) {
+        return fs_stat(sqe->name, (fileStat *)sqe->buf);
+    } else if (sqe->op == FS_RING_CLOSE) {
+        return fs_close(sqe->fd);
+    }
+
+    return FAILURE;
+}
+
+int fs_ring_enter(fs_ring_t *ring) {
+    fs_sqe_t *sqe;
+    fs_cqe_t *cqe;
+    int count = 0;
+
+    // Fail if the ring is missing or its indices are out of step
+    if (ring == NULL ||
+        ring->sq_tail - ring->sq_head > FS_RING_ENTRIES ||
+        ring->cq_tail - ring->cq_head > FS_RING_ENTRIES) {
+        return FAILURE;
+    }
+
+    // Run queued entries in order while their completions have room, so
+    // none is ever lost; the rest wait for the next call
+    while (ring->sq_head != ring->sq_tail &&
+           ring->cq_tail - ring->cq_head < FS_RING_ENTRIES) {
+        sqe = &ring->sq[ring->sq_head % FS_RING_ENTRIES];
+        cqe = &ring->cq[ring->cq_tail % FS_RING_ENTRIES];
+        cqe->user = sqe->user;
+        cqe->result = ring_run(sqe);
+        ring->sq_head++;
+        ring->cq_tail++;
+        count++;
+    }
+
+    return count;
+}
@@ -6,22 +6,60 @@
 #ifndef FS_INCLUDED
 #define FS_INCLUDED
 
+#include "block.h"
+#ifndef FAKE
+#include "thread.h"
+#endif
+
 #define FS_SIZE 2048
 
 void fs_init(void);
-int fs_mkfs(void);
+int fs_mkfs(int flags);
+int fs_fsck(void);
 int fs_open(char *fileName, int flags);
 int fs_close(int fd);
+int fs_dup(int fd);
+int fs_fd_mode(int fd);
 int fs_read(int fd, char *buf, int count);
 int fs_write(int fd, char *buf, int count);
 int fs_lseek(int fd, int offset);
+int fs_truncate(int fd, int length);
+int fs_fallocate(int fd, int offset, int length);
+int fs_pread(int fd, char *buf, int count, int offset);
+int fs_pwrite(int fd, char *buf, int count, int offset);
+int fs_readv(int fd, iovec_t *iov, int iovcnt);
+int fs_writev(int fd, iovec_t *iov, int iovcnt);
 int fs_mkdir(char *fileName);
 int fs_rmdir(char *fileName);
 int fs_cd(char *dirName);
 int fs_link(char *old_fileName, char *new_fileName);
+int fs_clone(char *src_fileName, char *dst_fileName);
+int fs_snapshot(char *snapName);
 int fs_unlink(char *fileName);
 int fs_stat(char *fileName, fileStat *buf);
 int fs_ls_one(int index, char *buf);
+int fs_sync(void);
+int fs_reclaim(void);
+int fs_fsync(int fd);
+int fs_fdatasync(int fd);
+int fs_mount(int flags);
+int fs_dedup_stat(dedupStat *buf);
+int fs_checksum_stat(csumStat *buf, int bench);
+int fs_lock_stat(lockStat *buf, int reset);
+int fs_io_stat(ioStat *buf, int reset);
+int fs_trace(int on);
+int fs_lockf(int fd, int cmd, int len);
+int fs_advise(int fd, int offset, int len, int advice);
+int fs_ring_enter(fs_ring_t *ring);
+
+void fs_proc_init(fs_proc_t *proc);
+void fs_proc_exit(void);
+void fs_proc_enter(fs_proc_t *proc);
+void fs_proc_leave(void);
+
+/* For the page replacement policy: give back a borrowed cache frame whose
+ * blocks are all clean, without waiting. FALSE if it cannot be taken now. */
+bool_t fs_cache_reclaim(char *frame);
 
 #define MAX_FILE_NAME 32
 #define MAX_PATH_NAME 256 
@@ -34,7 +72,10 @@ int fs_ls_one(int index, char *buf);
 /* Super block ***************************************************************/
 
 #define SUPER_BLOCK 0
-#define SUPER_MAGIC_NUM 0xa455
+
+// Most unlinked files waiting for their blocks to be freed
+#define SBLOCK_MAX_ORPHANS 32
+#define SUPER_MAGIC_NUM 0xa45a // Bumped whenever the disk layout changes
 
 typedef struct {
     int magic_num; // Indicates that disk is formatted
@@ -50,12 +91,292 @@ typedef struct {
 
     int data_start; // First data block
     int data_blocks; // Number of data blocks that can be allocated
+
+    int journal_start; // First block of metadata journal
+    int journal_blocks; // Number of blocks set aside for journal
+    int journal_seq; // Sequence number of oldest live journal transaction
+
+    int hindex_start; // First block of dedup hash index
+    int hindex_blocks; // Number of blocks set aside for hash index
+
+    int csum_start; // First block of block checksum table
+    int csum_blocks; // Number of blocks set aside for checksums
+
+    int flags; // Layout options chosen at mkfs time (SBLOCK_*)
+    int clean; // Was the disk synced with no operation begun since?
+
+    int orphan_count; // Number of entries in the orphan list
+    short orphans[SBLOCK_MAX_ORPHANS]; // Unlinked inodes whose blocks have
+                                       // not been freed yet
 } sblock_t;
 
+// Data blocks are written copy-on-write, appended to a segment log
+#define SBLOCK_LOG_STRUCTURED 0x1
+
+// File blocks with identical contents are stored once and shared
+#define SBLOCK_DEDUP 0x2
+
+// File data is compressed a cluster at a time when a writer closes it
+#define SBLOCK_COMPRESS 0x4
+
+// Metadata blocks carry a CRC32C, checked whenever read from disk
+#define SBLOCK_CHECKSUM 0x8
+
+// File data blocks carry a CRC32C as well
+#define SBLOCK_CHECKSUM_DATA 0x10
+
+/* Checksums *****************************************************************/
+
+// One CRC32C per disk block, indexed by block number
+#define CSUM_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(uint32_t))
+#define CSUM_BLOCKS (FS_SIZE / CSUM_BLOCK_ENTRIES)
+
+// Reflected Castagnoli polynomial
+#define CRC32C_POLY 0x82f63b78
+
+// CPUID leaf 1 feature bit (in ecx) for SSE4.2, which adds crc32
+#define CPUID_ECX_SSE42 (1 << 20)
+
+// Benchmark averages over 2^CSUM_BENCH_SHIFT repetitions
+#define CSUM_BENCH_SHIFT 6
+#define CSUM_BENCH_ROUNDS (1 << CSUM_BENCH_SHIFT)
+
+/* Block allocation map ******************************************************/
+
+// Most inodes that can share one data block
+#define MAX_BLOCK_REFS 255
+
+/* Deduplication index *******************************************************/
+
+#define HINDEX_BLOCKS 48
+
+// Most index slots examined by one lookup or insert
+#define DEDUP_MAX_PROBES 16
+
+#define DEDUP_HASH_SEED 0xcbf29ce484222325ULL
+#define DEDUP_HASH_PRIME 0x9e3779b97f4a7c15ULL
+
+// Values of hentry_t.block that do not name a block
+#define HENTRY_FREE 0
+#define HENTRY_DELETED -1
+
+typedef struct {
+    uint32_t hash; // Low half of the block content hash
+    short block; // Data block index plus one, or HENTRY_*
+    short _padding;
+} hentry_t;
+
+#define HINDEX_BLOCK_ENTRIES (BLOCK_SIZE / sizeof(hentry_t))
+#define HINDEX_ENTRIES (HINDEX_BLOCKS * HINDEX_BLOCK_ENTRIES)
+
+/* Compression ***************************************************************/
+
+// Blocks of file data compressed together as one unit
+#define CLUSTER_BLOCKS 4
+#define CLUSTER_SIZE (CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// Positions remembered by the compressor, indexed by a hash of 3 bytes
+#define LZ_HASH_BITS 10
+#define LZ_HASH_SIZE (1 << LZ_HASH_BITS)
+
+// Each token is a literal run of (token + 1) bytes following it, or if
+// LZ_MATCH is set, a copy of ((token & ~LZ_MATCH) + LZ_MIN_MATCH) bytes
+// from a 16-bit little-endian distance back in the output
+#define LZ_MATCH 0x80
+#define LZ_MIN_MATCH 3
+#define LZ_MAX_MATCH (LZ_MATCH - 1 + LZ_MIN_MATCH)
+#define LZ_MAX_LITERALS LZ_MATCH
+
+typedef struct {
+    short packed_size; // Bytes of compressed data after the header
+    short size; // Bytes of file data the cluster expands to
+} cluster_header_t;
+
+/* Log-structured allocation *************************************************/
+
+#define LOG_SEGMENT_BLOCKS 16
+#define MAX_SEGMENTS (MAX_FILE_COUNT / LOG_SEGMENT_BLOCKS)
+
+// Free segment count at or below which the cleaner is run
+#define LOG_CLEAN_THRESHOLD 4
+
+/* Journal *******************************************************************/
+
+#define JOURNAL_BLOCKS 64
+#define JOURNAL_DESC_MAGIC 0x4a44
+#define JOURNAL_COMMIT_MAGIC 0x4a43
+
+// Most distinct metadata blocks a single file system operation can dirty
+#define TXN_MAX_BLOCKS 8
+
+// Limits on a group of operations committed together; the group keeps
+// room for TXN_MAX_BLOCKS per operation in progress
+#define GROUP_MAX_BLOCKS 32
+#define GROUP_MAX_OPS 8
+
+typedef struct {
+    int magic; // Descriptor or commit block magic number
+    int seq; // Sequence number of the transaction
+    int count; // Number of block images in the transaction
+    int blocks[GROUP_MAX_BLOCKS]; // Home locations of the block images
+} jheader_t;
+
+/* Data block cache **********************************************************/
+
+// Page frames the cache may hold, each carrying CACHE_PAGE_BLOCKS blocks.
+// Frames beyond the first are borrowed from the shared page pool and given
+// back when it runs short.
+#define CACHE_PAGES 8
+#define CACHE_PAGE_BLOCKS (PAGE_CACHE_FRAME_SIZE / BLOCK_SIZE)
+#define CACHE_BLOCKS (CACHE_PAGES * CACHE_PAGE_BLOCKS)
+
+// Most adjacent dirty blocks written back in one transfer
+#define CACHE_RUN_BLOCKS 16
+
+// Most blocks read ahead of a sequential reader, and most read into the
+// cache by one transfer
+#define READAHEAD_BLOCKS 4
+
+// Longest time dirty data or metadata may stay in memory, in units of
+// 2^20 timestamp counter cycles (about two seconds at 2 GHz)
+#define CACHE_MAX_AGE 4096
+
+// Most newly allocated blocks tracked between journal commits
+#define MAX_FRESH_BLOCKS (GROUP_MAX_OPS * INODE_ADDRS)
+
+typedef struct {
+    bool_t valid; // Does this entry hold a block?
+    bool_t dirty; // Does the block differ from its copy on disk?
+    int block; // Block number on disk
+    int inode; // Inode owning the block's data, FAILURE if unknown
+    uint32_t dirty_time; // When the block was first dirtied
+    uint32_t last_used; // Clock value at last access, for LRU eviction
+    char *data; // Cached block contents, inside a cache frame
+} cblock_t;
+
+/* Metadata preload **********************************************************/
+
+// Page frames a preloading mount may pin for metadata: enough for the inode
+// table, the allocation map and a few dozen directory blocks
+#define PRELOAD_PAGES 16
+#define PRELOAD_BLOCKS (PRELOAD_PAGES * CACHE_PAGE_BLOCKS)
+
+/* File system check *********************************************************/
+
+// Most check-and-repair rounds run before giving up on a clean result
+#define FSCK_MAX_ROUNDS 4
+
+// Most bad directory entries removed in one round
+#define FSCK_MAX_BAD_ENTRIES 16
+
+typedef struct {
+    short owner; // First inode found using the block, FAILURE if free
+    char index; // Position of the block within that owner
+    char entries; // Number of live entries if owner is a directory
+    uint8_t refs; // Number of inodes sharing the block
+} fsck_block_t;
+
+typedef struct {
+    char type; // Inode type found in the inode table
+    char links; // Number of directory entries naming the inode
+    short parent; // Directory holding the entry for a directory inode
+    uint8_t unwritten; // Reserved blocks, as in the inode
+} fsck_inode_t;
+
+/* Locking *******************************************************************/
+
+// Inodes hash onto this many reader-writer locks
+#define INODE_LOCKS 16
+
+// Most reader-writer locks one operation holds: the journal group, the
+// namespace and one file
+#define OP_MAX_LOCKS 4
+
+// Threads that may be inside the file system, each indexed by its pcb
+#ifdef FAKE
+#define LOCK_THREADS 1
+#else
+#define LOCK_THREADS PCB_TABLE_SIZE
+#endif
+
+// Lock hold and wait times are kept in units of 2^LOCK_TIME_SHIFT cycles
+#define LOCK_TIME_SHIFT 10
+
+typedef struct {
+#ifndef FAKE
+    lock_t lock;
+#endif
+    int owner; // Thread holding the lock, FAILURE if none
+    int depth; // Acquisitions by the owner not yet released
+    uint64_t since; // When the owner acquired it
+    int class; // Lock class its counters are kept under (FS_LOCK_*)
+} fs_lock_t;
+
+typedef struct {
+#ifndef FAKE
+    rwlock_t lock;
+#endif
+    int class; // Lock class its counters are kept under (FS_LOCK_*)
+} fs_rwlock_t;
+
+typedef struct {
+    fs_rwlock_t *lock; // Lock taken by the operation
+    bool_t write; // Was it taken for writing?
+    uint64_t since; // When it was taken
+} held_lock_t;
+
+// Record locks held at once by all processes together
+#define MAX_RECORD_LOCKS 32
+
+// Record locks of length 0 reach this far, past any possible file size
+#define RECORD_LOCK_END 0x7fffffff
+
+// Byte range of one file, locked by an operation for its duration or by a
+// process through fs_lockf
+typedef struct range_lock {
+    struct range_lock *next; // Next range in the same list
+    void *owner; // Thread or process holding it; its own ranges never
+                 // conflict
+    short inode; // File the range is in
+    int start; // First byte of the range
+    int end; // Byte just past the range
+    bool_t write; // Does it exclude all other ranges it overlaps?
+    uint64_t since; // When it was granted
+} range_lock_t;
+
+// Reader-writer locks taken by one file system operation, all released
+// when it returns, and the I/O it has done so far
+typedef struct op_scope {
+    struct op_scope *outer; // Operation of the same thread this one
+                            // interrupted, NULL if none
+    held_lock_t held[OP_MAX_LOCKS];
+    int count; // Number of locks held
+    bool_t reserved; // Is room held for it in the journal group?
+    range_lock_t range; // Blocks of the file it reads or writes
+    bool_t ranged; // Is the range held?
+    int op; // Call it is counted under, FS_IO_*
+    ioStat io; // Blocks and bytes it has moved; io.calls is unused
+} op_scope_t;
+
 /* i-Nodes *******************************************************************/
 
 #define INODE_ADDRS 8
-#define INODE_PADDING 4
+#define INODE_PADDING 1
+#define INODE_CLUSTERS (INODE_ADDRS / CLUSTER_BLOCKS)
+
+// Inode belongs to a snapshot; its contents and entries cannot change
+#define INODE_READ_ONLY 0x1
+
+// Inode was unlinked and is on the orphan list, waiting to be freed
+#define INODE_ORPHAN 0x2
+
+// Files with fewer blocks are freed at once when unlinked; deferring them
+// would cost as much as it saves
+#define ORPHAN_MIN_BLOCKS 4
+
+// Orphans are freed before an operation once fewer blocks than this are
+// free, leaving room for a whole file and its copy
+#define ORPHAN_LOW_WATER (2 * INODE_ADDRS)
 
 typedef struct {
     int size; // File size in bytes
@@ -64,6 +385,11 @@ typedef struct {
     short used_blocks; // Number of in-use data blocks
     short blocks[INODE_ADDRS]; // File data blocks
     char links; // Number of links to the i-node
+    char flags; // Inode options (INODE_*)
+    uint8_t packed[INODE_CLUSTERS]; // Blocks holding each compressed
+                                    // cluster, 0 if stored uncompressed
+    uint8_t unwritten; // Bit i set if blocks[i] was reserved by
+                       // fs_fallocate and has not been written since
     char _padding[INODE_PADDING];
 } inode_t;
 
@@ -79,15 +405,53 @@ typedef struct {
     char _padding[ENTRY_PADDING];
 } entry_t;
 
+/* Snapshots *****************************************************************/
+
+// Deepest directory tree fs_snapshot can copy
+#define SNAPSHOT_MAX_DEPTH 16
+
+typedef struct {
+    short src; // Live directory being copied
+    short dst; // Its read-only copy in the snapshot
+    short entry; // Index of next entry of src to copy
+} snap_frame_t;
+
 /* File descriptor table *****************************************************/
 
-#define MAX_FD_ENTRIES 256
+// Processes whose state the file system keeps, each indexed by its pcb
+#ifdef FAKE
+#define FS_PROCS 1
+#else
+#define FS_PROCS PCB_TABLE_SIZE
+#endif
+
+// Processes that may have files open at once, each holding one table of
+// PROC_MAX_FDS descriptors; the host shell is the only process and gets
+// one large table. In the kernel every pcb takes a stack between STACK_MIN
+// and STACK_MAX, so there is a table for each process that can run beside
+// the kernel threads.
+#ifdef FAKE
+#define FD_TABLES 1
+#define PROC_MAX_FDS 256
+#else
+#define FD_TABLES ((STACK_MAX - STACK_MIN) / STACK_SIZE - NUM_THREADS)
+#define PROC_MAX_FDS 32
+#endif
+#define FD_MAP_WORDS (PROC_MAX_FDS / 32)
 
 typedef struct {
-    bool_t is_open; // Is this fd table entry open?
     int cursor; // Current r/w position in file (in bytes)
     short inode; // Corresponding inode index on disk
     short mode; // The file r/w mode (FS_O_RDONLY, FS_O_WRONLY, FS_ORDWR)
+    char advice; // Access pattern declared with fs_advise (FS_ADV_*)
+    char ra_window; // Blocks read ahead of the last read
+    short ra_next; // Block a sequential read would start at
 } file_t;
 
+typedef struct fd_table {
+    bool_t in_use; // Does a process hold this table?
+    uint32_t open_map[FD_MAP_WORDS]; // Bit set for each open descriptor
+    file_t files[PROC_MAX_FDS];
+} fd_table_t;
+
 #endif
\ No newline at end of file
@@ -0,0 +1,46 @@
+/*
+ * Helpers shared by the host tools fsbench, fsload and fsreplay.
+ */
+#include "hostutil.h"
+
+#include <stdlib.h>
+#include <time.h>
+
+uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int compare_times(const void *a, const void *b) {
+    uint64_t x = *(const uint64_t *)a;
+    uint64_t y = *(const uint64_t *)b;
+
+    return (x > y) - (x < y);
+}
+
+void sort_times(uint64_t *times, int count) {
+    qsort(times, count, sizeof(times[0]), compare_times);
+}
+
+double percentile_us(const uint64_t *times, int count, int p) {
+    int i = (count * p + 99) / 100 - 1;
+
+    return (count == 0) ? 0.0 : times[(i < 0) ? 0 : i] / 1000.0;
+}
+
+int prefix_of(const char *prefix, const char *name) {
+    while (*prefix != '\0' && *prefix == *name) {
+        prefix++;
+        name++;
+    }
+    return *prefix == '\0';
+}
+
+uint32_t xorshift32(uint32_t *state) {
+    *state ^= *state << 13;
+    *state ^= *state >> 17;
+    *state ^= *state << 5;
+    return *state;
+}
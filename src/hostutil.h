@@ -0,0 +1,25 @@
+/*
+ * Helpers shared by the host tools fsbench, fsload and fsreplay: timing,
+ * latency percentiles, name matching and a seeded random sequence.
+ */
+#ifndef HOSTUTIL_INCLUDED
+#define HOSTUTIL_INCLUDED
+
+#include "common.h"
+
+// Monotonic time in nanoseconds
+uint64_t now_ns(void);
+
+// Sort latencies in nanoseconds, then read percentile p of them in
+// microseconds (0 if there are none)
+void sort_times(uint64_t *times, int count);
+double percentile_us(const uint64_t *times, int count, int p);
+
+// Does name start with prefix? Selects benchmarks and personalities
+int prefix_of(const char *prefix, const char *name);
+
+// Next value of the xorshift32 sequence in *state, so runs with the same
+// seed make the same choices
+uint32_t xorshift32(uint32_t *state);
+
+#endif
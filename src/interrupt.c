@@ -44,13 +44,13 @@ void load_data_segments(int seg) {
 	inside another interrupt handler (the same thing is done in 
 	the other interrupt handlers).
 	
-	In syslib.c we put systemcall number in eax, arg1 in ebx, arg2 in ecx
-	and arg3 in edx. The return value is returned in eax.
+	In syslib.c we put systemcall number in eax, arg1 in ebx, arg2 in ecx,
+	arg3 in edx and arg4 in esi. The return value is returned in eax.
 	
 	Before entering the processor has switched to the kernel stack 
 	(PMSA p. 209, Privilege level switch whitout error code)
 */ 
-int system_call_helper(int fn, int arg1, int arg2, int arg3) {
+int system_call_helper(int fn, int arg1, int arg2, int arg3, int arg4) {
 	int	ret_val = 0;
 	
 	ASSERT2(current_running->nested_count == 0, "A process/thread that was running inside the kernel made a syscall.");
@@ -64,10 +64,10 @@ int system_call_helper(int fn, int arg1, int arg2, int arg3) {
 	}
 	/*	In C's calling convention, caller is responsible for
 		cleaning up the stack. Therefore we don't really need to
-		distinguish between different argument numbers. Just pass all 3
+		distinguish between different argument numbers. Just pass all 4
 		arguments and it will work
 	*/
-	ret_val	= syscall[fn] (arg1, arg2, arg3);
+	ret_val	= syscall[fn] (arg1, arg2, arg3, arg4);
 	
 	//	We can not leave the critical section we enter here before we return in syscall_entry.
 	//	This is due to a potential race condition on a scratch variable used by syscall_entry.
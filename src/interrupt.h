@@ -67,7 +67,7 @@ void name (void) { \
 	void	load_data_segments(int seg);
 
 	//	Helper function for system calls
-	int		system_call_helper(int fn, int arg1, int arg2, int arg3);
+	int		system_call_helper(int fn, int arg1, int arg2, int arg3, int arg4);
 
 
 	void	irq6(void);			//	Floppy interrupt
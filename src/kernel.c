@@ -54,6 +54,7 @@ static int			next_stack		= STACK_MIN;
 static unsigned int start_addr[NUM_THREADS] = {
 	(unsigned int) loader_thread,	//	Loads shell
 	(unsigned int) clock_thread,	//	Running indefinitely
+	(unsigned int) reclaim_thread,	//	Frees unlinked files
 	(unsigned int) thread2,			//	Test thread
 	(unsigned int) thread3			//	Test thread
 };
@@ -90,6 +91,7 @@ void _start(void) {
 	init_syscall(SYSCALL_MBOX_RECV,   (syscall_t) mbox_recv);
 	init_syscall(SYSCALL_MBOX_SEND,   (syscall_t) mbox_send);
 	init_syscall(SYSCALL_GETCHAR,     (syscall_t) getchar);
+	init_syscall(SYSCALL_FSCK, (syscall_t) fs_fsck);
 	init_syscall(SYSCALL_MKFS, (syscall_t) fs_mkfs);
 	init_syscall(SYSCALL_OPEN, (syscall_t) fs_open);
 	init_syscall(SYSCALL_CLOSE, (syscall_t) fs_close);
@@ -105,6 +107,28 @@ void _start(void) {
 	init_syscall(SYSCALL_READDIR,     (syscall_t) readdir);
 	init_syscall(SYSCALL_LOADPROC,    (syscall_t) loadproc);
 	init_syscall(SYSCALL_WRITE_SERIAL,(syscall_t) write_serial); 
+	init_syscall(SYSCALL_PREAD, (syscall_t) fs_pread);
+	init_syscall(SYSCALL_PWRITE, (syscall_t) fs_pwrite);
+	init_syscall(SYSCALL_READV, (syscall_t) fs_readv);
+	init_syscall(SYSCALL_WRITEV, (syscall_t) fs_writev);
+	init_syscall(SYSCALL_SYNC, (syscall_t) fs_sync);
+	init_syscall(SYSCALL_FSYNC, (syscall_t) fs_fsync);
+	init_syscall(SYSCALL_FDATASYNC, (syscall_t) fs_fdatasync);
+	init_syscall(SYSCALL_MOUNT, (syscall_t) fs_mount);
+	init_syscall(SYSCALL_CLONE, (syscall_t) fs_clone);
+	init_syscall(SYSCALL_SNAPSHOT, (syscall_t) fs_snapshot);
+	init_syscall(SYSCALL_DEDUP_STAT, (syscall_t) fs_dedup_stat);
+	init_syscall(SYSCALL_CHECKSUM_STAT, (syscall_t) fs_checksum_stat);
+	init_syscall(SYSCALL_MMAP,        (syscall_t) mmap);
+	init_syscall(SYSCALL_MUNMAP,      (syscall_t) munmap);
+	init_syscall(SYSCALL_TRUNCATE, (syscall_t) fs_truncate);
+	init_syscall(SYSCALL_FALLOCATE, (syscall_t) fs_fallocate);
+	init_syscall(SYSCALL_LOCK_STAT, (syscall_t) fs_lock_stat);
+	init_syscall(SYSCALL_LOCKF, (syscall_t) fs_lockf);
+	init_syscall(SYSCALL_RING_ENTER, (syscall_t) fs_ring_enter);
+	init_syscall(SYSCALL_ADVISE, (syscall_t) fs_advise);
+	init_syscall(SYSCALL_IO_STAT, (syscall_t) fs_io_stat);
+	init_syscall(SYSCALL_TRACE, (syscall_t) fs_trace);
 
 	init_idt();
 	init_gdt();
@@ -547,6 +571,7 @@ static int create_thread(int i) {
 
 	p->swap_loc				= 0;
 	p->swap_size			= 0;
+	fs_proc_init(&p->fs);
 	/* Sets p->page_directory = &(created page directory) */
 	setup_page_table(p);
 	insert_pcb(p);
@@ -600,6 +625,7 @@ static int create_process(uint32_t location, uint32_t size) {
 
 	p->swap_loc				= location;
 	p->swap_size			= size;
+	fs_proc_init(&p->fs);
 	setup_page_table(p);
 
 	insert_pcb(p);
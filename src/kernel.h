@@ -55,7 +55,7 @@ enum {
 	/*	Number of threads initially started by the kernel. Change
 		this when adding to or removing elements from the start_addr array.
 	*/
-	NUM_THREADS						= 4,
+	NUM_THREADS						= 5,
 	
 	//	Number of pcbs the OS supports
 	PCB_TABLE_SIZE					= 128,
@@ -118,6 +118,7 @@ typedef struct pcb_t {
 					*previous;
 	uint32_t	inV86; // set when in virtual 86 mode.
 	uint32_t	v86_if; // true when interrupts are enabled.
+	fs_proc_t	fs;						//	Open files and working directory
 } pcb_t;
 
 /*	Structure describing the contents of an interrupt gate entry.
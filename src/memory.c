@@ -17,6 +17,7 @@
 #include "util.h"
 #include "interrupt.h"
 #include "usb.h"
+#include "fs.h"
 
 //	Static prototypes
 	/*	page_alloc allocates a page.  If necessary, it swaps a page out.
@@ -41,6 +42,18 @@
 	//	return the disk_sector of the given page
 	static int		page_disk_sector(page_map_entry_t *page);
 
+	//	return the mapping of process p that covers vaddr, or NULL
+	static mmap_region_t	*mmap_lookup(pcb_t *p, uint32_t vaddr);
+
+	//	number of bytes of a mapping that live in the page at offset start
+	static int		mmap_page_bytes(mmap_region_t *region, int start);
+
+	//	write the i-th page back to the file it maps
+	static void		mmap_write_back(int pageno);
+
+	//	kill the current process for a bad access to its mmap window
+	static void		mmap_fault_kill(void);
+
 //	Static global variables
 	//	the page map
 	static page_map_entry_t		page_map[PAGEABLE_PAGES];
@@ -48,6 +61,13 @@
 	//	lock to control the access to the page map
 	static lock_t				page_map_lock;
 
+	//	file mappings, protected by page_map_lock
+	static mmap_region_t		mmap_regions[MMAP_MAX_REGIONS];
+
+	//	cache pages lent out, and how many of them the replacement policy wants back
+	static int					page_cache_lent;
+	static int					page_cache_wanted;
+
 	//	address of the kernel page directory (shared by all kernel threads)
 	static uint32_t				*kernel_pdir;
 
@@ -290,9 +310,20 @@ void page_fault_handler(void) {
 						*pta;		//	page table address
 	int					pidx;		//	page index in page map
 	page_map_entry_t	*page;		//	ptr to page map entry of a page
+	mmap_region_t		*region;	//	mapping covering the faulting address
 	
 	current_running->page_fault_count++;
 	lock_acquire(&page_map_lock);
+
+	/*	The mmap window has no process image behind it. A fault there that
+		no mapping covers, or a store to a read-only mapping, is a bug in
+		the process, which is killed rather than given image sectors.
+	*/
+	region	= mmap_lookup(current_running, current_running->fault_addr & PE_BASE_ADDR_MASK);
+	if ((current_running->fault_addr >= MMAP_START) &&
+		((region == NULL) ||
+		 (((current_running->error_code & PF_WRITE) != 0) && ((region->mode & PE_RW) == 0))))
+		mmap_fault_kill();
 	
 	pdi		= get_directory_index(current_running->fault_addr);
 	pde		= current_running->page_directory[pdi];
@@ -332,12 +363,192 @@ void page_fault_handler(void) {
 		page->vaddr		= current_running->fault_addr & PE_BASE_ADDR_MASK;
 		page->entry		= &pta[pti];
 		page->pinned	= FALSE;
+		page->region	= region;
 		
 		page_swap_in(pidx);
 	}
 	lock_release(&page_map_lock);
 }
 
+/*	Map a file range into the current process.
+
+	The mapping holds its own descriptor (fs_dup), so the caller may close
+	'fd' afterwards. Each region slot owns a fixed window of
+	MMAP_REGION_PAGES pages in the process page table, which is always
+	present, so no page tables need to be allocated here. Nothing is read
+	until the process touches the range.
+
+	A descriptor opened FS_O_RDONLY gives a read-only mapping. A store to
+	it, or a touch of the window past the mapped length or after munmap(),
+	kills the process; the rest of the system goes on.
+*/
+uint32_t mmap(int fd, int offset, int length) {
+	mmap_region_t	*region;
+	int				i, mode;
+
+	//	only processes have a private page table to map into
+	if (current_running->is_thread)
+		return 0;
+	if ((length <= 0) || (length > MMAP_REGION_PAGES * PAGE_SIZE) ||
+		(offset < 0) || ((offset & PAGE_MASK) != 0))
+		return 0;
+
+	//	faults read the file, so write-only descriptors cannot be mapped
+	mode = fs_fd_mode(fd);
+	if ((mode != FS_O_RDONLY) && (mode != FS_O_RDWR))
+		return 0;
+
+	lock_acquire(&page_map_lock);
+
+	//	find a free region slot
+	region = NULL;
+	for (i = 0; (i < MMAP_MAX_REGIONS) && (region == NULL); i++) {
+		if (mmap_regions[i].owner == NULL)
+			region = &mmap_regions[i];
+	}
+	if (region != NULL) {
+		region->fd = fs_dup(fd);
+		if (region->fd < 0)
+			region = NULL;
+	}
+	if (region == NULL) {
+		lock_release(&page_map_lock);
+		return 0;
+	}
+
+	region->owner	= current_running;
+	region->offset	= offset;
+	region->length	= length;
+	region->vaddr	= MMAP_START + (region - mmap_regions) * MMAP_REGION_PAGES * PAGE_SIZE;
+	region->mode	= (mode == FS_O_RDWR) ? (PE_RW | PE_US) : PE_US;
+
+	lock_release(&page_map_lock);
+	return region->vaddr;
+}
+
+
+//	Remove a mapping made by mmap(), writing its dirty pages back to the file
+int munmap(uint32_t addr) {
+	mmap_region_t	*region;
+	int				i;
+
+	lock_acquire(&page_map_lock);
+
+	region = mmap_lookup(current_running, addr);
+	if ((region == NULL) || (region->vaddr != addr)) {
+		lock_release(&page_map_lock);
+		return -1;
+	}
+
+	//	write back and release the resident pages of the mapping
+	for (i = 0; i < PAGEABLE_PAGES; i++) {
+		if (page_map[i].region != region)
+			continue;
+		if ((*page_map[i].entry & (PE_P | PE_D)) == (PE_P | PE_D))
+			mmap_write_back(i);
+		*page_map[i].entry = 0;
+		invalidate_page((uint32_t *) page_map[i].vaddr);
+
+		//	the page is free again: page_swap_out() skips it
+		page_map[i].owner	= NULL;
+		page_map[i].vaddr	= 0;
+		page_map[i].entry	= NULL;
+		page_map[i].region	= NULL;
+	}
+
+	fs_close(region->fd);
+	region->owner = NULL;
+
+	lock_release(&page_map_lock);
+	return 0;
+}
+
+
+//	Remove every mapping of the current process
+void munmap_all(void) {
+	int		i;
+
+	for (i = 0; i < MMAP_MAX_REGIONS; i++) {
+		if (mmap_regions[i].owner == current_running)
+			munmap(mmap_regions[i].vaddr);
+	}
+}
+
+/*	Lend a page to the file system's block cache. A pinned page stays
+	lent until the file system frees it; others are asked back under pressure.
+
+	The fault handler may be filling a mapped page through the file system
+	while holding page_map_lock, so never wait for it: the cache simply
+	does without another page this time.
+*/
+char *page_cache_alloc(bool_t pinned) {
+	int		pidx;
+
+	if (!lock_try_acquire(&page_map_lock))
+		return NULL;
+
+	pidx						= page_alloc(pinned);
+	page_map[pidx].cached		= TRUE;
+	page_map[pidx].referenced	= TRUE;
+	if (!pinned)
+		page_cache_lent++;
+
+	lock_release(&page_map_lock);
+	return (char *) page_addr(pidx);
+}
+
+
+//	Take back a page lent to the file system cache. The cache has written back its blocks.
+void page_cache_free(char *frame) {
+	page_map_entry_t	*page = &page_map[((uint32_t) frame - MEM_START) / PAGE_SIZE];
+
+	//	the page is free again: page_swap_out() skips it
+	enter_critical();
+	if (!page->pinned) {
+		page_cache_lent--;
+		if (page_cache_wanted > 0)
+			page_cache_wanted--;
+	}
+	page->cached		= FALSE;
+	page->referenced	= FALSE;
+	page->pinned		= FALSE;
+	leave_critical();
+}
+
+
+//	Note a use of a cache page, giving it another pass of the clock
+void page_cache_touch(char *frame) {
+	uint32_t	addr = (uint32_t) frame;
+
+	//	the cache's own page is not part of the pool
+	if ((addr >= MEM_START) && (addr < MAX_PHYSICAL_MEMORY))
+		page_map[(addr - MEM_START) / PAGE_SIZE].referenced = TRUE;
+}
+
+
+//	Number of pages the file system cache should give back
+int page_cache_pressure(void) {
+	return page_cache_wanted;
+}
+
+
+/*	Pin contiguous pages for good, for a kernel table too large to sit in
+	the kernel image. The pool hands pages out in order until it first
+	runs dry, so this must be called during boot.
+*/
+char *page_static_alloc(int frames) {
+	int		i, first;
+
+	lock_acquire(&page_map_lock);
+	first = page_alloc(TRUE);
+	for (i = 1; i < frames; i++) {
+		if (page_alloc(TRUE) != first + i)
+			HALT("Static pages must be allocated during boot");
+	}
+	lock_release(&page_map_lock);
+	return (char *) page_addr(first);
+}
+
 //	Other local functions
 
 
@@ -370,6 +581,8 @@ static int page_alloc(int pinned) {
 	page_map[page].vaddr	= 0;
 	page_map[page].entry	= NULL;
 	page_map[page].pinned	= pinned; 
+	page_map[page].region	= NULL;
+	page_map[page].cached	= FALSE;
 	
 	//	Zero out page before returning 
 	p						= page_addr(page);
@@ -393,29 +606,49 @@ static uint32_t *page_addr(int i) {
 }
 
 
-//	Decide which page to replace, return the page number 
+/*	Decide which page to replace, return the page number 
+
+	Process pages and file system cache pages share one clock. A page used
+	since the hand last passed it gets a second chance. An unused cache page
+	whose blocks are clean is taken back from the file system at once. One
+	with dirty blocks, or whose blocks the file system is working on, is
+	left, and the file system is asked to give one back at its next
+	operation instead.
+*/
 static int page_replacement_policy(void) {
 	static int		page = -1;
-	bool_t			found;
+	bool_t			asked;
 	int				i;
 	
-	//	check if there is any page not pinned
-	found	= FALSE;
-	i = 0;
-	while ((!found) && (i < PAGEABLE_PAGES)) {
-		i++;
-		found = (page_map[i].pinned == FALSE);
-	}
-	ASSERT2(found, "All pages pinned");
-	
-	//	Cycle through looking for an unpinned page.  Avoid last swapped page if possible. 
-	while (1) {
+	//	Two sweeps: the first may only clear reference bits
+	asked = FALSE;
+	for (i = 0; i <= 2 * PAGEABLE_PAGES; i++) {
 		page++;
 		if (page >= PAGEABLE_PAGES)
 			page = 0;
-		if (page_map[page].pinned == FALSE)
-			return page;
+		if (page_map[page].pinned)
+			continue;
+		if (page_map[page].cached) {
+			if (page_map[page].referenced)
+				page_map[page].referenced = FALSE;
+			else if (fs_cache_reclaim((char *) page_addr(page)))
+				return page;
+			else if (!asked && (page_cache_wanted < page_cache_lent)) {
+				page_cache_wanted++;
+				asked = TRUE;
+			}
+			continue;
+		}
+		if ((page_map[page].entry != NULL) && ((*page_map[page].entry & PE_A) != 0)) {
+			*page_map[page].entry &= ~PE_A;
+			if (page_map[page].owner == current_running)
+				invalidate_page((uint32_t *) page_map[page].vaddr);
+			continue;
+		}
+		return page;
 	}
+	HALT("All pages pinned");
+	return -1;
 }
 
 
@@ -423,14 +656,26 @@ static int page_replacement_policy(void) {
 static void page_swap_in(int pageno) {
 	page_map_entry_t	*page	= &page_map[pageno];
 	uint32_t			addr	= (uint32_t) page_addr(pageno);
-	int					sector	= page_disk_sector(page),
-						i, nsectors;
+	int					sector, i, nsectors;
 	
 	print_str(23, 50, "pid ");
 	print_int(23, 54, current_running->pid);
 	print_str(23, 57, "rding page ");
 	print_int(23, 68, pageno);
 
+	//	mapped file pages come from the file system, not the image
+	if (page->region != NULL) {
+		mmap_region_t	*region	= page->region;
+		int				start	= page->vaddr - region->vaddr;
+
+		//	bytes past the end of the file stay zero (page_alloc cleared them)
+		fs_pread(region->fd, (char *) addr, mmap_page_bytes(region, start),
+				 region->offset + start);
+		*page->entry = region->mode | PE_P | PE_A | addr;
+		return;
+	}
+
+	sector	= page_disk_sector(page);
 	if ((sector + SECTORS_PER_PAGE) >
 		(page->owner->swap_loc + page->owner->swap_size)) {
 		/*	if the final sector is past the end of the image
@@ -473,6 +718,10 @@ static void page_swap_in(int pageno) {
 static void page_swap_out(int pageno) {
 	page_map_entry_t	*page = &page_map[pageno];
 	
+	//	pages released by munmap() have nothing to save
+	if (page->entry == NULL)
+		return;
+
 	print_str(24, 50, "pid ");
 	print_int(24, 54, current_running->pid);
 	print_str(24, 57, "wting page ");
@@ -494,8 +743,12 @@ static void page_swap_out(int pageno) {
 
 	print_str(24, 71, "0");
 
+	//	dirty mapped file pages go back to the file
+	if ((page->region != NULL) && ((*page->entry & PE_D) != 0)) {
+		mmap_write_back(pageno);
+	}
 	//	if page is dirty
-	if ((*page->entry & PE_D) != 0) {
+	else if ((*page->entry & PE_D) != 0) {
 		int			i, sector, nsectors;
 		uint32_t	addr;
 
@@ -531,3 +784,68 @@ static int page_disk_sector(page_map_entry_t *page) {
 	return page->owner->swap_loc + ((page->vaddr - PROCESS_START) / PAGE_SIZE) * SECTORS_PER_PAGE;
 }
 
+//	Find the mapping of process p whose window holds vaddr
+static mmap_region_t *mmap_lookup(pcb_t *p, uint32_t vaddr) {
+	int		i;
+
+	for (i = 0; i < MMAP_MAX_REGIONS; i++) {
+		if ((mmap_regions[i].owner == p) &&
+			(vaddr >= mmap_regions[i].vaddr) &&
+			(vaddr < mmap_regions[i].vaddr + mmap_regions[i].length))
+			return &mmap_regions[i];
+	}
+	return NULL;
+}
+
+//	Bytes of the mapping in the page starting 'start' bytes into it
+static int mmap_page_bytes(mmap_region_t *region, int start) {
+	if (region->length - start < PAGE_SIZE)
+		return region->length - start;
+	return PAGE_SIZE;
+}
+
+/*	Write a dirty mapped page back through the file system. Only the bytes
+	inside the mapping are written, so a mapping that ends past the end of
+	the file grows the file to the mapped length.
+*/
+static void mmap_write_back(int pageno) {
+	page_map_entry_t	*page	= &page_map[pageno];
+	mmap_region_t		*region	= page->region;
+	int					start	= page->vaddr - region->vaddr;
+
+	//	the descriptor is in the table of the process owning the mapping
+	fs_proc_enter(&region->owner->fs);
+	fs_pwrite(region->fd, (char *) page_addr(pageno),
+			  mmap_page_bytes(region, start), region->offset + start);
+	fs_proc_leave();
+	*page->entry &= ~PE_D;
+}
+
+//	Report a bad access to the mmap window and end the faulting process
+static void mmap_fault_kill(void) {
+	PRINT_INFO(1, "Bad mmap access", print_str, "");
+	PRINT_INFO(2, "PID", print_int, current_running->pid);
+	PRINT_INFO(3, "Fault address", print_hex, current_running->fault_addr);
+	PRINT_INFO(4, "Error code", print_hex, current_running->error_code);
+
+	//	exit() takes the lock again to release the mappings
+	lock_release(&page_map_lock);
+
+	/*	Inside a system call the kernel may hold locks the process would
+		never release, so that fault is as fatal as the other exceptions.
+	*/
+	if ((current_running->error_code & PF_USER) == 0)
+		HALT("Bad mmap access from the kernel");
+
+	/*	Unwind exception_14 as it would on return, then enter the kernel
+		again as system_call_helper does, so exit() ends the process exactly
+		like SYSCALL_EXIT. The frame of exception_14_entry is abandoned
+		with the rest of the stack.
+	*/
+	enter_critical();
+	current_running->nested_count--;
+	ASSERT2(current_running->nested_count == 0, "Bad mmap access while nested");
+	current_running->nested_count++;
+	leave_critical();
+	exit();
+}
@@ -27,6 +27,10 @@ enum {
 	PE_BASE_ADDR_BITS			= 12,			//	position of base address
 	PE_BASE_ADDR_MASK			= 0xfffff000,	//	extracts the base address
 
+	//	page fault error code bits
+	PF_WRITE					= 1 << 1,		//	the faulting access was a store
+	PF_USER						= 1 << 2,		//	the faulting access was made in user mode
+
 	//	Constants to simulate a very small physical memory.
 	MEM_START					= 0x100000,		//	== 1MB
 	PAGEABLE_PAGES				= 128,
@@ -45,15 +49,34 @@ enum {
 													a page directory entry */
 	
 	PAGE_TABLE_SIZE         	= (1024*4096 -1),	//	size of a page table in bytes
+
+	//	file mappings made by mmap()
+	MMAP_MAX_REGIONS			= 16,			//	mappings in the whole system
+	MMAP_REGION_PAGES			= 4,			//	virtual window of one mapping
+	MMAP_START					= PROCESS_START + PTABLE_SPAN / 2,	/*	first window, in the
+													process page table */
 };
 
 #ifndef MAKE_PRE_FILE
+//	a file range mapped into a process by mmap()
+typedef struct {
+    pcb_t		*owner;			//	process the range is mapped into (NULL if free)
+    int			fd;				//	private descriptor held by the mapping
+    int			offset;			//	file offset of the first mapped byte
+    int			length;			//	number of bytes mapped
+    uint32_t	vaddr;			//	page-aligned virtual address of the mapping
+    uint32_t	mode;			//	page table mode of resident pages
+} mmap_region_t;
+
 //	structure of an entry in the page map
 typedef struct {
     pcb_t		*owner;			//	process that owns this page
     uint32_t	vaddr;			//	page-aligned virtual address of this page
     uint32_t	*entry;			//	entry that points to this page
     bool_t		pinned;			//	is this page pinned?
+    mmap_region_t	*region;	//	file mapping backing this page, or NULL
+    bool_t		cached;			//	is this page lent to the file system cache?
+    bool_t		referenced;		//	cache page used since the clock last passed
 } page_map_entry_t;
 #endif
 
@@ -70,6 +93,19 @@ typedef struct {
 		Should handle demand paging 
 	*/
 	void	page_fault_handler(void);
+
+	/*	Map 'length' bytes of the open file 'fd', starting at the page-aligned
+		'offset', into the address space of the current process. Pages are
+		read from the file on first touch. Returns the address of the mapping,
+		or 0 on failure.
+	*/
+	uint32_t	mmap(int fd, int offset, int length);
+
+	//	Write dirty pages back to the file and remove the mapping at 'addr'
+	int		munmap(uint32_t addr);
+
+	//	Remove every mapping of the current process, called from exit()
+	void	munmap_all(void);
 	
 	//	Use virtual address to get index in page directory.
 	inline uint32_t	get_directory_index(uint32_t vaddr);
@@ -2,9 +2,16 @@
 
 import sys
 
+import test
 from test import spawn_lnxsh, issue, do_exit
 
 
+def do_crash():
+    # Stop the shell without syncing, as a power cut would
+    issue('crash')
+    return test.p.communicate()[0]
+
+
 def mkfs_tests():
     print '***** Mkfs Tests *****'
 
@@ -98,6 +105,55 @@ def close_tests():
     sys.stdout.flush()
  
 
+def fd_tests():
+    print '***** Descriptor Tests *****'
+    issue('mkfs')
+    issue('create a 5')
+    issue('mkdir d')
+
+    # The lowest free descriptor is reused
+    issue('open a 1')
+    issue('open a 1')
+    issue('close 0')
+    issue('open a 1')
+
+    # The shell's table holds 256 descriptors (the last open should fail)
+    issue('repeat 254 open a 1')
+    issue('open a 1')
+    issue('close 255')
+    issue('open a 1')
+    issue('repeat 256 close $i')
+    issue('open a 1')
+
+    # Descriptors outlive a change of working directory, and names are
+    # looked up in the new one
+    issue('cd d')
+    issue('read 0 5')
+    issue('open a 1')
+    issue('create a 3')
+    issue('open a 1')
+    issue('read 1 3')
+    issue('cd ..')
+    issue('lseek 1 0')
+    issue('read 1 3')
+
+    # fsck keeps the working directory and open files, which are valid
+    issue('cd d')
+    issue('fsck')
+    issue('lseek 0 0')
+    issue('read 0 5')
+    issue('ls')
+
+    # A new disk starts the shell again at the root with no files open
+    issue('mkfs')
+    issue('read 0 5')
+    issue('ls')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
 def read_tests():
     print '***** Read Tests *****'
     issue('mkfs')
@@ -230,6 +286,412 @@ def write_tests():
     sys.stdout.flush()
 
 
+def pread_pwrite_tests():
+    print '***** Pread/Pwrite Tests *****'
+    issue('mkfs')
+
+    # Try to pread/pwrite unopened file descriptor (should fail)
+    issue('pread 0 1 0')
+    issue('pwrite 0 x 0')
+
+    # Try negative offsets (should fail)
+    issue('create a 32')
+    issue('open a 3')
+    issue('pread 0 1 -1')
+    issue('pwrite 0 x -1')
+
+    # Read at explicit offsets, cursor should not move
+    issue('pread 0 4 10')
+    issue('pread 0 4 0')
+    issue('read 0 2')
+    issue('pread 0 4 30')
+    issue('pread 0 4 40')
+
+    # Write at explicit offsets, cursor should not move
+    issue('pwrite 0 XYZ 5')
+    issue('write 0 ab')
+    issue('cat a')
+
+    # Write past end of file pads with zeros
+    issue('pwrite 0 end 40')
+    issue('stat a')
+    issue('pread 0 3 40')
+
+    # Respect file modes
+    issue('close 0')
+    issue('open a 1')
+    issue('pwrite 0 x 0')
+    issue('close 0')
+    issue('open a 2')
+    issue('pread 0 1 0')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def truncate_tests():
+    print '***** Truncate/Fallocate Tests *****'
+    issue('mkfs')
+
+    # Try to truncate/fallocate unopened file descriptor (should fail)
+    issue('truncate 0 0')
+    issue('fallocate 0 0 10')
+
+    # Try bad lengths and ranges (should fail)
+    issue('create a 40')
+    issue('open a 3')
+    issue('truncate 0 -1')
+    issue('truncate 0 5000')
+    issue('fallocate 0 -1 10')
+    issue('fallocate 0 0 0')
+    issue('fallocate 0 4000 200')
+
+    # Shrink, then grow again; dropped bytes come back as zeros
+    issue('truncate 0 10')
+    issue('stat a')
+    issue('truncate 0 20')
+    issue('stat a')
+    issue('pread 0 20 0')
+
+    # Reserved space reads as zeros until written
+    issue('fallocate 0 100 2000')
+    issue('stat a')
+    issue('pread 0 4 1000')
+    issue('pwrite 0 log 1000')
+    issue('pread 0 4 999')
+    issue('truncate 0 0')
+    issue('stat a')
+    issue('close 0')
+
+    # Respect file modes
+    issue('open a 1')
+    issue('truncate 0 0')
+    issue('fallocate 0 0 10')
+    issue('close 0')
+    issue('fsck')
+
+    print do_exit()
+    print '************************************'
+    sys.stdout.flush()
+
+
+def readv_writev_tests():
+    print '***** Readv/Writev Tests *****'
+    issue('mkfs')
+
+    # Try to readv/writev unopened file descriptor (should fail)
+    issue('readv 0 1 1')
+    issue('writev 0 x y')
+
+    # Gather several buffers into one write
+    issue('open a 3')
+    issue('writev 0 hello, vectored world')
+    issue('cat a')
+
+    # Scatter one read into several buffers
+    issue('lseek 0 0')
+    issue('readv 0 5 2 8')
+    issue('read 0 5')
+
+    # Short read at end of file fills only leading buffers
+    issue('lseek 0 10')
+    issue('readv 0 4 4 4')
+
+    # Try negative buffer size, alone and after a good one (fs_readv
+    # should fail the whole call without reading)
+    issue('lseek 0 0')
+    issue('readv 0 -1')
+    issue('readv 0 2 -1')
+    issue('read 0 5')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def sync_tests():
+    print '***** Sync Tests *****'
+    issue('mkfs')
+
+    # Try bad mount modes and unopened fds (should fail)
+    issue('mount sideways')
+    issue('fsync 0')
+    issue('fdatasync 0')
+
+    # Buffered writes are visible before and after syncing
+    issue('mount writeback')
+    issue('open a 3')
+    issue('write 0 buffered')
+    issue('cat a')
+    issue('fdatasync 0')
+    issue('write 0 _more')
+    issue('fsync 0')
+    issue('close 0')
+    issue('create b 45')
+    issue('sync')
+    issue('cat b')
+    issue('mount writethrough')
+
+    print do_exit()
+
+    # Data written in write-back mode survives a restart
+    spawn_lnxsh()
+    issue('mount writeback')
+    issue('create c 20')
+    issue('open a 3')
+    issue('lseek 0 8')
+    issue('write 0 !')
+    print do_exit()
+
+    spawn_lnxsh()
+    issue('ls')
+    issue('cat a')
+    issue('cat c')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def log_tests():
+    print '***** Log Tests *****'
+    issue('mkfs log')
+
+    # Overwrites relocate blocks but contents stay the same
+    issue('create a 40')
+    issue('open a 3')
+    issue('lseek 0 4')
+    issue('write 0 log')
+    issue('pwrite 0 end 30')
+    issue('close 0')
+    issue('cat a')
+    issue('stat a')
+
+    print do_exit()
+
+    # Relocated blocks survive a restart
+    spawn_lnxsh()
+    issue('cat a')
+    issue('mkfs')
+    issue('ls')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def crash_tests():
+    print '***** Crash Tests *****'
+    issue('mkfs')
+    issue('mount writeback')
+
+    # Commit one transaction, then stop in the middle of the next
+    issue('create a 20')
+    issue('mkdir d')
+    issue('open b 3')
+    issue('write 0 committed')
+    issue('fsync 0')
+    issue('mkdir e')
+    issue('open c 3')
+    issue('write 1 lost')
+    issue('write 0 _lost')
+
+    print do_crash()
+
+    # The committed transaction is replayed and the open one is gone
+    spawn_lnxsh()
+    issue('ls')
+    issue('cat a')
+    issue('cat b')
+    issue('stat b')
+    issue('cd d')
+    issue('ls')
+    issue('cd ..')
+    issue('fsck')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def fsck_tests():
+    print '***** Fsck Tests *****'
+    issue('mkfs')
+
+    # A freshly made file system needs no repairs
+    issue('fsck')
+
+    # Nor does one with files, links, directories and an open orphan
+    issue('create a 20')
+    issue('mkdir d')
+    issue('cd d')
+    issue('create b 30')
+    issue('link b c')
+    issue('open e 3')
+    issue('write 0 orphan')
+    issue('unlink e')
+    issue('cd ..')
+    issue('fsck')
+    issue('cd d')
+    issue('lseek 0 0')
+    issue('read 0 6')
+    issue('ls')
+    issue('stat b')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def dedup_tests():
+    print '***** Dedup Tests *****'
+    issue('mkfs dedup')
+
+    # Try a bad mkfs option (should fail)
+    issue('mkfs sideways')
+
+    # Identical files share their blocks
+    issue('create a 600')
+    issue('create b 600')
+    issue('dedup')
+
+    # Changing one copy leaves the other intact
+    issue('open b 3')
+    issue('write 0 changed')
+    issue('close 0')
+    issue('cat a')
+    issue('cat b')
+    issue('fsck')
+
+    print do_exit()
+
+    # Index survives a restart
+    spawn_lnxsh()
+    issue('create c 600')
+    issue('dedup')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def compress_tests():
+    print '***** Compress Tests *****'
+    issue('mkfs compress')
+
+    # Repetitive file is stored in fewer blocks once closed
+    issue('create a 3000')
+    issue('stat a')
+    issue('cat a')
+
+    # Writing to a compressed cluster expands it, closing recompresses
+    issue('open a 3')
+    issue('write 0 changed')
+    issue('stat a')
+    issue('close 0')
+    issue('stat a')
+    issue('cat a')
+    issue('fsck')
+
+    print do_exit()
+
+    # Compressed data survives a restart
+    spawn_lnxsh()
+    issue('cat a')
+
+    print do_exit()
+    print '**************************'
+    sys.stdout.flush()
+
+
+def checksum_tests():
+    print '***** Checksum Tests *****'
+    issue('mkfs checksum-data')
+
+    # Blocks are summed as they are written and checked as they are read
+    issue('create a 600')
+    issue('mkdir d')
+    issue('cd d')
+    issue('create b 30')
+    issue('cd ..')
+    issue('fsck')
+    issue('sync')
+
+    print do_exit()
+
+    # Flip a byte in the first data block of file a (block 101)
+    disk = open('disk', 'r+b')
+    disk.seek(101 * 512 + 7)
+    disk.write('!')
+    disk.close()
+
+    # Reading the damaged block fails; fsck reports it and leaves it failing
+    spawn_lnxsh()
+    issue('cat a')
+    issue('checksum')
+    issue('fsck')
+    issue('checksum')
+    issue('cat a')
+    issue('cd d')
+    issue('cat b')
+
+    print do_exit()
+
+    # A block freed while dirty and then reserved again is not damaged
+    spawn_lnxsh()
+    issue('mkfs checksum-data')
+    issue('mount writeback')
+    issue('open f 3')
+    issue('write 0 hello')
+    issue('truncate 0 0')
+    issue('fallocate 0 0 600')
+    issue('close 0')
+    issue('fsck')
+
+    print do_exit()
+    print '**************************'
+    sys.stdout.flush()
+
+
+def preload_tests():
+    print '***** Preload Tests *****'
+    issue('mkfs')
+    issue('mkdir d')
+    issue('cd d')
+    issue('create a 100')
+    issue('cd ..')
+
+    # Try a bad preload option (should fail)
+    issue('mount writethrough sideways')
+
+    # Metadata is read up front, then changes keep the copy current
+    issue('mount writethrough preload')
+    issue('mkdir e')
+    issue('cd d')
+    issue('create b 600')
+    issue('ls')
+    issue('stat a')
+    issue('cd ..')
+    issue('rmdir e')
+    issue('ls')
+    issue('fsck')
+
+    print do_exit()
+
+    # Preloaded view agrees with the disk after a restart
+    spawn_lnxsh()
+    issue('mount writeback preload')
+    issue('cd d')
+    issue('ls')
+    issue('cat b')
+    issue('mount writethrough')
+
+    print do_exit()
+    print '*************************'
+    sys.stdout.flush()
+
+
 def mkdir_tests():
     print '***** Mkdir Tests *****'
     issue('mkfs')
@@ -346,6 +808,95 @@ def link_tests():
     sys.stdout.flush()
 
 
+def clone_tests():
+    print '***** Clone Tests *****'
+    issue('mkfs')
+
+    # Try to clone non-existent file or directory (should fail)
+    issue('clone fake fake2')
+    issue('clone . this')
+
+    # Try to name clone same as existing file (should fail)
+    issue('create f 600')
+    issue('create g 0')
+    issue('clone f g')
+
+    # Clone shares data but is a separate file
+    issue('clone f c')
+    issue('ls')
+    issue('stat c')
+
+    # Writing either file leaves the other unchanged
+    issue('open c 3')
+    issue('write 0 clone')
+    issue('close 0')
+    issue('open f 3')
+    issue('pwrite 0 orig 590')
+    issue('close 0')
+    issue('cat c')
+    issue('cat f')
+
+    # Removing one copy keeps the other's data
+    issue('unlink f')
+    issue('cat c')
+    issue('fsck')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def snapshot_tests():
+    print '***** Snapshot Tests *****'
+    issue('mkfs')
+
+    # Build a small tree and snapshot it
+    issue('create a 10')
+    issue('mkdir d')
+    issue('cd d')
+    issue('create b 20')
+    issue('cd ..')
+    issue('snapshot snap')
+    issue('ls')
+
+    # Try to reuse snapshot name (should fail)
+    issue('snapshot snap')
+
+    # Live changes do not show up in the snapshot
+    issue('open a 3')
+    issue('write 0 live')
+    issue('close 0')
+    issue('cd d')
+    issue('unlink b')
+    issue('cd ..')
+    issue('cat a')
+    issue('cd snap')
+    issue('ls')
+    issue('cat a')
+    issue('cd d')
+    issue('cat b')
+
+    # Try to change the snapshot (should fail)
+    issue('open b 3')
+    issue('open new 3')
+    issue('mkdir x')
+    issue('link b c')
+
+    # Snapshot can be removed entry by entry
+    issue('unlink b')
+    issue('cd ..')
+    issue('rmdir d')
+    issue('unlink a')
+    issue('cd ..')
+    issue('rmdir snap')
+    issue('ls')
+    issue('fsck')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
 def unlink_tests():
     print '***** Unlink Tests *****'
     issue('mkfs')
@@ -383,6 +934,43 @@ def unlink_tests():
     sys.stdout.flush()
 
 
+def orphan_tests():
+    print '***** Orphan Tests *****'
+    issue('mkfs')
+
+    # A file unlinked while open is still readable until the shell stops
+    issue('create a 600')
+    issue('open a 1')
+    issue('unlink a')
+    issue('read 0 5')
+    issue('stat a')
+
+    print do_exit()
+
+    # Its inode and blocks come back at the next mount: fsck finds no
+    # leaked blocks and a new file takes the inode
+    spawn_lnxsh()
+    issue('fsck')
+    issue('create b 600')
+    issue('ls')
+
+    # So do those of a file still open when the shell crashes
+    issue('open c 3')
+    issue('write 0 crashed')
+    issue('unlink c')
+
+    print do_crash()
+
+    spawn_lnxsh()
+    issue('fsck')
+    issue('create d 10')
+    issue('ls')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
 def stat_tests():
     print '***** Stat Tests *****'
     issue('mkfs')
@@ -454,6 +1042,241 @@ def misc_tests():
     sys.stdout.flush()
 
 
+def locks_tests():
+    print '***** Lock Tests *****'
+    issue('mkfs')
+
+    # Try an unknown option (should fail)
+    issue('locks now')
+
+    # Start from zero, then count the locks a few operations take
+    issue('locks reset')
+    issue('create a 40')
+    issue('cat a')
+    issue('stat a')
+    issue('locks')
+
+    # Counters start again after a reset
+    issue('locks reset')
+    issue('locks')
+    
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def lockf_tests():
+    print '***** Record Lock Tests *****'
+    issue('mkfs')
+    issue('create a 1000')
+    issue('open a 3')
+
+    # Lock two overlapping regions, then test one the process holds
+    issue('lockf 0 lock 100')
+    issue('lseek 0 50')
+    issue('lockf 0 tlock 100')
+    issue('lockf 0 test 10')
+
+    # Unlock the middle of the merged region, and the bytes before the
+    # cursor
+    issue('lockf 0 ulock 20')
+    issue('lseek 0 30')
+    issue('lockf 0 ulock -10')
+
+    # Lock to the end of the file and beyond
+    issue('lockf 0 lock 0')
+
+    # Try a bad command, a bad fd and a region before the file (should
+    # fail)
+    issue('lockf 0 share 10')
+    issue('lockf 5 lock 10')
+    issue('lseek 0 5')
+    issue('lockf 0 lock -10')
+
+    # Writes in place lock byte ranges, appends lock the whole file
+    issue('locks reset')
+    issue('lseek 0 0')
+    issue('write 0 hello')
+    issue('pwrite 0 world 1025')
+    issue('locks')
+
+    # Closing the file drops its record locks
+    issue('close 0')
+    issue('open a 3')
+    issue('lockf 0 tlock 0')
+    issue('close 0')
+    issue('fsck')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def ring_tests():
+    print '***** Ring Tests *****'
+    issue('mkfs')
+    issue('create a 50')
+
+    # Queue an open, a read, a write, a stat and a close, then run them
+    # all with one submit
+    issue('queue open a 3')
+    issue('queue read 0 10')
+    issue('queue write 0 XYZ')
+    issue('queue stat a')
+    issue('queue close 0')
+    issue('submit')
+    issue('reap')
+
+    # Failed calls complete with their error
+    issue('queue read 0 10')
+    issue('queue stat b')
+    issue('submit')
+    issue('reap')
+
+    # Try a bad operation and an oversized read (should fail)
+    issue('queue seek 0 1')
+    issue('queue read 0 100')
+
+    # A slot stays busy until its completion is reaped (should fail
+    # until the reap)
+    for i in range(17):
+        issue('queue stat a')
+    issue('submit')
+    issue('queue stat a')
+    issue('reap')
+    issue('queue stat a')
+    issue('submit')
+    issue('reap')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def advise_tests():
+    print '***** Advise Tests *****'
+    issue('mkfs')
+    issue('create a 2000')
+    issue('open a 1')
+
+    # Declare each access pattern, then read the file with it
+    issue('advise 0 0 0 sequential')
+    issue('read 0 40')
+    issue('advise 0 0 0 random')
+    issue('pread 0 40 1200')
+    issue('advise 0 0 0 normal')
+    issue('read 0 40')
+
+    # Fetch part of the file ahead of use, then drop it again
+    issue('advise 0 500 1000 willneed')
+    issue('pread 0 40 1500')
+    issue('advise 0 0 0 dontneed')
+    issue('pread 0 40 1500')
+
+    # Try a bad hint, a bad fd and a negative range (should fail)
+    issue('advise 0 0 0 often')
+    issue('advise 4 0 0 willneed')
+    issue('advise 0 -1 10 willneed')
+    issue('close 0')
+    issue('fsck')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def iostat_tests():
+    print '***** I/O Stat Tests *****'
+    issue('mkfs')
+    issue('iostat reset')
+
+    # Count a small write and read of one file, and the device traffic
+    issue('create a 600')
+    issue('open a 1')
+    issue('read 0 40')
+    issue('close 0')
+    issue('stat a')
+    issue('iostat')
+
+    # Counters start over after a reset; sync writes the dirty blocks
+    issue('iostat reset')
+    issue('mount writeback')
+    issue('create b 100')
+    issue('sync')
+    issue('iostat')
+
+    # Try a bad argument (should fail)
+    issue('iostat all')
+
+    print do_exit()
+    print '**************************'
+    sys.stdout.flush()
+
+
+def trace_tests():
+    print '***** Trace Tests *****'
+    issue('mkfs')
+
+    # Record the block requests of a few calls, then stop
+    issue('trace on')
+    issue('mkdir d')
+    issue('cd d')
+    issue('create a 100')
+    issue('cat a')
+    issue('sync')
+    issue('trace off')
+
+    # Nothing is recorded while tracing is off
+    issue('trace on')
+    issue('trace off')
+
+    # Try a bad argument (should fail)
+    issue('trace maybe')
+
+    print do_exit()
+    print '***********************'
+    sys.stdout.flush()
+
+
+def script_tests():
+    print '***** Script Tests *****'
+    issue('mkfs')
+
+    # Repeat one command, numbering each pass
+    issue('repeat 3 create f$i 5')
+    issue('ls')
+
+    # Loops nest, and $i is the pass of the innermost one
+    issue('mkdir d')
+    issue('loop 2')
+    issue('cd d')
+    issue('loop 2')
+    issue('create g$i 3')
+    issue('end')
+    issue('cd ..')
+    issue('end')
+    issue('cd d')
+    issue('ls')
+    issue('cd ..')
+
+    # A loop of no passes runs nothing
+    issue('loop 0')
+    issue('unlink f0')
+    issue('end')
+    issue('stat f0')
+
+    # Try bad counts and a bare time (should fail)
+    issue('repeat many ls')
+    issue('loop x')
+    issue('ls')
+    issue('end')
+    issue('time')
+
+    print do_exit()
+    print '************************'
+    sys.stdout.flush()
+
+
 def main():
     print '============================'
     print ' Running my custom tests... '
@@ -469,12 +1292,48 @@ def main():
     spawn_lnxsh()
     close_tests()
 
+    spawn_lnxsh()
+    fd_tests()
+
     spawn_lnxsh()
     read_tests()
 
     spawn_lnxsh()
     write_tests()
 
+    spawn_lnxsh()
+    pread_pwrite_tests()
+
+    spawn_lnxsh()
+    truncate_tests()
+
+    spawn_lnxsh()
+    readv_writev_tests()
+
+    spawn_lnxsh()
+    sync_tests()
+
+    spawn_lnxsh()
+    log_tests()
+
+    spawn_lnxsh()
+    crash_tests()
+
+    spawn_lnxsh()
+    fsck_tests()
+
+    spawn_lnxsh()
+    dedup_tests()
+
+    spawn_lnxsh()
+    compress_tests()
+
+    spawn_lnxsh()
+    checksum_tests()
+
+    spawn_lnxsh()
+    preload_tests()
+
     spawn_lnxsh()
     mkdir_tests()
 
@@ -487,15 +1346,45 @@ def main():
     spawn_lnxsh()
     link_tests()
 
+    spawn_lnxsh()
+    clone_tests()
+
+    spawn_lnxsh()
+    snapshot_tests()
+
     spawn_lnxsh()
     unlink_tests()
 
+    spawn_lnxsh()
+    orphan_tests()
+
     spawn_lnxsh()
     stat_tests()
 
     spawn_lnxsh()
     misc_tests()
 
+    spawn_lnxsh()
+    locks_tests()
+
+    spawn_lnxsh()
+    lockf_tests()
+
+    spawn_lnxsh()
+    ring_tests()
+
+    spawn_lnxsh()
+    advise_tests()
+
+    spawn_lnxsh()
+    iostat_tests()
+
+    spawn_lnxsh()
+    trace_tests()
+
+    spawn_lnxsh()
+    script_tests()
+
 
 if __name__ == '__main__':
     main()
@@ -0,0 +1,57 @@
+/* process5.c
+ *
+ * Checks that a process touching its mmap window outside the
+ * mapping is killed. Maps one page of a file, reads and writes
+ * it, and then reads the next page of the window, which no
+ * mapping covers. The kernel should kill the process there, so
+ * "FAILED" is never printed.
+ */
+#include "common.h"
+#include "syslib.h"
+#include "util.h"
+
+#define LINE 6
+#define FILE_NAME "mmaptest"
+#define MAP_SIZE 4096 /* one page */
+#define CHUNK 256
+
+void _start(void)
+{
+    int fd, i;
+    volatile char *map;
+    char data[CHUNK], c;
+
+    print_str(LINE, 0, "Process 5 (mmap)");
+
+    /* a file with one page of data to map */
+    for (i = 0; i < CHUNK; i++)
+	data[i] = 'a' + i % 26;
+    if ((fd = fs_open(FILE_NAME, FS_O_RDWR)) < 0) {
+	print_str(LINE, 20, "Cannot create the file");
+	exit();
+    }
+    for (i = 0; i < MAP_SIZE / CHUNK; i++) {
+	if (fs_write(fd, data, CHUNK) != CHUNK) {
+	    print_str(LINE, 20, "Cannot write the file");
+	    exit();
+	}
+    }
+    if ((map = mmap(fd, 0, MAP_SIZE)) == NULL) {
+	print_str(LINE, 20, "mmap failed");
+	exit();
+    }
+
+    /* inside the mapping: faults are served from the file */
+    if (map[0] != 'a' || map[MAP_SIZE - 1] != data[(MAP_SIZE - 1) % CHUNK]) {
+	print_str(LINE, 20, "FAILED: wrong mapped data");
+	exit();
+    }
+    map[0] = 'A';
+    print_str(LINE, 20, "Mapping OK, touching past it");
+
+    /* outside the mapping, inside the window: the process is killed */
+    c = map[MAP_SIZE];
+    print_str(LINE, 20, "FAILED: not killed             ");
+    print_int(LINE, 50, c);
+    exit();
+}
@@ -0,0 +1,232 @@
+/*
+ * Replays a block request trace against a disk image.
+ *
+ * Usage: fsreplay [-p] <trace>
+ *
+ * The trace is what `trace on` and `trace off` recorded: BLOCK_TRACE_FILE
+ * from lnxsh, or the serial output of the kernel, whose other lines are
+ * skipped. Every request is issued again, in order, to the image in ./disk
+ * through the fake block device; writes carry a fill pattern, so replay
+ * into a copy of an image that matters. With -p requests keep the spacing
+ * their timestamps give, read as microseconds as lnxsh records them;
+ * otherwise they are issued back to back. One JSON object is printed:
+ * request latency percentiles, blocks moved, how far the device had to seek
+ * between requests, and the blocks each file system call asked for.
+ */
+#include "common.h"
+#include "block.h"
+#include "hostutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+// Longest trace line that is read as a whole
+#define LINE_MAX_CHARS 128
+
+typedef struct {
+    uint32_t time;
+    char op;
+    int block;
+    int count;
+    int call;
+} request_t;
+
+static const char *call_names[FS_IO_CLASSES] = {
+    "mkfs", "fsck", "mount", "open", "close", "dup", "read", "write",
+    "pread", "pwrite", "readv", "writev", "lseek", "advise", "lockf",
+    "truncate", "fallocate", "mkdir", "rmdir", "cd", "link", "clone",
+    "snapshot", "unlink", "stat", "ls", "sync", "fsync", "fdatasync",
+    "reclaim", "other", "device"
+};
+
+static request_t *requests;
+static int request_count;
+static int skipped;
+
+static uint64_t *times;
+static int call_reads[FS_IO_CLASSES];
+static int call_writes[FS_IO_CLASSES];
+
+/* Loading *******************************************************************/
+
+static bool_t parse_request(char *line, request_t *r) {
+    unsigned int time;
+    char op;
+
+    // Lines that are not trace records are left out
+    if (sscanf(line, "%u %c %d %d %d", &time, &op, &r->block, &r->count,
+               &r->call) != 5 ||
+        (op != BLOCK_TRACE_READ && op != BLOCK_TRACE_WRITE) ||
+        r->block < 0 || r->count <= 0 || r->call < 0 ||
+        r->call >= FS_IO_CLASSES) {
+        return FALSE;
+    }
+    r->time = time;
+    r->op = op;
+
+    return TRUE;
+}
+
+static void load_trace(FILE *f) {
+    char line[LINE_MAX_CHARS];
+    int room = 0;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        // Grow the request array as the trace is read
+        if (request_count == room) {
+            room = (room == 0) ? 1024 : room * 2;
+            requests = realloc(requests, room * sizeof(request_t));
+            if (requests == NULL) {
+                fprintf(stderr, "fsreplay: out of memory\n");
+                exit(1);
+            }
+        }
+        if (parse_request(line, &requests[request_count])) {
+            request_count++;
+        } else {
+            skipped++;
+        }
+    }
+}
+
+/* Replay ********************************************************************/
+
+static void wait_until(uint64_t when) {
+    struct timespec ts;
+    uint64_t now = now_ns();
+
+    if (when > now) {
+        ts.tv_sec = (when - now) / 1000000000ULL;
+        ts.tv_nsec = (when - now) % 1000000000ULL;
+        nanosleep(&ts, NULL);
+    }
+}
+
+static void print_calls(const char *name, int *blocks) {
+    int i;
+    int first = TRUE;
+
+    printf("\"%s\":{", name);
+    for (i = 0; i < FS_IO_CLASSES; i++) {
+        if (blocks[i] != 0) {
+            printf("%s\"%s\":%d", first ? "" : ",", call_names[i], blocks[i]);
+            first = FALSE;
+        }
+    }
+    printf("}");
+}
+
+int main(int argc, char **argv) {
+    FILE *f;
+    request_t *r;
+    char *buf = NULL;
+    int buf_blocks = 0;
+    int paced = FALSE;
+    int i, j;
+    int reads = 0, writes = 0;
+    int sequential = 0;
+    long long seek_blocks = 0;
+    int next_block = -1;
+    uint64_t start, elapsed, issued;
+    double seconds;
+
+    // Parse options
+    if (argc == 3 && argv[1][0] == '-' && argv[1][1] == 'p') {
+        paced = TRUE;
+        argv++;
+        argc--;
+    }
+    if (argc != 2) {
+        fprintf(stderr, "Usage: fsreplay [-p] <trace>\n");
+        return 1;
+    }
+    f = fopen(argv[1], "r");
+    if (f == NULL) {
+        perror(argv[1]);
+        return 1;
+    }
+    load_trace(f);
+    fclose(f);
+    if (request_count == 0) {
+        fprintf(stderr, "fsreplay: no requests in %s\n", argv[1]);
+        return 1;
+    }
+    times = malloc(request_count * sizeof(uint64_t));
+    if (times == NULL) {
+        fprintf(stderr, "fsreplay: out of memory\n");
+        return 1;
+    }
+
+    block_init();
+    start = now_ns();
+    for (i = 0; i < request_count; i++) {
+        r = &requests[i];
+
+        // Make room for the largest request so far
+        if (r->count > buf_blocks) {
+            buf_blocks = r->count;
+            buf = realloc(buf, buf_blocks * BLOCK_SIZE);
+            if (buf == NULL) {
+                fprintf(stderr, "fsreplay: out of memory\n");
+                return 1;
+            }
+        }
+
+        // Count how far the device moves from where the last request ended
+        if (next_block >= 0) {
+            if (r->block == next_block) {
+                sequential++;
+            }
+            seek_blocks += (r->block > next_block) ? r->block - next_block
+                                                   : next_block - r->block;
+        }
+        next_block = r->block + r->count;
+
+        if (paced) {
+            wait_until(start + (uint64_t)(r->time - requests[0].time) *
+                                   1000ULL);
+        }
+        issued = now_ns();
+        if (r->op == BLOCK_TRACE_READ) {
+            block_read_many(r->block, r->count, buf);
+            reads += r->count;
+            call_reads[r->call] += r->count;
+        } else {
+            for (j = 0; j < r->count * BLOCK_SIZE; j++) {
+                buf[j] = 'a' + (r->block + j / BLOCK_SIZE) % 26;
+            }
+            block_write_many(r->block, r->count, buf);
+            writes += r->count;
+            call_writes[r->call] += r->count;
+        }
+        times[i] = now_ns() - issued;
+    }
+    elapsed = now_ns() - start;
+    seconds = elapsed / 1e9;
+
+    // Percentiles come from the sorted individual times
+    sort_times(times, request_count);
+    printf("{\"trace\":\"%s\",\"requests\":%d,\"skipped\":%d,"
+           "\"paced\":%d,\"seconds\":%.6f,\"requests_per_sec\":%.1f,"
+           "\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f,"
+           "\"blocks_read\":%d,\"blocks_written\":%d,"
+           "\"sequential\":%d,\"seek_blocks\":%lld,",
+           argv[1], request_count, skipped, paced, seconds,
+           (seconds > 0) ? request_count / seconds : 0.0,
+           percentile_us(times, request_count, 50),
+           percentile_us(times, request_count, 90),
+           percentile_us(times, request_count, 99),
+           percentile_us(times, request_count, 100), reads, writes,
+           sequential, seek_blocks);
+    print_calls("reads_by_call", call_reads);
+    printf(",");
+    print_calls("writes_by_call", call_writes);
+    printf("}\n");
+
+    free(buf);
+    free(times);
+    free(requests);
+
+    return 0;
+}
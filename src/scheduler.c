@@ -8,6 +8,8 @@
 #include "thread.h"
 #include "util.h"
 #include "time.h"
+#include "memory.h"
+#include "fs.h"
 
 static int	eflags = INIT_EFLAGS;	// contents of EFlags when a job is started for the first time
 
@@ -165,6 +167,10 @@ void dispatch(void) {
 	will not be scheduled in the future
 */
 void exit(void) {
+	//	Write back the file mappings and close open files while
+	//	interrupts are still on
+	munmap_all();
+	fs_proc_exit();
 	enter_critical();
 	current_running->status = EXITED;
 	//	Removes job from ready queue, and dispatchs next job to run
@@ -9,10 +9,12 @@
 
 #ifdef FAKE
 #define START main
+#define START_ARGS int ac, char **av
 #include "fs.h"
 #include <stdlib.h>
 #else
 #define START _start
+#define START_ARGS void
 #include "syslib.h"
 #endif
 
@@ -25,19 +27,49 @@ static void readLine( void);
 static void parseLine( void);
 static void usage( char *s);
 
+static int nextLine( void);
+static void shell_loop( int timed);
+static void shell_repeat( void);
+static void shell_time( void);
+
 static void shell_exit( void);
+static void shell_crash( void);
 static void shell_fire( void);
 static void shell_clearscreen( void);
 static void shell_mkfs( void);
+static void shell_fsck( void);
 static void shell_open( void);
 static void shell_read( void);
 static void shell_write( void);
 static void shell_lseek( void);
+static void shell_truncate( void);
+static void shell_fallocate( void);
+static void shell_lockf( void);
+static void shell_advise( void);
+static void shell_pread( void);
+static void shell_pwrite( void);
+static void shell_readv( void);
+static void shell_writev( void);
 static void shell_close( void);
+static void shell_sync( void);
+static void shell_fsync( void);
+static void shell_fdatasync( void);
+static void shell_mount( void);
+static void shell_dedup( void);
+static void shell_checksum( void);
+static void shell_locks( void);
+static void shell_iostat( void);
+static void print_iostat( int reset);
+static void shell_trace( void);
+static void shell_queue( void);
+static void shell_submit( void);
+static void shell_reap( void);
 static void shell_mkdir( void);
 static void shell_rmdir( void);
 static void shell_cd( void);
 static void shell_link( void);
+static void shell_clone( void);
+static void shell_snapshot( void);
 static void shell_unlink( void);
 static void shell_stat( void);
 
@@ -55,8 +87,11 @@ static void shell_loadproc ( void );
     } \
 }
 
-int START(void)
+int START(START_ARGS)
 {
+#ifdef FAKE
+	shellArgs( ac, av);
+#endif
 	writeStr( "ShellShock Version 0.000003");
 	writeChar( RETURN);
 	writeChar( RETURN);
@@ -64,17 +99,25 @@ int START(void)
 	shell_init();
     
 	while( 1) {
-		writeStr( "# ");
-		readLine();
+		if ( !nextLine())
+			shell_exit();
 		parseLine();
 
 		if ( argc == 0)
 			continue;
 
 		EXEC_COMMAND( "exit",   1,  1, "", shell_exit());
+		EXEC_COMMAND( "crash",  1,  1, "", shell_crash());
+		EXEC_COMMAND( "loop",   2,  2, " <count>", shell_loop( FALSE));
+		EXEC_COMMAND( "repeat", 3,  MAX_LINE, " <count> <command>",
+			      shell_repeat());
+		EXEC_COMMAND( "time",   2,  MAX_LINE, " <command>", shell_time());
 		EXEC_COMMAND( "fire",   1,  1, "", shell_fire());
 		EXEC_COMMAND( "clear",  1,  1, "", shell_clearscreen());
-		EXEC_COMMAND( "mkfs",   1,  1, "", shell_mkfs());
+		EXEC_COMMAND( "mkfs",   1,  5,
+			      " [log] [dedup] [compress] [checksum[-data]]",
+			      shell_mkfs());
+		EXEC_COMMAND( "fsck",   1,  1, "", shell_fsck());
 		EXEC_COMMAND( "open",   3,  3, " <filename> <flag>",
 			      shell_open());
 		EXEC_COMMAND( "read",   3,  3, " <fd> <size>",
@@ -83,11 +126,44 @@ int START(void)
 			      shell_write());
 		EXEC_COMMAND( "lseek",  3,  3, " <fd> <offset>",
 			      shell_lseek());
+		EXEC_COMMAND( "truncate", 3, 3, " <fd> <length>",
+			      shell_truncate());
+		EXEC_COMMAND( "fallocate", 4, 4, " <fd> <offset> <length>",
+			      shell_fallocate());
+		EXEC_COMMAND( "lockf",  4,  4, " <fd> <ulock|lock|tlock|test> <len>",
+			      shell_lockf());
+		EXEC_COMMAND( "advise", 5,  5, " <fd> <offset> <len> <normal|random|"
+			      "sequential|willneed|dontneed>", shell_advise());
+		EXEC_COMMAND( "pread",  4,  4, " <fd> <size> <offset>",
+			      shell_pread());
+		EXEC_COMMAND( "pwrite", 4,  4, " <fd> <string> <offset>",
+			      shell_pwrite());
+		EXEC_COMMAND( "readv",  3,  2 + MAX_IOV_COUNT,
+			      " <fd> <size> [<size> ...]", shell_readv());
+		EXEC_COMMAND( "writev", 3,  2 + MAX_IOV_COUNT,
+			      " <fd> <string> [<string> ...]", shell_writev());
 		EXEC_COMMAND( "mkdir",  2,  2, " <dirname>", shell_mkdir());
 		EXEC_COMMAND( "rmdir",  2,  2, " <dirname>", shell_rmdir());
 		EXEC_COMMAND( "cd",     2,  2, " <dirname>", shell_cd());
 		EXEC_COMMAND( "close",  2,  2, " <fd>", shell_close());
+		EXEC_COMMAND( "sync",   1,  1, "", shell_sync());
+		EXEC_COMMAND( "fsync",  2,  2, " <fd>", shell_fsync());
+		EXEC_COMMAND( "fdatasync", 2, 2, " <fd>", shell_fdatasync());
+		EXEC_COMMAND( "mount",  2,  3, " <writethrough|writeback> [preload]",
+			      shell_mount());
+		EXEC_COMMAND( "dedup",  1,  1, "", shell_dedup());
+		EXEC_COMMAND( "checksum", 1, 2, " [bench]", shell_checksum());
+		EXEC_COMMAND( "locks",  1,  2, " [times|reset]", shell_locks());
+		EXEC_COMMAND( "iostat", 1,  2, " [reset]", shell_iostat());
+		EXEC_COMMAND( "trace",  2,  2, " <on|off>", shell_trace());
+		EXEC_COMMAND( "queue",  3,  4,
+			      " <read|write|open|stat|close> <fd|name> [<arg>]",
+			      shell_queue());
+		EXEC_COMMAND( "submit", 1,  1, "", shell_submit());
+		EXEC_COMMAND( "reap",   1,  1, "", shell_reap());
 		EXEC_COMMAND( "link",   3,  3, " <src> <dest>", shell_link());
+		EXEC_COMMAND( "clone",  3,  3, " <src> <dest>", shell_clone());
+		EXEC_COMMAND( "snapshot", 2, 2, " <name>", shell_snapshot());
 		EXEC_COMMAND( "unlink", 2,  2, " <name>", shell_unlink());
 		EXEC_COMMAND( "stat",   2,  2, " <name>", shell_stat());
 		EXEC_COMMAND( "ls",     1,  2, "", shell_ls());
@@ -141,15 +217,299 @@ static void readLine( void) {
     line[i] = 0;
 }
 
+/* Loops and timed commands being run, innermost last. Their lines are
+   kept in one pool, each frame's after those of the frames it runs in */
+#define MAX_FRAMES 8
+#define MAX_BODY_LINES 64
+
+static char body[MAX_BODY_LINES][MAX_LINE+1];
+static int body_used;
+
+static struct {
+    int first;		/* first of its lines in body */
+    int lines;		/* lines it runs each pass */
+    int next;		/* next line to run in this pass */
+    int pass;		/* passes run so far; $i in its lines */
+    int passes;		/* passes to run */
+    int loop;		/* is it a loop, whose pass $i names? */
+    int timed;		/* report time and I/O when it is done? */
+    uint64_t start;
+    ioStat io;		/* device totals, and hits, when it started */
+} frames[MAX_FRAMES];
+static int frame_count;
+
+static void io_totals( ioStat *total) {
+    static ioStat status[FS_IO_CLASSES];
+    int i;
+
+    bzero( (char *)total, sizeof( ioStat));
+    if ( fs_io_stat( status, FALSE) == -1)
+	return;
+    *total = status[FS_IO_DEVICE];
+    for ( i = 0; i < FS_IO_DEVICE; i++)
+	total->cacheHits += status[i].cacheHits;
+}
+
+static void time_report( int n) {
+    ioStat now;
+    char s[12];
+
+    io_totals( &now);
+    writeStr( "Time: ");
+    itoa( shellElapsedUs( frames[n].start), s); writeStr( s);
+    writeStr( " us, ");
+    itoa( now.blocksRead - frames[n].io.blocksRead, s); writeStr( s);
+    writeStr( " read, ");
+    itoa( now.blocksWritten - frames[n].io.blocksWritten, s); writeStr( s);
+    writeStr( " written, ");
+    itoa( now.calls - frames[n].io.calls, s); writeStr( s);
+    writeStr( " transfers, ");
+    itoa( now.cacheHits - frames[n].io.cacheHits, s); writeStr( s);
+    writeStr( " hits");
+    writeChar( RETURN);
+}
+
+/* Copy a frame's line into line, with $i replaced by the pass of the
+   innermost loop */
+static void expandLine( char *src) {
+    char s[12];
+    int i = 0, j, n;
+
+    for ( n = frame_count - 1; n > 0 && !frames[n].loop; n--)
+	;
+    itoa( frames[n].pass, s);
+    while ( *src != 0 && i < MAX_LINE) {
+	if ( src[0] == '$' && src[1] == 'i' && frames[n].loop) {
+	    for ( j = 0; s[j] != 0 && i < MAX_LINE; j++)
+		line[i++] = s[j];
+	    src += 2;
+	} else
+	    line[i++] = *src++;
+    }
+    line[i] = 0;
+}
+
+/* Read a line typed or from the script; FALSE once input has run out */
+static int inputLine( char *prompt) {
+    if ( !shellBatch())
+	writeStr( prompt);
+    readLine();
+    if ( endOfInput() && line[0] == 0)
+	return FALSE;
+    if ( shellBatch()) {
+	writeStr( prompt); writeStr( line); writeChar( RETURN);
+    }
+    return TRUE;
+}
+
+/* Put the next command to run in line; FALSE once there are none */
+static int nextLine( void) {
+    int n;
+
+    while ( frame_count > 0) {
+	n = frame_count - 1;
+	if ( frames[n].next < frames[n].lines) {
+	    expandLine( body[frames[n].first + frames[n].next++]);
+	    if ( shellBatch()) {
+		writeStr( "# "); writeStr( line); writeChar( RETURN);
+	    }
+	    return TRUE;
+	}
+
+	/* Start the next pass, or finish */
+	frames[n].next = 0;
+	if ( ++frames[n].pass < frames[n].passes)
+	    continue;
+	if ( frames[n].timed)
+	    time_report( n);
+	body_used = frames[n].first;
+	frame_count--;
+    }
+    return inputLine( "# ");
+}
+
+/* Start a frame running lines already added to body from first on */
+static void pushFrame( int first, int passes, int loop, int timed) {
+    frames[frame_count].first = first;
+    frames[frame_count].lines = body_used - first;
+    frames[frame_count].next = 0;
+    frames[frame_count].pass = 0;
+    frames[frame_count].passes = passes;
+    frames[frame_count].loop = loop;
+    frames[frame_count].timed = timed;
+    if ( timed) {
+	io_totals( &frames[frame_count].io);
+	frames[frame_count].start = shellClock();
+    }
+    frame_count++;
+}
+
+/* Add the words of argv from first on to body as one line */
+static int addWords( int first) {
+    char *s;
+    int i, j = 0;
+
+    if ( body_used == MAX_BODY_LINES || frame_count == MAX_FRAMES)
+	return FALSE;
+    s = body[body_used];
+    for ( i = first; i < argc; i++) {
+	if ( j + strlen( argv[i]) + 1 > MAX_LINE)
+	    return FALSE;
+	if ( i > first)
+	    s[j++] = ' ';
+	bcopy( (unsigned char *)argv[i], (unsigned char *)&s[j],
+	       strlen( argv[i]));
+	j += strlen( argv[i]);
+    }
+    s[j] = 0;
+    body_used++;
+    return TRUE;
+}
+
+/* The first word of s, after an optional "time", is "loop" */
+static int opensLoop( char *s) {
+    while ( *s == ' ')
+	s++;
+    if ( s[0] == 't' && s[1] == 'i' && s[2] == 'm' && s[3] == 'e' &&
+	 s[4] == ' ') {
+	s += 4;
+	while ( *s == ' ')
+	    s++;
+    }
+    return s[0] == 'l' && s[1] == 'o' && s[2] == 'o' && s[3] == 'p' &&
+	   ( s[4] == ' ' || s[4] == 0);
+}
+
+static int isEnd( char *s) {
+    while ( *s == ' ')
+	s++;
+    return s[0] == 'e' && s[1] == 'n' && s[2] == 'd' &&
+	   ( s[3] == ' ' || s[3] == 0);
+}
+
+/* Read the next line of a loop body: from the frame running the loop
+   command, or from the input */
+static int bodyLine( void) {
+    int n = frame_count - 1;
+    int i;
+
+    if ( frame_count == 0)
+	return inputLine( "> ");
+    if ( frames[n].next == frames[n].lines)
+	return FALSE;
+    i = frames[n].first + frames[n].next++;
+    bcopy( (unsigned char *)body[i], (unsigned char *)line, MAX_LINE + 1);
+    return TRUE;
+}
+
+/* A count of passes, or -1 if s is not a number */
+static int passCount( char *s) {
+    char *p;
+
+    for ( p = s; *p != 0; p++)
+	if ( *p < '0' || *p > '9' || p - s > 6)
+	    return -1;
+    return ( p == s) ? -1 : atoi( s);
+}
+
+/* loop <count> ... end runs the lines between count times */
+static void shell_loop( int timed) {
+    int passes, first, depth = 1;
+    int full = FALSE;
+
+    /* the body is read even when the count is bad, so it is not run */
+    passes = passCount( argv[argc - 1]);
+    if ( passes < 0)
+	writeStr( "Bad count\n");
+    first = body_used;
+    while ( bodyLine()) {
+	if ( opensLoop( line))
+	    depth++;
+	else if ( isEnd( line) && --depth == 0)
+	    break;
+	if ( body_used == MAX_BODY_LINES)
+	    full = TRUE;
+	else
+	    bcopy( (unsigned char *)line, (unsigned char *)body[body_used++],
+		   MAX_LINE + 1);
+    }
+    if ( depth > 0) {
+	writeStr( "Missing end\n");
+	body_used = first;
+    } else if ( frame_count == MAX_FRAMES) {
+	writeStr( "Loops nested too deeply\n");
+	body_used = first;
+    } else if ( full) {
+	writeStr( "Loop too long\n");
+	body_used = first;
+    } else if ( passes > 0)
+	pushFrame( first, passes, TRUE, timed);
+    else
+	body_used = first;
+}
+
+/* repeat <count> <command> runs one command count times */
+static void shell_repeat( void) {
+    int first = body_used;
+    int passes = passCount( argv[1]);
+
+    if ( passes < 0) {
+	usage( " <count> <command>");
+	return;
+    }
+    if ( !addWords( 2)) {
+	writeStr( "Loop too long\n");
+	return;
+    }
+    if ( passes > 0)
+	pushFrame( first, passes, TRUE, FALSE);
+    else
+	body_used = first;
+}
+
+/* time <command> reports the wall time and device I/O of a command,
+   including a whole loop */
+static void shell_time( void) {
+    int first = body_used;
+
+    if ( same_string( argv[1], "loop")) {
+	if ( argc != 3)
+	    usage( " loop <count>");
+	else
+	    shell_loop( TRUE);
+	return;
+    }
+    if ( !addWords( 1)) {
+	writeStr( "Command too long\n");
+	return;
+    }
+    pushFrame( first, 1, FALSE, TRUE);
+}
+
 static void shell_exit( void) {
     writeStr( "Goodbye\n"); 
 #ifdef FAKE
+    fs_sync();
+    /* report where the session's device traffic went */
+    if ( getenv( "LNXSH_IOSTAT") != NULL)
+	print_iostat( FALSE);
     exit(0);
 #else
     exit();
 #endif
 }
 
+/* Stop without syncing, as a power cut would, so the next session finds
+ * the disk mid-transaction */
+static void shell_crash( void) {
+#ifdef FAKE
+    writeStr( "Crashed\n");
+    exit(0);
+#else
+    writeStr( "Not supported on the kernel.\n");
+#endif
+}
+
 static void shell_fire( void) {
     fire();
 }
@@ -159,10 +519,49 @@ static void shell_clearscreen( void) {
 }
 
 static void shell_mkfs( void) {
-    if (fs_mkfs() != 0)
+    int flags = 0;
+    int i;
+
+    for (i = 1; i < argc; i++) {
+	if (same_string(argv[i], "log"))
+	    flags |= FS_MKFS_LOG;
+	else if (same_string(argv[i], "dedup"))
+	    flags |= FS_MKFS_DEDUP;
+	else if (same_string(argv[i], "compress"))
+	    flags |= FS_MKFS_COMPRESS;
+	else if (same_string(argv[i], "checksum"))
+	    flags |= FS_MKFS_CHECKSUM;
+	else if (same_string(argv[i], "checksum-data"))
+	    flags |= FS_MKFS_CHECKSUM_DATA;
+	else {
+	    usage(" [log] [dedup] [compress] [checksum[-data]]");
+	    return;
+	}
+    }
+    if (fs_mkfs(flags) != 0)
 	writeStr("mkfs failed\n");
 }
 
+static void shell_fsck( void) {
+    int repairs;
+    csumStat status;
+    char s[10];
+
+    repairs = fs_fsck();
+    if (repairs == -1)
+	writeStr("Problem with checking file system\n");
+    else {
+	itoa(repairs, s);
+	writeStr("Repaired "); writeStr(s); writeStr(" problems\n");
+    }
+
+    /* file data that failed its checksum cannot be repaired */
+    if (fs_checksum_stat(&status, FALSE) == 0 && status.damaged > 0) {
+	itoa(status.damaged, s);
+	writeStr("Damaged blocks left: "); writeStr(s); writeChar(RETURN);
+    }
+}
+
 static void shell_create( void) {
     int fd, i;
     char letter[1];
@@ -230,6 +629,138 @@ static void shell_lseek( void) {
 	writeStr("OK\n");
 }
 
+static void shell_truncate( void) {
+    if (fs_truncate(atoi(argv[1]), atoi(argv[2])) == -1)
+	writeStr("Problem with truncating file\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_fallocate( void) {
+    if (fs_fallocate(atoi(argv[1]), atoi(argv[2]), atoi(argv[3])) == -1)
+	writeStr("Problem with allocating file space\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_lockf( void) {
+    int cmd;
+
+    if (same_string(argv[2], "ulock"))
+	cmd = FS_F_ULOCK;
+    else if (same_string(argv[2], "lock"))
+	cmd = FS_F_LOCK;
+    else if (same_string(argv[2], "tlock"))
+	cmd = FS_F_TLOCK;
+    else if (same_string(argv[2], "test"))
+	cmd = FS_F_TEST;
+    else
+	cmd = -1;
+
+    if (fs_lockf(atoi(argv[1]), cmd, atoi(argv[3])) == -1)
+	writeStr("Problem with locking file\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_advise( void) {
+    int advice;
+
+    if (same_string(argv[4], "normal"))
+	advice = FS_ADV_NORMAL;
+    else if (same_string(argv[4], "random"))
+	advice = FS_ADV_RANDOM;
+    else if (same_string(argv[4], "sequential"))
+	advice = FS_ADV_SEQUENTIAL;
+    else if (same_string(argv[4], "willneed"))
+	advice = FS_ADV_WILLNEED;
+    else if (same_string(argv[4], "dontneed"))
+	advice = FS_ADV_DONTNEED;
+    else
+	advice = -1;
+
+    if (fs_advise(atoi(argv[1]), atoi(argv[2]), atoi(argv[3]), advice) == -1)
+	writeStr("Problem with advising\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_pread( void) {
+    char data[SIZEX];
+    int i, n, count;
+
+    n = atoi( argv[2]);
+    if ( n > SIZEX) {
+	writeStr( "Requested size too big\n");
+	return;
+    }
+    if ( ( count = fs_pread(atoi(argv[1]), data, n, atoi(argv[3]))) == -1)
+	writeStr("Read failed\n");
+    else {
+	writeStr("Data read in : ");
+	for ( i = 0; i < count; i++)
+	    writeChar( data[i]);
+	writeChar( RETURN);
+    }
+}
+
+static void shell_pwrite( void) {
+    if ( fs_pwrite( atoi(argv[1]), argv[2], strlen(argv[2]),
+		    atoi(argv[3])) == -1)
+	writeStr("Error while writing file\n");
+    else
+	writeStr("Done\n");
+}
+
+static void shell_readv( void) {
+    char data[SIZEX];
+    iovec_t iov[MAX_IOV_COUNT];
+    int i, j, n, total, count;
+
+    // Carve one buffer per requested size out of data; a negative size
+    // takes no room and is left for fs_readv to reject
+    total = 0;
+    for ( i = 0; i < argc - 2; i++) {
+	n = atoi( argv[i + 2]);
+	if ( total + n > SIZEX) {
+	    writeStr( "Requested size too big\n");
+	    return;
+	}
+	iov[i].base = &data[total];
+	iov[i].len = n;
+	if ( n > 0)
+	    total += n;
+    }
+
+    if ( ( count = fs_readv(atoi(argv[1]), iov, argc - 2)) == -1)
+	writeStr("Read failed\n");
+    else {
+	// Print each buffer on its own line
+	for ( i = 0; i < argc - 2 && count > 0; i++) {
+	    writeStr("Data read in : ");
+	    for ( j = 0; j < iov[i].len && j < count; j++)
+		writeChar( iov[i].base[j]);
+	    writeChar( RETURN);
+	    count -= iov[i].len;
+	}
+    }
+}
+
+static void shell_writev( void) {
+    iovec_t iov[MAX_IOV_COUNT];
+    int i;
+
+    for ( i = 0; i < argc - 2; i++) {
+	iov[i].base = argv[i + 2];
+	iov[i].len = strlen( argv[i + 2]);
+    }
+
+    if ( fs_writev( atoi(argv[1]), iov, argc - 2) == -1)
+	writeStr("Error while writing file\n");
+    else
+	writeStr("Done\n");
+}
+
 static void shell_close( void) {
     if (fs_close(atoi(argv[1])) == -1)
 	writeStr("Problem with closing file\n");
@@ -237,6 +768,339 @@ static void shell_close( void) {
 	writeStr("OK\n");
 }
 
+static void shell_sync( void) {
+    if (fs_sync() == -1)
+	writeStr("Problem with syncing\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_fsync( void) {
+    if (fs_fsync(atoi(argv[1])) == -1)
+	writeStr("Problem with syncing file\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_fdatasync( void) {
+    if (fs_fdatasync(atoi(argv[1])) == -1)
+	writeStr("Problem with syncing file\n");
+    else
+	writeStr("OK\n");
+}
+
+static void shell_mount( void) {
+    int flags, blocks;
+    char s[10];
+
+    if (same_string(argv[1], "writeback"))
+	flags = FS_MOUNT_WRITE_BACK;
+    else if (same_string(argv[1], "writethrough"))
+	flags = FS_MOUNT_WRITE_THROUGH;
+    else
+	flags = -1;
+
+    if (argc == 3) {
+	if (same_string(argv[2], "preload") && flags != -1)
+	    flags |= FS_MOUNT_PRELOAD;
+	else
+	    flags = -1;
+    }
+
+    blocks = fs_mount(flags);
+    if (blocks == -1) {
+	writeStr("Problem with mounting\n");
+	return;
+    }
+    if (flags & FS_MOUNT_PRELOAD) {
+	itoa(blocks, s);
+	writeStr("Preloaded "); writeStr(s); writeStr(" metadata blocks\n");
+    }
+    writeStr("OK\n");
+}
+
+static void shell_dedup( void) {
+    dedupStat status;
+    char s[10];
+
+    if (fs_dedup_stat(&status) == -1) {
+	writeStr("Problem with dedup stats\n");
+	return;
+    }
+    itoa(status.blocksWritten, s);
+    writeStr("    Blocks written   : "); writeStr(s); writeChar(RETURN);
+    itoa(status.blocksShared, s);
+    writeStr("    Blocks shared    : "); writeStr(s); writeChar(RETURN);
+    itoa(status.blocksWritten == 0 ? 0 :
+	 status.blocksShared * 100 / status.blocksWritten, s);
+    writeStr("    Dedup ratio (%)  : "); writeStr(s); writeChar(RETURN);
+    itoa(status.indexProbes, s);
+    writeStr("    Index probes     : "); writeStr(s); writeChar(RETURN);
+    itoa(status.compareReads, s);
+    writeStr("    Compare reads    : "); writeStr(s); writeChar(RETURN);
+}
+
+static void print_overhead( char *name, int cycles, int readCycles) {
+    int permille;
+    char s[10];
+
+    /* checksum time as a share of the time to read the block */
+    permille = readCycles == 0 ? 0 : cycles * 1000 / readCycles;
+    writeStr(name);
+    itoa(permille / 10, s); writeStr(s); writeChar('.');
+    itoa(permille % 10, s); writeStr(s); writeStr("%\n");
+}
+
+static void shell_checksum( void) {
+    csumStat status;
+    int bench;
+    char s[10];
+
+    bench = argc == 2;
+    if (bench && !same_string(argv[1], "bench")) {
+	usage(" [bench]");
+	return;
+    }
+    if (fs_checksum_stat(&status, bench) == -1) {
+	writeStr("Problem with checksum stats\n");
+	return;
+    }
+    writeStr("    CRC32C using     : ");
+    writeStr(status.hardware ? "crc32 instruction\n" : "lookup table\n");
+    itoa(status.blocksSummed, s);
+    writeStr("    Blocks summed    : "); writeStr(s); writeChar(RETURN);
+    itoa(status.blocksVerified, s);
+    writeStr("    Blocks verified  : "); writeStr(s); writeChar(RETURN);
+    itoa(status.mismatches, s);
+    writeStr("    Mismatches       : "); writeStr(s); writeChar(RETURN);
+    itoa(status.damaged, s);
+    writeStr("    Damaged blocks   : "); writeStr(s); writeChar(RETURN);
+    if (!bench)
+	return;
+
+    itoa(status.hwCycles, s);
+    writeStr("    Cycles/block hw  : "); writeStr(s); writeChar(RETURN);
+    itoa(status.tableCycles, s);
+    writeStr("    Cycles/block sw  : "); writeStr(s); writeChar(RETURN);
+    itoa(status.readCycles, s);
+    writeStr("    Cycles/block read: "); writeStr(s); writeChar(RETURN);
+    if (status.hardware)
+	print_overhead("    Overhead hw      : ", status.hwCycles,
+		       status.readCycles);
+    print_overhead("    Overhead sw      : ", status.tableCycles,
+		   status.readCycles);
+}
+
+static void shell_locks( void) {
+    static char *names[FS_LOCK_CLASSES] = {
+	"txn      ", "namespace", "inode    ", "range    ",
+	"cluster  ", "fd       ", "alloc    ", "cache    "
+    };
+    lockStat status[FS_LOCK_CLASSES];
+    int i, times, reset;
+    char s[10];
+
+    times = argc == 2 && same_string(argv[1], "times");
+    reset = argc == 2 && same_string(argv[1], "reset");
+    if (argc == 2 && !times && !reset) {
+	usage(" [times|reset]");
+	return;
+    }
+    if (fs_lock_stat(status, reset) == -1) {
+	writeStr("Problem with lock stats\n");
+	return;
+    }
+    for (i = 0; i < FS_LOCK_CLASSES; i++) {
+	writeStr("    "); writeStr(names[i]); writeStr(": ");
+	itoa(status[i].acquires, s); writeStr(s);
+	writeStr(" acquired, ");
+	itoa(status[i].contended, s); writeStr(s);
+	writeStr(" contended");
+	/* times are in units of 1024 cycles */
+	if (times) {
+	    itoa(status[i].waitTime, s);
+	    writeStr(", wait "); writeStr(s);
+	    itoa(status[i].holdTime, s);
+	    writeStr(", held "); writeStr(s);
+	    itoa(status[i].maxHold, s);
+	    writeStr(", max "); writeStr(s);
+	}
+	writeChar(RETURN);
+    }
+}
+
+static void print_iostat( int reset) {
+    static char *names[FS_IO_CLASSES] = {
+	"mkfs     ", "fsck     ", "mount    ", "open     ",
+	"close    ", "dup      ", "read     ", "write    ",
+	"pread    ", "pwrite   ", "readv    ", "writev   ",
+	"lseek    ", "advise   ", "lockf    ", "truncate ",
+	"fallocate", "mkdir    ", "rmdir    ", "cd       ",
+	"link     ", "clone    ", "snapshot ", "unlink   ",
+	"stat     ", "ls       ", "sync     ", "fsync    ",
+	"fdatasync", "reclaim  ", "other    ", "device   "
+    };
+    static ioStat status[FS_IO_CLASSES];
+    int i;
+    char s[10];
+
+    if (fs_io_stat(status, reset) == -1) {
+	writeStr("Problem with I/O stats\n");
+	return;
+    }
+    for (i = 0; i < FS_IO_CLASSES; i++) {
+	/* calls that moved nothing are left out */
+	if (status[i].calls == 0 && status[i].blocksRead == 0 &&
+	    status[i].blocksWritten == 0)
+	    continue;
+	writeStr("    "); writeStr(names[i]); writeStr(": ");
+	itoa(status[i].calls, s); writeStr(s);
+	writeStr(i == FS_IO_DEVICE ? " transfers, " : " calls, ");
+	itoa(status[i].blocksRead, s); writeStr(s);
+	writeStr(" read, ");
+	itoa(status[i].blocksWritten, s); writeStr(s);
+	writeStr(" written");
+	if (i != FS_IO_DEVICE) {
+	    itoa(status[i].cacheHits, s);
+	    writeStr(", "); writeStr(s); writeStr(" hits, ");
+	    itoa(status[i].bytesCopied, s); writeStr(s);
+	    writeStr(" bytes");
+	}
+	writeChar(RETURN);
+    }
+}
+
+static void shell_iostat( void) {
+    int reset;
+
+    reset = argc == 2 && same_string(argv[1], "reset");
+    if (argc == 2 && !reset) {
+	usage(" [reset]");
+	return;
+    }
+    print_iostat(reset);
+}
+
+static void shell_trace( void) {
+    int n;
+    char s[10];
+
+    if (same_string(argv[1], "on")) {
+	fs_trace(TRUE);
+	writeStr("OK\n");
+    } else if (same_string(argv[1], "off")) {
+	n = fs_trace(FALSE);
+	itoa(n, s);
+	writeStr("Traced "); writeStr(s); writeStr(" block requests\n");
+    } else {
+	usage(" <on|off>");
+    }
+}
+
+// Ring of queued file system calls kept between commands. Each slot has
+// a buffer for the data, name or stat its entry uses until reaped
+#define RING_DATA 64
+
+static fs_ring_t ring;
+static struct {
+    char data[RING_DATA];
+    fileStat stat;
+} ring_bufs[FS_RING_ENTRIES];
+
+static void shell_queue( void) {
+    fs_sqe_t *sqe;
+    char *copy;
+    int slot;
+
+    // A slot stays in use until its completion is reaped
+    if (ring.sq_tail - ring.cq_head >= FS_RING_ENTRIES) {
+	writeStr("Ring full\n");
+	return;
+    }
+    slot = ring.sq_tail % FS_RING_ENTRIES;
+    sqe = &ring.sq[slot];
+    sqe->user = slot;
+    sqe->name = ring_bufs[slot].data;
+    sqe->buf = ring_bufs[slot].data;
+    sqe->len = 0;
+    copy = NULL;
+
+    if (same_string(argv[1], "read") && argc == 4) {
+	sqe->op = FS_RING_READ;
+	sqe->fd = atoi(argv[2]);
+	sqe->len = atoi(argv[3]);
+    } else if (same_string(argv[1], "write") && argc == 4) {
+	sqe->op = FS_RING_WRITE;
+	sqe->fd = atoi(argv[2]);
+	sqe->len = strlen(argv[3]);
+	copy = argv[3];
+    } else if (same_string(argv[1], "open") && argc == 4) {
+	sqe->op = FS_RING_OPEN;
+	sqe->len = atoi(argv[3]);
+	copy = argv[2];
+    } else if (same_string(argv[1], "stat") && argc == 3) {
+	sqe->op = FS_RING_STAT;
+	sqe->buf = (char *)&ring_bufs[slot].stat;
+	copy = argv[2];
+    } else if (same_string(argv[1], "close") && argc == 3) {
+	sqe->op = FS_RING_CLOSE;
+	sqe->fd = atoi(argv[2]);
+    } else {
+	writeStr("Unknown ring operation\n");
+	return;
+    }
+
+    // Data and names must outlive the command line, so keep a copy
+    if ((sqe->op == FS_RING_READ && sqe->len > RING_DATA) ||
+	(copy != NULL && strlen(copy) >= RING_DATA)) {
+	writeStr("Requested size too big\n");
+	return;
+    }
+    if (copy != NULL)
+	bcopy((unsigned char *)copy, (unsigned char *)ring_bufs[slot].data,
+	      strlen(copy) + 1);
+
+    ring.sq_tail++;
+    writeStr("Queued\n");
+}
+
+static void shell_submit( void) {
+    int count;
+    char s[10];
+
+    // One call runs every queued entry that has room to complete
+    if ((count = fs_ring_enter(&ring)) == -1)
+	writeStr("Problem with submitting\n");
+    else {
+	itoa(count, s);
+	writeStr("Submitted "); writeStr(s); writeChar(RETURN);
+    }
+}
+
+static void shell_reap( void) {
+    fs_cqe_t *cqe;
+    fs_sqe_t *sqe;
+    int i;
+    char s[10];
+
+    while (ring.cq_head != ring.cq_tail) {
+	cqe = &ring.cq[ring.cq_head % FS_RING_ENTRIES];
+	sqe = &ring.sq[cqe->user];
+	itoa(cqe->result, s);
+	writeStr("Completed "); writeStr(s);
+	if (sqe->op == FS_RING_READ && cqe->result > 0) {
+	    writeStr(" : ");
+	    for (i = 0; i < cqe->result; i++)
+		writeChar(sqe->buf[i]);
+	} else if (sqe->op == FS_RING_STAT && cqe->result == 0) {
+	    itoa(ring_bufs[cqe->user].stat.size, s);
+	    writeStr(" : size "); writeStr(s);
+	}
+	writeChar(RETURN);
+	ring.cq_head++;
+    }
+}
+
 static void shell_mkdir( void) {
     if (fs_mkdir( argv[1]) == -1)
 	writeStr("Problem with making directory\n");
@@ -317,6 +1181,18 @@ static void shell_link( void) {
 	writeStr("Problem with link\n");
 }
 
+static void shell_clone( void) {
+    if (fs_clone(argv[1], argv[2]) == -1)
+	writeStr("Problem with clone\n");
+}
+
+static void shell_snapshot( void) {
+    if (fs_snapshot(argv[1]) == -1)
+	writeStr("Problem with snapshot\n");
+    else
+	writeStr("OK\n");
+}
+
 static void shell_unlink( void) {
     if (fs_unlink(argv[1]) == -1)
 	writeStr("Problem with unlink\n");
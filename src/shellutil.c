@@ -69,6 +69,37 @@ writeStr( char *s) {
     }
 }
 
+int
+endOfInput( void) {
+    return FALSE;
+}
+
+int
+shellBatch( void) {
+    return FALSE;
+}
+
+uint64_t
+shellClock( void) {
+    return get_timer();
+}
+
+int
+shellElapsedUs( uint64_t since) {
+    static int mhz = 0;
+    uint64_t cycles = get_timer() - since;
+    uint32_t c;
+
+    if ( mhz == 0)
+	mhz = cpuspeed();
+
+    /* divide in 32 bits, in units of 256 cycles */
+    if ( ( cycles >> 40) != 0)
+	return 0x7fffffff;
+    c = cycles >> 8;
+    return c / mhz * 256 + ( c % mhz) * 256 / mhz;
+}
+
 void 
 writeInt( int i ) {
   char str[10];
@@ -18,4 +18,17 @@ void writeInt( int i );
 void clearShellScreen( void);
 void fire( void);
 
+/* Has the input run out? The keyboard never does */
+int endOfInput( void);
+/* Are commands read from a script rather than typed? */
+int shellBatch( void);
+/* Reading of a clock, and microseconds since such a reading */
+uint64_t shellClock( void);
+int shellElapsedUs( uint64_t since);
+
+#ifdef FAKE
+/* lnxsh [-b] [<script>]: run a script, or stdin with -b, in batch mode */
+void shellArgs( int ac, char **av);
+#endif
+
 #endif
@@ -1,4 +1,6 @@
 #include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
 #include "util.h"
 #include "common.h"
 #include "fs.h"
@@ -6,6 +8,9 @@
 
 int system ( const char *string );
 
+static FILE *input;
+static int batch, ended;
+
 void 
 shell_init( void) {
     fs_init();
@@ -28,13 +33,62 @@ fire( void) {
     writeStr( "   B A N G\n");
 }
 
+void
+shellArgs( int ac, char **av) {
+    input = stdin;
+    if ( ac > 1 && same_string( av[1], "-b")) {
+	batch = 1;
+	ac--;
+	av++;
+    }
+    if ( ac > 2) {
+	fprintf( stderr, "Usage: lnxsh [-b] [<script>]\n");
+	exit( 1);
+    }
+    if ( ac == 2) {
+	input = fopen( av[1], "r");
+	if ( input == NULL) {
+	    perror( av[1]);
+	    exit( 1);
+	}
+	batch = 1;
+    }
+}
+
 void
 readChar( int *c) {
-    *c = getchar();
+    *c = getc( input ? input : stdin);
+    if ( *c == EOF) {
+	ended = 1;
+	*c = RETURN;
+    }
     if ( *c == '\n')
 	*c = RETURN;
 }
 
+int
+endOfInput( void) {
+    return ended;
+}
+
+int
+shellBatch( void) {
+    return batch;
+}
+
+uint64_t
+shellClock( void) {
+    struct timeval now;
+
+    gettimeofday( &now, NULL);
+    return ( uint64_t)now.tv_sec * 1000000 + now.tv_usec;
+}
+
+int
+shellElapsedUs( uint64_t since) {
+    return shellClock() - since;
+}
+
 void
 writeStr( char *s) {
     while( *s != 0) {
@@ -9,20 +9,24 @@
 #include "syslib.h"
 #include "util.h"
 
-/*	1.	Place system call number (i) in eax, arg1 in ebx, arg2 in ecx and 
-		arg 3 in edx.
+/*	1.	Place system call number (i) in eax, arg1 in ebx, arg2 in ecx, 
+		arg 3 in edx and arg 4 in esi.
 	2.	Trigger interrupt 48 (system call).
 	3.	Return value is in eax after returning from interrupt.
 */
-static int invoke_syscall(int i, int arg1, int arg2, int arg3) {
+static int invoke_syscall4(int i, int arg1, int arg2, int arg3, int arg4) {
     int ret;
 
     asm volatile("int $48"   /* 48 = 0x30 */
 		  : "=a" (ret) 
-		  : "%0" (i), "b" (arg1), "c" (arg2), "d" (arg3));
+		  : "%0" (i), "b" (arg1), "c" (arg2), "d" (arg3), "S" (arg4));
     return ret;
 }
 
+static int invoke_syscall(int i, int arg1, int arg2, int arg3) {
+    return invoke_syscall4(i, arg1, arg2, arg3, IGNORE);
+}
+
 void yield(void) { 
     invoke_syscall(SYSCALL_YIELD, IGNORE, IGNORE, IGNORE); 
 }
@@ -73,8 +77,12 @@ int getchar(int *c) {
     return invoke_syscall(SYSCALL_GETCHAR, (int)c, IGNORE, IGNORE);
 }
 
-int fs_mkfs( void) {
-    return invoke_syscall( SYSCALL_MKFS, IGNORE, IGNORE, IGNORE); 
+int fs_mkfs( int flags) {
+    return invoke_syscall( SYSCALL_MKFS, flags, IGNORE, IGNORE); 
+}
+
+int fs_fsck( void) {
+    return invoke_syscall( SYSCALL_FSCK, IGNORE, IGNORE, IGNORE); 
 }
 
 int fs_open( char *filename, int flags) {
@@ -97,6 +105,78 @@ int fs_lseek( int fd, int offset) {
     return invoke_syscall( SYSCALL_LSEEK, fd, offset, IGNORE); 
 }
 
+int fs_truncate( int fd, int length) {
+    return invoke_syscall( SYSCALL_TRUNCATE, fd, length, IGNORE); 
+}
+
+int fs_fallocate( int fd, int offset, int length) {
+    return invoke_syscall( SYSCALL_FALLOCATE, fd, offset, length); 
+}
+
+int fs_lockf( int fd, int cmd, int len) {
+    return invoke_syscall( SYSCALL_LOCKF, fd, cmd, len); 
+}
+
+int fs_advise( int fd, int offset, int len, int advice) {
+    return invoke_syscall4( SYSCALL_ADVISE, fd, offset, len, advice); 
+}
+
+int fs_pread( int fd, char *buf, int count, int offset) {
+    return invoke_syscall4( SYSCALL_PREAD, fd, ( int)buf, count, offset); 
+}
+
+int fs_pwrite( int fd, char *buf, int count, int offset) {
+    return invoke_syscall4( SYSCALL_PWRITE, fd, ( int)buf, count, offset); 
+}
+
+int fs_readv( int fd, iovec_t *iov, int iovcnt) {
+    return invoke_syscall( SYSCALL_READV, fd, ( int)iov, iovcnt); 
+}
+
+int fs_writev( int fd, iovec_t *iov, int iovcnt) {
+    return invoke_syscall( SYSCALL_WRITEV, fd, ( int)iov, iovcnt); 
+}
+
+int fs_sync( void) {
+    return invoke_syscall( SYSCALL_SYNC, IGNORE, IGNORE, IGNORE); 
+}
+
+int fs_fsync( int fd) {
+    return invoke_syscall( SYSCALL_FSYNC, fd, IGNORE, IGNORE); 
+}
+
+int fs_fdatasync( int fd) {
+    return invoke_syscall( SYSCALL_FDATASYNC, fd, IGNORE, IGNORE); 
+}
+
+int fs_mount( int flags) {
+    return invoke_syscall( SYSCALL_MOUNT, flags, IGNORE, IGNORE); 
+}
+
+int fs_dedup_stat( dedupStat *buf) {
+    return invoke_syscall( SYSCALL_DEDUP_STAT, ( int)buf, IGNORE, IGNORE); 
+}
+
+int fs_checksum_stat( csumStat *buf, int bench) {
+    return invoke_syscall( SYSCALL_CHECKSUM_STAT, ( int)buf, bench, IGNORE); 
+}
+
+int fs_lock_stat( lockStat *buf, int reset) {
+    return invoke_syscall( SYSCALL_LOCK_STAT, ( int)buf, reset, IGNORE); 
+}
+
+int fs_io_stat( ioStat *buf, int reset) {
+    return invoke_syscall( SYSCALL_IO_STAT, ( int)buf, reset, IGNORE); 
+}
+
+int fs_trace( int on) {
+    return invoke_syscall( SYSCALL_TRACE, on, IGNORE, IGNORE); 
+}
+
+int fs_ring_enter( fs_ring_t *ring) {
+    return invoke_syscall( SYSCALL_RING_ENTER, ( int)ring, IGNORE, IGNORE); 
+}
+
 int fs_mkdir( char *fileName) {
     return invoke_syscall( SYSCALL_MKDIR, ( int)fileName, IGNORE, IGNORE); 
 }
@@ -113,6 +193,14 @@ int fs_link( char *pathName, char *fileName) {
     return invoke_syscall( SYSCALL_LINK, ( int)pathName, (int)fileName, IGNORE); 
 }
 
+int fs_clone( char *srcName, char *dstName) {
+    return invoke_syscall( SYSCALL_CLONE, ( int)srcName, ( int)dstName, IGNORE); 
+}
+
+int fs_snapshot( char *snapName) {
+    return invoke_syscall( SYSCALL_SNAPSHOT, ( int)snapName, IGNORE, IGNORE); 
+}
+
 int fs_unlink( char *fileName) {
     return invoke_syscall( SYSCALL_UNLINK, ( int)fileName, IGNORE, IGNORE); 
 }
@@ -129,6 +217,14 @@ void loadproc (int location, int size) {
     invoke_syscall (SYSCALL_LOADPROC, location, size, IGNORE);
 }
 
+void *mmap(int fd, int offset, int length) {
+    return (void *)invoke_syscall( SYSCALL_MMAP, fd, offset, length);
+}
+
+int munmap(void *addr) {
+    return invoke_syscall( SYSCALL_MUNMAP, ( int)addr, IGNORE, IGNORE);
+}
+
 void write_serial(int character)
 {
     invoke_syscall(SYSCALL_WRITE_SERIAL, (int)character, IGNORE, IGNORE);
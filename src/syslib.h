@@ -27,18 +27,41 @@ enum {
 	int		getchar(int *c);
 	void	readdir(unsigned char *buf);
 	void	loadproc(int location, int size);
+	void	*mmap(int fd, int offset, int length);
+	int		munmap(void *addr);
         void	write_serial(int character);
 
-int fs_mkfs( void);
+int fs_mkfs( int flags);
+int fs_fsck( void);
 int fs_open( char *filename, int flags);
 int fs_close( int fd);
 int fs_read( int fd, char *buf, int count);
 int fs_write( int fd, char *buf, int count);
 int fs_lseek( int fd, int offset);
+int fs_truncate( int fd, int length);
+int fs_fallocate( int fd, int offset, int length);
+int fs_lockf( int fd, int cmd, int len);
+int fs_advise( int fd, int offset, int len, int advice);
+int fs_pread( int fd, char *buf, int count, int offset);
+int fs_pwrite( int fd, char *buf, int count, int offset);
+int fs_readv( int fd, iovec_t *iov, int iovcnt);
+int fs_writev( int fd, iovec_t *iov, int iovcnt);
+int fs_sync( void);
+int fs_fsync( int fd);
+int fs_fdatasync( int fd);
+int fs_mount( int flags);
+int fs_dedup_stat( dedupStat *buf);
+int fs_checksum_stat( csumStat *buf, int bench);
+int fs_lock_stat( lockStat *buf, int reset);
+int fs_io_stat( ioStat *buf, int reset);
+int fs_trace( int on);
+int fs_ring_enter( fs_ring_t *ring);
 int fs_mkdir( char *fileName);
 int fs_rmdir( char *fileName);
 int fs_cd( char *pathName);
 int fs_link( char *pathName, char *fileName);
+int fs_clone( char *srcName, char *dstName);
+int fs_snapshot( char *snapName);
 int fs_unlink( char *fileName);
 int fs_stat( char *fileName, fileStat *buf);
 
@@ -12,6 +12,9 @@ void loader_thread(void);
 //	Runs indefinitely
 void clock_thread(void);
 
+//	Frees the blocks of unlinked files in the background
+void reclaim_thread(void);
+
 //	Threads to test the condition variables and locks
 void thread2(void);
 void thread3(void);
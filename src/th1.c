@@ -2,6 +2,7 @@
 
 	loader_thread is used to load the shell. 
 	clock_thread  is a thread which runs indefinitely
+	reclaim_thread frees the blocks of unlinked files
 	Best viewed with tabs set to 4 spaces.
 */
 #include "kernel.h"
@@ -9,8 +10,11 @@
 #include "th.h"
 #include "mbox.h"
 #include "util.h"
+#include "sleep.h"
+#include "fs.h"
 
 #define MHZ 2392 /* CPU clock rate */
+#define RECLAIM_MSECS 1000 /* Time between passes of reclaim_thread */
 
 /*	This thread is started to load the user shell, which is 
 	the first process in the directory.
@@ -49,3 +53,14 @@ void clock_thread(void) {
 		yield();
 	}
 }
+
+/*	This thread frees the blocks of files unlinked since its last pass,
+	so that unlink does not wait for them. The orphan list is kept on
+	disk, so a crash before a pass leaves nothing behind.
+*/
+void reclaim_thread(void) {
+	while (1) {
+		msleep(RECLAIM_MSECS);
+		fs_reclaim();
+	}
+}
@@ -85,6 +85,18 @@ void lock_release(lock_t *l) {
 	spinlock_release(&l->spinlock);
 }
 
+int lock_try_acquire(lock_t *l) {
+	int acquired = FALSE;
+
+	spinlock_acquire(&l->spinlock);
+	if (l->status == UNLOCKED) {
+		l->status = LOCKED;
+		acquired = TRUE;
+	}
+	spinlock_release(&l->spinlock);
+	return acquired;
+}
+
 //	condition functions
 
 void condition_init(condition_t *c) {
@@ -116,3 +128,79 @@ void condition_broadcast(condition_t *c) {
 	}
 	spinlock_release(&c->spinlock);
 }
+
+//	reader-writer lock functions
+
+void rwlock_init(rwlock_t *rw) {
+	lock_init(&rw->mutex);
+	condition_init(&rw->readable);
+	condition_init(&rw->writable);
+	rw->readers			= 0;
+	rw->writer			= FALSE;
+	rw->writers_waiting	= 0;
+}
+
+/*	Readers share the lock, but wait while a writer is inside or waiting,
+	so a stream of readers cannot starve writers
+*/
+void rwlock_acquire_read(rwlock_t *rw) {
+	lock_acquire(&rw->mutex);
+	while (rw->writer || rw->writers_waiting > 0)
+		condition_wait(&rw->mutex, &rw->readable);
+	rw->readers++;
+	lock_release(&rw->mutex);
+}
+
+void rwlock_release_read(rwlock_t *rw) {
+	lock_acquire(&rw->mutex);
+	ASSERT2(rw->readers > 0, "rwlock should be read locked");
+	if (--rw->readers == 0)
+		condition_signal(&rw->writable);
+	lock_release(&rw->mutex);
+}
+
+void rwlock_acquire_write(rwlock_t *rw) {
+	lock_acquire(&rw->mutex);
+	rw->writers_waiting++;
+	while (rw->writer || rw->readers > 0)
+		condition_wait(&rw->mutex, &rw->writable);
+	rw->writers_waiting--;
+	rw->writer = TRUE;
+	lock_release(&rw->mutex);
+}
+
+//	Hand the lock to the next writer if there is one, else to all readers
+void rwlock_release_write(rwlock_t *rw) {
+	lock_acquire(&rw->mutex);
+	ASSERT2(rw->writer, "rwlock should be write locked");
+	rw->writer = FALSE;
+	if (rw->writers_waiting > 0)
+		condition_signal(&rw->writable);
+	else
+		condition_broadcast(&rw->readable);
+	lock_release(&rw->mutex);
+}
+
+int rwlock_try_read(rwlock_t *rw) {
+	int acquired = FALSE;
+
+	lock_acquire(&rw->mutex);
+	if (!rw->writer && rw->writers_waiting == 0) {
+		rw->readers++;
+		acquired = TRUE;
+	}
+	lock_release(&rw->mutex);
+	return acquired;
+}
+
+int rwlock_try_write(rwlock_t *rw) {
+	int acquired = FALSE;
+
+	lock_acquire(&rw->mutex);
+	if (!rw->writer && rw->readers == 0) {
+		rw->writer = TRUE;
+		acquired = TRUE;
+	}
+	lock_release(&rw->mutex);
+	return acquired;
+}
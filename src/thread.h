@@ -27,6 +27,15 @@ typedef struct {
 	pcb_t	*waiting;	//	waiting queue
 } condition_t;
 
+typedef struct {
+	lock_t		mutex;		//	protects the fields below
+	condition_t	readable,	//	signalled when readers may enter
+				writable;	//	signalled when a writer may enter
+	int			readers,	//	readers inside
+				writer,		//	is a writer inside?
+				writers_waiting;	//	writers blocked; they go first
+} rwlock_t;
+
 
 //	Prototypes
 	//	Spinlock functions
@@ -38,6 +47,8 @@ typedef struct {
 	void lock_init(lock_t *);
 	void lock_acquire(lock_t *);
 	void lock_release(lock_t *);
+	//	Acquire l if it is free; never blocks. Returns TRUE on success
+	int lock_try_acquire(lock_t *l);
 
 	//	Initialize c
 	void condition_init(condition_t *c);
@@ -51,4 +62,14 @@ typedef struct {
 	//	Unblock all threads enqued on c
 	void condition_broadcast(condition_t *c);
 
+	//	Reader-writer lock functions. Waiting writers keep new readers out.
+	void rwlock_init(rwlock_t *rw);
+	void rwlock_acquire_read(rwlock_t *rw);
+	void rwlock_release_read(rwlock_t *rw);
+	void rwlock_acquire_write(rwlock_t *rw);
+	void rwlock_release_write(rwlock_t *rw);
+	//	As above but never block. Return TRUE if the lock was acquired
+	int rwlock_try_read(rwlock_t *rw);
+	int rwlock_try_write(rwlock_t *rw);
+
 #endif
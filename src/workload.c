@@ -0,0 +1,636 @@
+/*
+ * Workload generator for the file system, run against the fake block
+ * device.
+ *
+ * Usage: fsload [-m <mkfs flags>] [-s <seed>] [-w <warmup seconds>]
+ *               [-d <duration seconds>] [<personality> ...]
+ *
+ * A personality imitates one kind of server: it lays out a file set on a
+ * fresh file system, then runs a random mix of operations on it, first for
+ * the warmup, whose operations are not counted, and then for the duration.
+ * Each personality prints one JSON object per line: operations and bytes
+ * per second, latency percentiles in microseconds, device blocks read and
+ * written per operation, and the same for each kind of operation in its
+ * mix. An operation includes changing into the file's directory and back,
+ * since names are only looked up in the working directory. Runs with the
+ * same seed make the same sequence of choices. With no names every
+ * personality runs; a name selects those it prefixes.
+ */
+#include "common.h"
+#include "block.h"
+#include "fs.h"
+#include "util.h"
+#include "hostutil.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+
+// Latencies kept for each kind of operation; past this many, a random
+// sample of them is kept
+#define LOAD_MAX_SAMPLES (1 << 15)
+
+// Largest file the file system can hold, and the size of each read
+#define LOAD_FILE_MAX (INODE_ADDRS * BLOCK_SIZE)
+#define LOAD_READ_SIZE 1024
+
+// File sets. A directory holds at most 62 entries besides "." and ".."
+#define MAIL_BOXES 4
+#define MAIL_SLOTS 50
+#define SERVE_DIRS 4
+#define SERVE_FILES 30
+#define WEB_DIRS 2
+#define WEB_FILES 50
+#define WEB_HOT_FILES 10
+#define STORM_DIRS 4
+#define STORM_FILES 50
+
+// Room for the largest of the file sets
+#define LOAD_DIRS 4
+#define LOAD_FILES 50
+
+// Kinds of operation a personality's mix is made of
+enum {
+    KIND_CREATE,
+    KIND_APPEND,
+    KIND_READ,
+    KIND_WRITE,
+    KIND_STAT,
+    KIND_DELETE,
+    KIND_LIST,
+    KIND_MKDIR,
+    KIND_RMDIR,
+    KIND_COUNT
+};
+
+static const char *kind_names[KIND_COUNT] = {
+    "create", "append", "read", "write", "stat", "delete", "list", "mkdir",
+    "rmdir"
+};
+
+typedef struct {
+    int ops;
+    int errors;
+    long long bytes;
+    int samples;
+    uint64_t times[LOAD_MAX_SAMPLES];
+} kind_stat_t;
+
+typedef struct {
+    const char *name;
+    void (*setup)(void); // Lays out the file set before the warmup
+    void (*step)(void); // Runs one operation of the mix
+} personality_t;
+
+static int mkfs_flags;
+static uint32_t rand_state;
+
+static bool_t measuring;
+static int op_kind;
+static uint64_t op_start;
+static kind_stat_t kinds[KIND_COUNT];
+
+// Size of each file in the file set, -1 if it does not exist
+static int file_sizes[LOAD_DIRS][LOAD_FILES];
+static bool_t subdirs[LOAD_DIRS];
+
+static char data_buf[LOAD_FILE_MAX];
+
+/* Measurement ***************************************************************/
+
+static uint32_t load_rand(void) {
+    return xorshift32(&rand_state);
+}
+
+static int rand_between(int low, int high) {
+    return low + load_rand() % (high - low + 1);
+}
+
+static void op_begin(int kind) {
+    op_kind = kind;
+    op_start = now_ns();
+}
+
+static void op_end(int result, int bytes) {
+    kind_stat_t *k = &kinds[op_kind];
+    uint64_t elapsed = now_ns() - op_start;
+    int slot;
+
+    // Operations during the warmup are not counted
+    if (!measuring) {
+        return;
+    }
+    k->ops++;
+    if (result < 0) {
+        k->errors++;
+    } else {
+        k->bytes += bytes;
+    }
+
+    // Keep every latency until the array is full, then a uniform sample
+    if (k->samples < LOAD_MAX_SAMPLES) {
+        k->times[k->samples++] = elapsed;
+    } else {
+        slot = load_rand() % k->ops;
+        if (slot < LOAD_MAX_SAMPLES) {
+            k->times[slot] = elapsed;
+        }
+    }
+}
+
+static void print_latency(uint64_t *times, int count) {
+    sort_times(times, count);
+    printf("\"p50_us\":%.2f,\"p90_us\":%.2f,\"p99_us\":%.2f,\"max_us\":%.2f",
+           percentile_us(times, count, 50), percentile_us(times, count, 90),
+           percentile_us(times, count, 99), percentile_us(times, count, 100));
+}
+
+static void load_report(personality_t *p, double seconds, double warmup,
+                        int reads, int writes) {
+    static uint64_t all_times[KIND_COUNT * LOAD_MAX_SAMPLES];
+    int ops = 0, errors = 0, samples = 0;
+    long long bytes = 0;
+    int i;
+    int first = TRUE;
+
+    // Totals, with percentiles over the samples of every kind together
+    for (i = 0; i < KIND_COUNT; i++) {
+        ops += kinds[i].ops;
+        errors += kinds[i].errors;
+        bytes += kinds[i].bytes;
+        bcopy((unsigned char *)kinds[i].times,
+              (unsigned char *)&all_times[samples],
+              kinds[i].samples * sizeof(uint64_t));
+        samples += kinds[i].samples;
+    }
+    printf("{\"personality\":\"%s\",\"mkfs\":%d,\"warmup\":%.1f,"
+           "\"seconds\":%.3f,\"ops\":%d,\"errors\":%d,\"ops_per_sec\":%.1f,"
+           "\"mb_per_sec\":%.3f,",
+           p->name, mkfs_flags, warmup, seconds, ops, errors,
+           ops / seconds, bytes / seconds / (1 << 20));
+    print_latency(all_times, samples);
+    printf(",\"reads_per_op\":%.3f,\"writes_per_op\":%.3f,\"kinds\":{",
+           ops ? (double)reads / ops : 0.0, ops ? (double)writes / ops : 0.0);
+
+    // Then each kind of operation the mix ran
+    for (i = 0; i < KIND_COUNT; i++) {
+        if (kinds[i].ops == 0) {
+            continue;
+        }
+        printf("%s\"%s\":{\"ops\":%d,\"errors\":%d,\"ops_per_sec\":%.1f,",
+               first ? "" : ",", kind_names[i], kinds[i].ops,
+               kinds[i].errors, kinds[i].ops / seconds);
+        print_latency(kinds[i].times, kinds[i].samples);
+        printf("}");
+        first = FALSE;
+    }
+    printf("}}\n");
+    fflush(stdout);
+}
+
+/* File set ******************************************************************/
+
+static void dir_name(char *name, int dir) {
+    sprintf(name, "d%d", dir);
+}
+
+static void file_name(char *name, int file) {
+    sprintf(name, "f%d", file);
+}
+
+static int enter_dir(int dir) {
+    char name[MAX_FILE_NAME];
+
+    dir_name(name, dir);
+    return fs_cd(name);
+}
+
+static int pick_file(int dirs, int files, bool_t present, int *dir) {
+    int i, file;
+
+    // Probe from a random slot for one that is, or is not, in use
+    file = load_rand() % (dirs * files);
+    for (i = 0; i < dirs * files; i++) {
+        *dir = file / files;
+        if ((file_sizes[*dir][file % files] >= 0) == present) {
+            return file % files;
+        }
+        file = (file + 1) % (dirs * files);
+    }
+    return FAILURE;
+}
+
+static int write_file(int fd, int size) {
+    int written = 0;
+    int result;
+
+    while (written < size) {
+        result = fs_write(fd, data_buf + written, size - written);
+        if (result <= 0) {
+            return FAILURE;
+        }
+        written += result;
+    }
+    return written;
+}
+
+static void do_create(int dir, int file, int size, bool_t sync) {
+    char name[MAX_FILE_NAME];
+    int fd, result;
+
+    // Make a new file of the given size
+    op_begin(KIND_CREATE);
+    file_name(name, file);
+    result = enter_dir(dir);
+    fd = fs_open(name, FS_O_RDWR);
+    if (fd < 0) {
+        result = FAILURE;
+    } else {
+        if (write_file(fd, size) < 0 || (sync && fs_fsync(fd) < 0)) {
+            result = FAILURE;
+        }
+        fs_close(fd);
+    }
+    fs_cd("..");
+    op_end(result, size);
+    if (fd >= 0) {
+        file_sizes[dir][file] = size;
+    }
+}
+
+static void do_append(int dir, int file, int size, bool_t sync) {
+    char name[MAX_FILE_NAME];
+    int fd, result;
+
+    // Add to the end of an existing file, staying within the largest size
+    size = (file_sizes[dir][file] + size > LOAD_FILE_MAX)
+               ? LOAD_FILE_MAX - file_sizes[dir][file] : size;
+    op_begin(KIND_APPEND);
+    file_name(name, file);
+    result = enter_dir(dir);
+    fd = fs_open(name, FS_O_RDWR);
+    if (fd < 0 || fs_lseek(fd, file_sizes[dir][file]) < 0) {
+        result = FAILURE;
+    } else if (write_file(fd, size) < 0 || (sync && fs_fsync(fd) < 0)) {
+        result = FAILURE;
+    }
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+    fs_cd("..");
+    op_end(result, size);
+    if (result >= 0) {
+        file_sizes[dir][file] += size;
+    }
+}
+
+static void do_read(int dir, int file) {
+    char name[MAX_FILE_NAME];
+    int fd, result, count;
+    int total = 0;
+
+    // Read a whole file
+    op_begin(KIND_READ);
+    file_name(name, file);
+    result = enter_dir(dir);
+    fd = fs_open(name, FS_O_RDONLY);
+    if (fd < 0) {
+        result = FAILURE;
+    } else {
+        while ((count = fs_read(fd, data_buf, LOAD_READ_SIZE)) > 0) {
+            total += count;
+        }
+        if (count < 0) {
+            result = FAILURE;
+        }
+        fs_close(fd);
+    }
+    fs_cd("..");
+    op_end(result, total);
+}
+
+static void do_write(int dir, int file, int size) {
+    char name[MAX_FILE_NAME];
+    int fd, result;
+
+    // Replace the contents of an existing file
+    op_begin(KIND_WRITE);
+    file_name(name, file);
+    result = enter_dir(dir);
+    fd = fs_open(name, FS_O_RDWR);
+    if (fd < 0 || fs_truncate(fd, 0) < 0 || write_file(fd, size) < 0) {
+        result = FAILURE;
+    }
+    if (fd >= 0) {
+        fs_close(fd);
+    }
+    fs_cd("..");
+    op_end(result, size);
+    if (result >= 0) {
+        file_sizes[dir][file] = size;
+    }
+}
+
+static void do_stat(int dir, int file) {
+    char name[MAX_FILE_NAME];
+    fileStat st;
+    int result;
+
+    op_begin(KIND_STAT);
+    file_name(name, file);
+    result = enter_dir(dir);
+    result |= fs_stat(name, &st);
+    fs_cd("..");
+    op_end(result, 0);
+}
+
+static void do_delete(int dir, int file) {
+    char name[MAX_FILE_NAME];
+    int result;
+
+    op_begin(KIND_DELETE);
+    file_name(name, file);
+    result = enter_dir(dir);
+    result |= fs_unlink(name);
+    fs_cd("..");
+    op_end(result, 0);
+    file_sizes[dir][file] = -1;
+}
+
+static void do_list(int dir) {
+    char name[MAX_FILE_NAME + 1];
+    int i, result;
+
+    // Read every entry of a directory
+    op_begin(KIND_LIST);
+    result = enter_dir(dir);
+    for (i = 0; fs_ls_one(i, name) == SUCCESS; i++) {
+    }
+    fs_cd("..");
+    op_end(result, 0);
+}
+
+static void do_subdir(int dir) {
+    int result;
+
+    // Make or remove the directory's one subdirectory
+    op_begin(subdirs[dir] ? KIND_RMDIR : KIND_MKDIR);
+    result = enter_dir(dir);
+    result |= subdirs[dir] ? fs_rmdir("sub") : fs_mkdir("sub");
+    fs_cd("..");
+    op_end(result, 0);
+    subdirs[dir] = !subdirs[dir];
+}
+
+static void make_file_set(int dirs, int files, int present, int min_size,
+                          int max_size) {
+    char name[MAX_FILE_NAME];
+    int i, j;
+
+    // Every slot starts empty; the first present of each directory are
+    // filled in
+    for (i = 0; i < LOAD_DIRS; i++) {
+        subdirs[i] = FALSE;
+        for (j = 0; j < LOAD_FILES; j++) {
+            file_sizes[i][j] = -1;
+        }
+    }
+    for (i = 0; i < dirs; i++) {
+        dir_name(name, i);
+        fs_mkdir(name);
+        for (j = 0; j < present; j++) {
+            do_create(i, j, rand_between(min_size, max_size), FALSE);
+        }
+    }
+}
+
+/* Personalities *************************************************************/
+
+static void mail_setup(void) {
+    make_file_set(MAIL_BOXES, MAIL_SLOTS, MAIL_SLOTS / 2, 256, 1536);
+}
+
+static void mail_step(void) {
+    int dir, file;
+    int choice = load_rand() % 100;
+
+    // Deliver a message, which is synced before it is acknowledged; a
+    // full spool has one deleted instead
+    if (choice < 40) {
+        file = pick_file(MAIL_BOXES, MAIL_SLOTS, FALSE, &dir);
+        if (file >= 0) {
+            do_create(dir, file, rand_between(256, 1536), TRUE);
+            return;
+        }
+        choice = 99;
+    }
+
+    // Add to a message, read one or delete one; an empty spool has one
+    // delivered instead
+    file = pick_file(MAIL_BOXES, MAIL_SLOTS, TRUE, &dir);
+    if (file < 0) {
+        file = pick_file(MAIL_BOXES, MAIL_SLOTS, FALSE, &dir);
+        do_create(dir, file, rand_between(256, 1536), TRUE);
+    } else if (choice < 50) {
+        do_append(dir, file, rand_between(64, 512), TRUE);
+    } else if (choice < 80) {
+        do_read(dir, file);
+    } else {
+        do_delete(dir, file);
+    }
+}
+
+static void serve_setup(void) {
+    make_file_set(SERVE_DIRS, SERVE_FILES, SERVE_FILES * 2 / 3, 512,
+                  LOAD_FILE_MAX);
+}
+
+static void serve_step(void) {
+    int dir, file;
+    int choice = load_rand() % 100;
+
+    // Mostly whole-file reads and rewrites of files of mixed sizes
+    if (choice < 10 &&
+        (file = pick_file(SERVE_DIRS, SERVE_FILES, FALSE, &dir)) >= 0) {
+        do_create(dir, file, rand_between(512, LOAD_FILE_MAX), FALSE);
+    } else if (choice < 20 && (file = pick_file(SERVE_DIRS, SERVE_FILES,
+                                                TRUE, &dir)) >= 0) {
+        do_delete(dir, file);
+    } else if ((file = pick_file(SERVE_DIRS, SERVE_FILES, TRUE,
+                                 &dir)) < 0) {
+        file = pick_file(SERVE_DIRS, SERVE_FILES, FALSE, &dir);
+        do_create(dir, file, rand_between(512, LOAD_FILE_MAX), FALSE);
+    } else if (choice < 50) {
+        do_read(dir, file);
+    } else if (choice < 70) {
+        do_write(dir, file, rand_between(512, LOAD_FILE_MAX));
+    } else if (choice < 85) {
+        do_append(dir, file, rand_between(256, 2048), FALSE);
+    } else {
+        do_stat(dir, file);
+    }
+}
+
+static void web_setup(void) {
+    make_file_set(WEB_DIRS, WEB_FILES, WEB_FILES, 1024, LOAD_FILE_MAX);
+
+    // The access log is the last file of the first directory
+    do_write(0, WEB_FILES - 1, 0);
+}
+
+static void web_step(void) {
+    int file;
+    int choice = load_rand() % 100;
+
+    // Log one request in ten; the log starts over when it fills
+    if (choice < 10) {
+        if (file_sizes[0][WEB_FILES - 1] + 128 > LOAD_FILE_MAX) {
+            do_write(0, WEB_FILES - 1, 0);
+        } else {
+            do_append(0, WEB_FILES - 1, 128, FALSE);
+        }
+        return;
+    }
+
+    // Nine reads in ten go to the hot pages
+    if (load_rand() % 10 != 0) {
+        file = load_rand() % WEB_HOT_FILES;
+    } else {
+        file = load_rand() % (WEB_DIRS * WEB_FILES - 1);
+        file += (file >= WEB_FILES - 1);
+    }
+    do_read(file / WEB_FILES, file % WEB_FILES);
+}
+
+static void storm_setup(void) {
+    make_file_set(STORM_DIRS, STORM_FILES, STORM_FILES / 2, 0, 0);
+}
+
+static void storm_step(void) {
+    int dir, file;
+    int choice = load_rand() % 100;
+
+    // Empty files come and go, and are looked up and listed
+    if (choice < 30 &&
+        (file = pick_file(STORM_DIRS, STORM_FILES, FALSE, &dir)) >= 0) {
+        do_create(dir, file, 0, FALSE);
+    } else if (choice < 55 && (file = pick_file(STORM_DIRS, STORM_FILES,
+                                                TRUE, &dir)) >= 0) {
+        do_delete(dir, file);
+    } else if (choice < 85 && (file = pick_file(STORM_DIRS, STORM_FILES,
+                                                TRUE, &dir)) >= 0) {
+        do_stat(dir, file);
+    } else if (choice < 90) {
+        do_list(load_rand() % STORM_DIRS);
+    } else {
+        do_subdir(load_rand() % STORM_DIRS);
+    }
+}
+
+/* Driver ********************************************************************/
+
+static personality_t personalities[] = {
+    {"mail-server", mail_setup, mail_step},
+    {"file-server", serve_setup, serve_step},
+    {"web-server", web_setup, web_step},
+    {"metadata-storm", storm_setup, storm_step},
+};
+
+#define PERSONALITY_COUNT (sizeof(personalities) / sizeof(personalities[0]))
+
+static void load_run(personality_t *p, uint32_t seed, double warmup,
+                     double duration) {
+    uint64_t start, end;
+    int reads, writes;
+    int end_reads, end_writes;
+    int transfers;
+
+    // Lay out the file set on a fresh file system, uncounted
+    rand_state = seed;
+    measuring = FALSE;
+    fs_mkfs(mkfs_flags);
+    p->setup();
+    fs_sync();
+
+    // Warm the cache and the file set up, then count from a clean start
+    start = now_ns();
+    while (now_ns() - start < (uint64_t)(warmup * 1e9)) {
+        p->step();
+    }
+    fs_sync();
+    bzero((char *)kinds, sizeof(kinds));
+    measuring = TRUE;
+
+    block_counts(&reads, &writes, &transfers);
+    start = now_ns();
+    do {
+        p->step();
+        end = now_ns();
+    } while (end - start < (uint64_t)(duration * 1e9));
+
+    // Charge deferred journal and write-back traffic to the run
+    fs_sync();
+    end = now_ns();
+    block_counts(&end_reads, &end_writes, &transfers);
+    load_report(p, (end - start) / 1e9, warmup, end_reads - reads,
+                end_writes - writes);
+}
+
+int main(int argc, char **argv) {
+    int i, j;
+    int named = 0;
+    uint32_t seed = 318;
+    double warmup = 1.0;
+    double duration = 5.0;
+
+    // Parse options, leaving personality names in place
+    for (i = 1; i < argc; i++) {
+        if (argv[i][0] == '-' && i + 1 < argc && argv[i][1] != '\0' &&
+            argv[i][2] == '\0') {
+            switch (argv[i][1]) {
+            case 'm':
+                mkfs_flags = atoi(argv[i + 1]);
+                break;
+            case 's':
+                seed = atoi(argv[i + 1]);
+                break;
+            case 'w':
+                warmup = atof(argv[i + 1]);
+                break;
+            case 'd':
+                duration = atof(argv[i + 1]);
+                break;
+            default:
+                named++;
+                continue;
+            }
+            argv[i] = argv[i + 1] = NULL;
+            i++;
+        } else {
+            named++;
+        }
+    }
+    if (seed == 0) {
+        seed = 318;
+    }
+    if (duration <= 0) {
+        duration = 5.0;
+    }
+
+    // Files are written with the same pattern
+    for (i = 0; i < LOAD_FILE_MAX; i++) {
+        data_buf[i] = 'a' + i % 26;
+    }
+    fs_init();
+    for (j = 0; j < PERSONALITY_COUNT; j++) {
+        for (i = 1; i < argc; i++) {
+            if (argv[i] != NULL && prefix_of(argv[i], personalities[j].name)) {
+                break;
+            }
+        }
+        if (named == 0 || i < argc) {
+            load_run(&personalities[j], seed, warmup, duration);
+        }
+    }
+
+    return 0;
+}